@@ -20,10 +20,29 @@ ARG get_arg(std::vector<std::any> const& vec, std::true_type)
                                            : 0.0);
 }
 
+// Binary data is stored as `Bytes`, but functions may still ask for a
+// `std::vector<uint8_t>`, in which case they get a copy.
+template <int A>
+Bytes get_bytes_arg(std::vector<std::any> const& vec)
+{
+    if (A >= vec.size()) return {};
+    if (auto const* b = std::any_cast<Bytes>(&vec[A])) {
+        return *b;
+    }
+    return std::any_cast<std::vector<uint8_t>>(vec[A]);
+}
+
 template <int A, typename ARG>
-ARG get_arg(std::vector<std::any> const& vec)
+decltype(auto) get_arg(std::vector<std::any> const& vec)
 {
-    return get_arg<A, ARG>(vec, std::is_arithmetic<ARG>());
+    using T = std::decay_t<ARG>;
+    if constexpr (std::is_same_v<T, Bytes>) {
+        return get_bytes_arg<A>(vec);
+    } else if constexpr (std::is_same_v<T, std::vector<uint8_t>>) {
+        return get_bytes_arg<A>(vec).vector();
+    } else {
+        return get_arg<A, ARG>(vec, std::is_arithmetic<ARG>());
+    }
 }
 
 template <typename T>
@@ -41,7 +60,11 @@ std::any make_res(T&& v, std::false_type)
 template <typename T>
 std::any make_res(T&& v)
 {
-    return make_res(std::forward<T>(v), std::is_arithmetic<T>());
+    if constexpr (std::is_same_v<std::decay_t<T>, std::vector<uint8_t>>) {
+        return std::any(Bytes(std::forward<T>(v)));
+    } else {
+        return make_res(std::forward<T>(v), std::is_arithmetic<T>());
+    }
 }
 
 struct FunctionCaller
@@ -3,16 +3,24 @@
 #include "catch.hpp"
 
 #include "assembler.h"
+#include "coverage.h"
+#include "linker.h"
 #include "png.h"
+#include "profile.h"
+#include "test_cache.h"
 #include "test_utils.h"
 
 #include <coreutils/crc.h>
 
+#include "emulator.h"
 #include "machine.h"
+#include <chrono>
 #include <cmath>
 #include <fmt/color.h>
 #include <fmt/format.h>
 #include <string>
+#include <thread>
+#include <tuple>
 
 using namespace std::string_literals;
 
@@ -22,7 +30,7 @@ void printSymbols(Assembler& ass)
     ass.getSymbols().forAll([](std::string const& name, std::any const& val) {
         if (auto const* n = any_cast<Number>(&val)) {
             fmt::print("{} == 0x{:x}\n", name, static_cast<int>(*n));
-        } else if (auto const* v = any_cast<std::vector<uint8_t>>(&val)) {
+        } else if (auto const* v = any_cast<Bytes>(&val)) {
             fmt::print("{} == [{} bytes]\n", name, v->size());
         } else if (auto const* s = any_cast<std::string>(&val)) {
             fmt::print("{} == \"{}\"\n", name, *s);
@@ -260,6 +268,755 @@ print:
     REQUIRE(syms.at<Number>("print.skip") == 0xd);
 }
 
+TEST_CASE("assembler.strip", "[assembler]")
+{
+    Assembler ass;
+    auto& syms = ass.getSymbols();
+    auto& mach = ass.getMachine();
+    ass.setStripUnused(true);
+
+    ass.parse(R"(
+    !section "RAM", $801
+    !section "main", in="RAM"
+    !section "lib", in="RAM", Removable=true
+
+    !section "start", in="main" {
+        jsr used
+        rts
+    }
+    !section "unused", in="lib" {
+    unused:
+        jsr also_unused
+        rts
+    }
+    !section "used", in="lib" {
+    used:
+        jsr helper
+        rts
+    }
+    !section "also_unused", in="lib" {
+    also_unused:
+        !fill 100
+    }
+    !section "helper", in="lib" {
+    helper:
+        rts
+    }
+)");
+
+    REQUIRE(ass.getErrors().empty());
+    REQUIRE(mach.getSection("unused").stripped);
+    REQUIRE(mach.getSection("also_unused").stripped);
+    REQUIRE(!mach.getSection("used").stripped);
+    REQUIRE(syms.get<Number>("used") == 0x805);
+    REQUIRE(syms.get<Number>("helper") == 0x809);
+}
+
+TEST_CASE("assembler.fold", "[assembler]")
+{
+    Assembler ass;
+    auto& syms = ass.getSymbols();
+    auto& mach = ass.getMachine();
+    ass.setFoldData(true);
+
+    ass.parse(R"(
+    !section "RAM", $801
+    !section "main", in="RAM"
+    !section "rodata", in="RAM", ReadOnly=true
+
+    !section "start", in="main" {
+        lda hello
+        lda world
+        lda table2
+        rts
+    }
+    !section "hello", in="rodata" {
+    hello:
+        !byte 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 0
+    }
+    !section "world", in="rodata" {
+    world:
+        !byte 7, 8, 9, 10, 0
+    }
+    !section "table", in="rodata" {
+    table:
+        !byte $10, $20, $30, $40
+    }
+    !section "table2", in="rodata" {
+    table2:
+        !byte $10, $20, $30, $40
+    }
+)");
+
+    REQUIRE(ass.getErrors().empty());
+    REQUIRE(mach.getSection("world").foldedInto == "hello");
+    REQUIRE(mach.getSection("table2").foldedInto == "table");
+    REQUIRE(syms.get<Number>("hello") == 0x80b);
+    REQUIRE(syms.get<Number>("world") == 0x80b + 6);
+    REQUIRE(syms.get<Number>("table") == 0x80b + 11);
+    REQUIRE(syms.get<Number>("table2") == 0x80b + 11);
+    REQUIRE(mach.getSection("table").data.size() == 4);
+
+    // Data is not shared between banks or output files
+    Assembler banked;
+    banked.setFoldData(true);
+    banked.parse(R"(
+    !section "bank0", $8000
+    !section "bank1", $018000
+    !section "disk", in="bank0", ToFile=true
+    !section "a", in="bank0", ReadOnly=true {
+        !byte 1, 2, 3, 4
+    }
+    !section "b", in="bank1", ReadOnly=true {
+        !byte 1, 2, 3, 4
+    }
+    !section "c", in="disk", ReadOnly=true {
+        !byte 1, 2, 3, 4
+    }
+)");
+    REQUIRE(banked.getErrors().empty());
+    for (auto const* name : {"a", "b", "c"}) {
+        REQUIRE(banked.getMachine().getSection(name).foldedInto.empty());
+    }
+}
+
+TEST_CASE("assembler.link", "[assembler]")
+{
+    std::string header = R"(
+    !section "main", $801
+    !section "code", in="main"
+    !section "data", in="main"
+)";
+
+    Assembler first;
+    first.setObjectMode(true);
+    first.parse(header + R"(
+    !section "code"
+start:
+    jsr print
+    lda #<message
+loop:
+    dex
+    bne loop
+    jmp start
+)");
+    REQUIRE(first.getErrors().empty());
+
+    Assembler second;
+    second.setObjectMode(true);
+    second.parse(header + R"(
+    !section "code"
+print:
+    lda message
+    rts
+    !section "data"
+message:
+    !word message
+)");
+    REQUIRE(second.getErrors().empty());
+
+    Machine mach;
+    linkObjects({first.makeObject(), second.makeObject()}, mach);
+
+    auto const& code = mach.getSection("code");
+    REQUIRE(code.start == 0x801);
+    REQUIRE(code.data == std::vector<uint8_t>{0x20, 0x0c, 0x08, 0xa9, 0x10,
+                                              0xca, 0xd0, 0xfd, 0x4c, 0x01,
+                                              0x08, 0xad, 0x10, 0x08, 0x60});
+    auto const& data = mach.getSection("data");
+    REQUIRE(data.start == 0x810);
+    REQUIRE(data.data == std::vector<uint8_t>{0x10, 0x08});
+
+    Assembler third;
+    third.setObjectMode(true);
+    third.parse(header + R"(
+    !section "code"
+print:
+    rts
+)");
+    Machine other;
+    REQUIRE_THROWS_AS(
+        linkObjects({second.makeObject(), third.makeObject()}, other),
+        link_error);
+
+    // Object files referring outside their tables are rejected
+    auto broken = first.makeObject();
+    broken.relocs[0].target = 100;
+    Machine bad;
+    REQUIRE_THROWS_AS(linkObjects({broken}, bad), link_error);
+    broken = first.makeObject();
+    broken.relocs[0].kind = static_cast<RelocKind>(9);
+    REQUIRE_THROWS_AS(linkObjects({broken}, bad), link_error);
+    broken = first.makeObject();
+    broken.sections.resize(reloc::ImportBase + 1);
+    REQUIRE_THROWS_AS(linkObjects({broken}, bad), link_error);
+
+    // Section targets must stay below the imports
+    std::string many = header;
+    for (int i = 0; i <= reloc::ImportBase; i++) {
+        many += fmt::format("    !section \"s{}\", in=\"main\"\n", i);
+    }
+    Assembler fourth;
+    fourth.setObjectMode(true);
+    fourth.parse(many + "last:\n    !word last\n");
+    REQUIRE(fourth.getErrors().size() == 1);
+    REQUIRE(fourth.getErrors()[0].message ==
+            fmt::format("Object files can have at most {} sections",
+                        reloc::ImportBase));
+}
+
+TEST_CASE("assembler.link_expressions", "[assembler]")
+{
+    // Only a label plus or minus a number, and the difference between
+    // labels in the same section, can be relocated
+    auto assemble = [](std::string const& line) {
+        Assembler ass;
+        ass.setObjectMode(true);
+        ass.parse(R"(
+    !section "main", $801
+    !section "code", in="main"
+    !section "data", in="main"
+    !section "code"
+start:
+    )" + line + R"(
+end:
+    !section "data"
+msg:
+    !byte 0
+)");
+        return ass.getErrors();
+    };
+
+    for (auto const* line :
+         {"!word start/2", "!byte start&$ff", "lda #(start*2)&$ff",
+          "!word start*2", "!word start+start", "!word 2-start",
+          "!word -start", "!byte <(<start)", "!byte <start == 1"}) {
+        auto errors = assemble(line);
+        INFO(line);
+        REQUIRE(errors.size() == 1);
+        REQUIRE(errors[0].line == 7);
+        REQUIRE(errors[0].message == "Expression can not be relocated");
+    }
+    auto errors = assemble("lda #msg-start");
+    REQUIRE(errors.size() == 1);
+    REQUIRE(errors[0].message == "Difference between labels in different "
+                                 "sections can not be relocated");
+
+    Assembler ass;
+    ass.setObjectMode(true);
+    ass.parse(R"(
+    !section "main", $801
+    !section "code", in="main"
+    !section "data", in="main"
+    !section "code"
+start:
+    !word start+3, end-start
+    !byte <(start+1), >msg
+end:
+    !section "data"
+msg:
+    !byte 0
+)");
+    REQUIRE(ass.getErrors().empty());
+    Machine mach;
+    linkObjects({ass.makeObject()}, mach);
+    REQUIRE(mach.getSection("code").data ==
+            std::vector<uint8_t>{0x04, 0x08, 0x06, 0x00, 0x02, 0x08});
+}
+
+TEST_CASE("assembler.parallel", "[assembler]")
+{
+    // Assemblers must not share state, so they can run on separate threads
+    auto build = [](int i) {
+        bool even = i % 2 == 0;
+        Assembler ass;
+        ass.parse(fmt::format(R"(
+    !section "main", $1000
+    EVEN = {}
+    !encoding "{}"
+    !if EVEN {{
+        !byte 1
+    }} else {{
+        !byte 2
+    }}
+    !text "AB"
+    !test "inc" {{
+        lda #{}
+        clc
+        adc #1
+    }}
+)",
+                              even ? 1 : 0,
+                              even ? "ascii" : "screencode_upper", i));
+        auto data = ass.getMachine().getSection("main").data;
+        return std::make_pair(ass.getErrors().empty(), data);
+    };
+
+    std::vector<std::pair<bool, std::vector<uint8_t>>> results(8);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back([&, i] { results[i] = build(i); });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (int i = 0; i < 8; i++) {
+        REQUIRE(results[i].first);
+        REQUIRE(results[i] == build(i));
+        REQUIRE(results[i].second[0] == (i % 2 == 0 ? 1 : 2));
+        REQUIRE(results[i].second[1] == (i % 2 == 0 ? 'A' : 1));
+    }
+}
+
+TEST_CASE("assembler.parallel_tests", "[assembler]")
+{
+    std::string source = R"(
+    !section "main", $1000
+)";
+    for (int i = 0; i < 8; i++) {
+        source += fmt::format(R"(
+    !test "t{0}"
+    lda $80
+    clc
+    adc #{0}
+    sta $80
+    rts
+)",
+                              i);
+    }
+    source += R"(
+    !test "check"
+    lda #5
+    !check A == 5
+    rts
+)";
+    // Every test starts from the same memory, so none of them sees the
+    // value stored by another
+    for (unsigned threads : {1, 4}) {
+        Assembler ass;
+        ass.setTestThreads(threads);
+        ass.parse(source);
+        REQUIRE(ass.getErrors().empty());
+        auto& syms = ass.getSymbols();
+        for (int i = 0; i < 8; i++) {
+            auto prefix = fmt::format("tests.t{}.", i);
+            REQUIRE(syms.get<Number>(prefix + "A") == i);
+            REQUIRE(syms.get<Number>(prefix + "cycles") == 10);
+            auto const& ram = syms.get<Bytes>(prefix + "ram");
+            REQUIRE(ram[0x80] == i);
+            REQUIRE(ram[0x1000] == 0xa5);
+        }
+    }
+}
+
+TEST_CASE("assembler.test_cache", "[assembler]")
+{
+    // A cached result is used as long as the pages the test read and
+    // wrote are unchanged
+    auto dir = fs::temp_directory_path() / "bass_test_cache";
+    fs::remove_all(dir);
+    TestCache cache{dir};
+    std::vector<uint8_t> mem(0x10000);
+    auto image = std::make_shared<std::vector<uint8_t> const>(mem);
+    RunResult result;
+    result.cycles = 12;
+    result.base = image;
+    result.reads = {0x10};
+    result.pages.emplace_back(0x20, std::array<uint8_t, 256>{1});
+    cache.store("key", result);
+
+    REQUIRE(!cache.find("other", image));
+    mem[0x3000] = 1;
+    auto found = cache.find("key", std::make_shared<decltype(mem)>(mem));
+    REQUIRE(found);
+    REQUIRE(found->cycles == 12);
+    REQUIRE(found->ram()[0x2000] == 1);
+    mem[0x2001] = 1;
+    REQUIRE(!cache.find("key", std::make_shared<decltype(mem)>(mem)));
+    mem[0x2001] = 0;
+    mem[0x10ff] = 1;
+    REQUIRE(!cache.find("key", std::make_shared<decltype(mem)>(mem)));
+    fs::remove_all(dir);
+
+    // Changed data must invalidate results from earlier builds
+    for (int value : {3, 3, 7}) {
+        Assembler ass;
+        ass.useCache(true);
+        ass.setTestCache(dir);
+        ass.parse(fmt::format(R"(
+    !section "main", $1000
+    !test "t"
+    lda data
+    !check A > 0
+    rts
+data:
+    !byte {0}
+)",
+                              value));
+        REQUIRE(ass.getErrors().empty());
+        REQUIRE(ass.getSymbols().get<Number>("tests.t.A") == value);
+    }
+    REQUIRE(fs::exists(dir));
+
+    // Checks calling Lua functions depend on the script
+    for (int value : {5, 6}) {
+        Assembler ass;
+        ass.useCache(true);
+        ass.setTestCache(dir);
+        ass.parse(fmt::format(R"(
+%{{
+    function expected() return {} end
+}}%
+    !section "main", $1000
+    !test "t"
+    lda #5
+    !check A == expected()
+    rts
+)",
+                              value));
+        REQUIRE(ass.getErrors().empty() == (value == 5));
+    }
+    fs::remove_all(dir);
+}
+
+TEST_CASE("assembler.profile", "[assembler]")
+{
+    // Tests run with a profile count every instruction and call
+    sixfive::Profile profile;
+    Assembler ass;
+    ass.setProfile(&profile);
+    ass.parse(R"(
+    !section "main", $1000
+    !test "t"
+    ldx #5
+loop:
+    jsr add
+    dex
+    bne loop
+    rts
+add:
+    inc $20
+    rts
+)");
+    REQUIRE(ass.getErrors().empty());
+    REQUIRE(profile.counts[0x1000] == 1);
+    REQUIRE(profile.counts[0x1002] == 5);
+    auto add = profile.functions.at(0x1009);
+    REQUIRE(add.calls == 5);
+    REQUIRE(add.exclusive == 5 * (5 + 6));
+    REQUIRE(profile.functions.at(0x1000).inclusive == profile.total);
+    REQUIRE(ass.getLabels().at(0x1009) == "add");
+
+    auto file = fs::temp_directory_path() / "bass_profile.txt";
+    writeProfile(file.string(), profile, ass);
+    auto text = utils::File{file.string()}.readAllString();
+    REQUIRE(text.find("FLAT PROFILE") != std::string::npos);
+    REQUIRE(text.find("add") != std::string::npos);
+    fs::remove(file);
+
+    // Tests run on workers are counted too
+    profile.clear();
+    Assembler parallel;
+    parallel.setProfile(&profile);
+    parallel.setTestThreads(2);
+    parallel.parse(R"(
+    !section "main", $1000
+    !test "a"
+    jsr add
+    rts
+    !test "b"
+    jsr add
+    rts
+add:
+    inc $20
+    rts
+)");
+    REQUIRE(parallel.getErrors().empty());
+    REQUIRE(profile.counts[0x1008] == 2);
+    REQUIRE(profile.functions.at(0x1008).calls == 2);
+    REQUIRE(profile.functions.at(0x1000).calls == 1);
+    REQUIRE(profile.functions.at(0x1004).calls == 1);
+}
+
+TEST_CASE("assembler.bench", "[assembler]")
+{
+    // Each run gets its own inputs, and the slowest run is held against
+    // the budget. Runs count down X, then `count`, taking 23, 23, 23 and
+    // 25 cycles with the inputs paired up by run.
+    auto source = R"(
+    !section "zp", $20, NoStore=true
+count:
+    !byte 0
+    !section "main", $1000
+    !bench "loop", runs=4, X=[i -> i + 1], count=[3, 2, 1, 0], {}={}
+loop:
+    dex
+    bne loop
+    ldx count
+    beq done
+more:
+    dex
+    bne more
+done:
+    rts
+)";
+    Assembler ass;
+    ass.parse(fmt::format(source, "budget", 100));
+    REQUIRE(ass.getErrors().empty());
+    auto& syms = ass.getSymbols();
+    REQUIRE(syms.get<Number>("tests.loop.runs") == 4);
+    REQUIRE(syms.get<Number>("tests.loop.min") == 23);
+    REQUIRE(syms.get<Number>("tests.loop.max") == 25);
+    REQUIRE(syms.get<Number>("tests.loop.mean") == 23.5);
+
+    Assembler over;
+    REQUIRE(!over.parse(fmt::format(source, "budget", 24)));
+    REQUIRE(over.getErrors().size() == 1);
+    REQUIRE(over.getErrors()[0].line == 6);
+
+    // Misspelled arguments are not ignored
+    Assembler typo;
+    REQUIRE(!typo.parse(fmt::format(source, "budgte", 100)));
+    REQUIRE(typo.getErrors().size() == 1);
+    REQUIRE(typo.getErrors()[0].message.find("budgte") !=
+            std::string::npos);
+}
+
+TEST_CASE("assembler.coverage", "[assembler]")
+{
+    // Lines and branch directions not reached by any test are reported,
+    // the same whether tests run in order, on workers or from the cache
+    auto dir = fs::temp_directory_path() / "bass_coverage_cache";
+    fs::remove_all(dir);
+    // Runs in order, then stores results from workers, then finds them
+    for (int run = 0; run < 3; run++) {
+        sixfive::Coverage coverage;
+        Assembler ass;
+        ass.setCoverage(&coverage);
+        ass.setTestThreads(run == 1 ? 2 : 1);
+        ass.useCache(run > 0);
+        ass.setTestCache(dir);
+        ass.parse(R"(
+    !section "main", $1000
+    !test "a"
+    lda #1
+    jsr check
+    rts
+    !test "b"
+    lda #1
+    jsr check
+    rts
+check:
+    cmp #1
+    beq one
+    lda #0
+one:
+    rts
+)");
+        REQUIRE(ass.getErrors().empty());
+        REQUIRE(sixfive::Coverage::test(coverage.executed, 0x100c));
+        REQUIRE(sixfive::Coverage::test(coverage.taken, 0x100e));
+        REQUIRE(!sixfive::Coverage::test(coverage.notTaken, 0x100e));
+        REQUIRE(!sixfive::Coverage::test(coverage.executed, 0x1010));
+
+        auto file = fs::temp_directory_path() / "bass_coverage.info";
+        writeCoverage(file.string(), coverage, ass);
+        auto text = utils::File{file.string()}.readAllString();
+        REQUIRE(text.find("DA:13,1\n") != std::string::npos);
+        REQUIRE(text.find("DA:14,0\n") != std::string::npos);
+        REQUIRE(text.find("BRDA:13,0,0,1\nBRDA:13,0,1,0\n") !=
+                std::string::npos);
+        REQUIRE(text.find("LF:10\nLH:9\n") != std::string::npos);
+        fs::remove(file);
+    }
+    fs::remove_all(dir);
+}
+
+TEST_CASE("machine.instances", "[machine]")
+{
+    // Run one machine to completion, then check that another one still
+    // sees its own intercept at the same address
+    int hits = 0;
+    auto second = std::make_unique<Machine>();
+    {
+        Machine first;
+        first.writeRam(0x1000, 0x60); // rts
+        first.go(0x1000);
+    }
+    second->writeRam(0x1000, 0x60);
+    second->addIntercept(0x1000, [&](uint32_t) {
+        hits++;
+        return true;
+    });
+    second->go(0x1000);
+    REQUIRE(hits == 1);
+
+    Machine third;
+    third.writeRam(0x1000, 0x60);
+    third.go(0x1000);
+    REQUIRE(hits == 1);
+}
+
+TEST_CASE("machine.intercepts", "[machine]")
+{
+    // 256 * 256 turns of an inner loop, then return
+    std::vector<uint8_t> code{
+        0xa0, 0x00, // ldy #0
+        0xa2, 0x00, // ldx #0
+        0xe8,       // inx
+        0xd0, 0xfd, // bne $1004
+        0xc8,       // iny
+        0xd0, 0xf8, // bne $1002
+        0x60        // rts
+    };
+    auto run = [&](Machine& m) {
+        for (size_t i = 0; i < code.size(); i++) {
+            m.writeRam(0x1000 + i, code[i]);
+        }
+        return m.go(0x1000);
+    };
+
+    Machine plain;
+    auto cycles = run(plain);
+    REQUIRE(cycles > 256 * 256 * 5);
+
+    // Intercepts on other pages are never called, and do not change timing
+    Machine other;
+    int hits = 0;
+    other.addIntercept(0x2000, [&](uint32_t) { return ++hits > 0; });
+    REQUIRE(run(other) == cycles);
+    REQUIRE(hits == 0);
+
+    int inner = 0;
+    other.addIntercept(0x1007, [&](uint32_t) {
+        inner++;
+        return false;
+    });
+    REQUIRE(run(other) == cycles);
+    REQUIRE(inner == 256);
+    REQUIRE(hits == 0);
+}
+
+TEST_CASE("machine.watch", "[machine]")
+{
+    std::vector<uint8_t> code{
+        0xa2, 0x03,       // ldx #3
+        0x8e, 0x00, 0x20, // stx $2000
+        0xad, 0x01, 0x20, // lda $2001
+        0xca,             // dex
+        0xd0, 0xf7,       // bne $1002
+        0x60              // rts
+    };
+    Machine m;
+    for (size_t i = 0; i < code.size(); i++) {
+        m.writeRam(0x1000 + i, code[i]);
+    }
+    auto cycles = m.go(0x1000);
+
+    // Only watched addresses are reported, and timing is unchanged
+    std::vector<std::tuple<uint16_t, uint8_t, int>> hits;
+    m.setWatchFunction([&](uint16_t adr, uint8_t value, int kind) {
+        hits.emplace_back(adr, value, kind);
+    });
+    m.addWatch(0x2000, 0x2001, sixfive::WatchWrite);
+    m.addWatch(0x1008, 0x1009, sixfive::WatchExec);
+    REQUIRE(m.go(0x1000) == cycles);
+    REQUIRE(hits.size() == 6);
+    REQUIRE(hits[0] == std::tuple(0x2000, 3, sixfive::WatchWrite));
+    REQUIRE(hits[1] == std::tuple(0x1008, 0xca, sixfive::WatchExec));
+    REQUIRE(hits[4] == std::tuple(0x2000, 1, sixfive::WatchWrite));
+
+    // Watched pages still go to their bank functions
+    int banked = 0;
+    m.setBankRead(0x20, 1, [&](uint16_t) { return ++banked; });
+    m.addWatch(0x2001, 0x2002, sixfive::WatchRead);
+    hits.clear();
+    m.go(0x1000);
+    REQUIRE(banked == 3);
+    REQUIRE(hits[1] == std::tuple(0x2001, 1, sixfive::WatchRead));
+
+    // After clearing, the last instructions are still remembered
+    m.clear();
+    hits.clear();
+    m.setHistory(4);
+    m.go(0x1000);
+    REQUIRE(hits.empty());
+    auto history = m.getHistory();
+    REQUIRE(history.size() == 4);
+    REQUIRE(history[0][5] == 0x1005);
+    REQUIRE(history[1][5] == 0x1008);
+    REQUIRE(history[1][1] == 1);
+    REQUIRE(history[3][5] == 0x100b);
+
+    // Stack accesses are watched too
+    std::vector<uint8_t> push{
+        0xa9, 0x07, // lda #7
+        0x48,       // pha
+        0x68,       // pla
+        0x60        // rts
+    };
+    for (size_t i = 0; i < push.size(); i++) {
+        m.writeRam(0x1100 + i, push[i]);
+    }
+    m.setHistory(0);
+    m.addWatch(0x1ff, 0x200, sixfive::WatchRead | sixfive::WatchWrite);
+    m.go(0x1100);
+    REQUIRE(hits.size() == 2);
+    REQUIRE(hits[0] == std::tuple(0x1ff, 7, sixfive::WatchWrite));
+    REQUIRE(hits[1] == std::tuple(0x1ff, 7, sixfive::WatchRead));
+}
+
+TEST_CASE("assembler.failed_run", "[assembler]")
+{
+    // A failed test with side effects is not run again to print its last
+    // instructions
+    std::string out;
+    outputBuffer = &out;
+    Assembler ass;
+    ass.parse(R"(
+    !section "main", $1000
+    !test "t"
+    lda #1
+    !run {: fmt("ran") :}
+    !check A == 2
+    rts
+)");
+    outputBuffer = nullptr;
+    REQUIRE(ass.getErrors().size() == 1);
+    REQUIRE(out.find("ran\nLast instructions:\n  1000  lda #$01") !=
+            std::string::npos);
+    REQUIRE(out.find("ran", out.find("ran") + 1) == std::string::npos);
+}
+
+TEST_CASE("machine.intercepts_benchmark", "[.][benchmark]")
+{
+    std::vector<uint8_t> code{0xa0, 0x00, 0xa2, 0x00, 0xe8, 0xd0,
+                              0xfd, 0xc8, 0xd0, 0xf8, 0x60};
+    auto mhz = [&](Machine& m) {
+        for (size_t i = 0; i < code.size(); i++) {
+            m.writeRam(0x1000 + i, code[i]);
+        }
+        uint64_t cycles = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < 200; i++) {
+            cycles += m.go(0x1000);
+        }
+        std::chrono::duration<double, std::micro> us =
+            std::chrono::steady_clock::now() - start;
+        return cycles / us.count();
+    };
+    for (int i = 0; i < 3; i++) {
+        Machine none;
+        Machine otherPage;
+        otherPage.addIntercept(0x2000, [](uint32_t) { return false; });
+        Machine samePage;
+        samePage.addIntercept(0x10ff, [](uint32_t) { return false; });
+        fmt::print("No intercepts:         {:.1f} MHz\n", mhz(none));
+        fmt::print("Intercept, other page: {:.1f} MHz\n", mhz(otherPage));
+        fmt::print("Intercept, same page:  {:.1f} MHz\n", mhz(samePage));
+    }
+}
+
 TEST_CASE("assembler.sine_table", "[assembler]")
 {
     using std::any_cast;
@@ -341,3 +1098,56 @@ TEST_CASE("assembler.functions", "[assembler]")
     REQUIRE(ass.getMachine().getSection("main").data[1] == 0xf);
     REQUIRE(ass.getMachine().getSection("main").data[3] == 66);
 }
+
+TEST_CASE("assembler.include_cache", "[assembler]")
+{
+    // An include is cached as the second parse of its assembler, and must
+    // load the same when it is later parsed first, as a main file
+    auto dir = fs::temp_directory_path() / "bass_include_cache";
+    fs::create_directories(dir);
+    auto unique = fs::file_time_type::clock::now().time_since_epoch().count();
+    utils::File{(dir / "inc.asm").string(), utils::File::Mode::Write}
+        .writeString(fmt::format("; {}\n"
+                                 "    !section \"main\", $1000\n"
+                                 "    !byte 1, 2, 3\n",
+                                 unique));
+    utils::File{(dir / "main.asm").string(), utils::File::Mode::Write}
+        .writeString("    !include \"inc.asm\"\n");
+
+    for (auto const* name : {"main.asm", "inc.asm", "main.asm"}) {
+        Assembler ass;
+        REQUIRE(ass.parse_path(dir / name));
+        REQUIRE(ass.getErrors().empty());
+        std::vector<uint8_t> data{1, 2, 3};
+        REQUIRE(ass.getMachine().getSection("main").data == data);
+    }
+    fs::remove_all(dir);
+}
+
+TEST_CASE("assembler.rebuild", "[assembler]")
+{
+    // Rebuilding with the same assembler must see the new source, whether
+    // the sources are mapped or read
+    auto dir = fs::temp_directory_path() / "bass_rebuild";
+    fs::create_directories(dir);
+    auto path = dir / "main.asm";
+    auto write = [&](std::string const& data) {
+        utils::File{path.string(), utils::File::Mode::Write}.writeString(
+            "    !section \"main\", $1000\n    !byte " + data + "\n");
+    };
+
+    for (bool map : {true, false}) {
+        Assembler ass;
+        ass.useCache(false);
+        ass.setMapSources(map);
+        write("1, 2, 3, 4, 5, 6");
+        REQUIRE(ass.parse_path(path));
+        write("7");
+        ass.clear();
+        REQUIRE(ass.parse_path(path));
+        REQUIRE(ass.getErrors().empty());
+        REQUIRE(ass.getMachine().getSection("main").data ==
+                std::vector<uint8_t>{7});
+    }
+    fs::remove_all(dir);
+}
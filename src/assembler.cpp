@@ -1,8 +1,10 @@
 #include "assembler.h"
 #include "chars.h"
 #include "defines.h"
+#include "emulator.h"
 #include "machine.h"
 #include "parser.h"
+#include "test_cache.h"
 
 #ifndef _WIN32
 #    include <cxxabi.h>
@@ -14,15 +16,23 @@
 #include <coreutils/text.h>
 #include <coreutils/utf8.h>
 
+#include <algorithm>
+#include <atomic>
 #include <charconv>
 #include <fmt/format.h>
+#include <functional>
+#include <map>
 #include <string_view>
+#include <thread>
 #include <unordered_set>
 extern char const* const grammar6502;
 
 using namespace std::string_literals;
 using sixfive::Mode;
 
+// Instructions printed when a test fails
+static constexpr unsigned HistorySize = 16;
+
 // OpenBSD
 #ifdef _N
 #    undef _N
@@ -58,7 +68,7 @@ std::string any_to_string(std::any const& val)
         if (*n == in) return fmt::format("${:x}", in);
         return fmt::format("{}", *n);
     }
-    if (auto const* v = std::any_cast<std::vector<uint8_t>>(&val)) {
+    if (auto const* v = std::any_cast<Bytes>(&val)) {
         std::string res = "[ ";
         int i = 0;
         for (auto const& b : *v) {
@@ -101,8 +111,8 @@ std::string_view rstrip(std::string_view text)
     return text;
 }
 
-template <typename T>
-std::any Assembler::slice(std::vector<T> const& v, int64_t a, int64_t b)
+template <typename C>
+std::any Assembler::slice(C const& v, int64_t a, int64_t b)
 {
     if (b < 0) {
         b = v.size() + b + 1;
@@ -114,12 +124,15 @@ std::any Assembler::slice(std::vector<T> const& v, int64_t a, int64_t b)
         return any_num(0);
     }
 
-    std::vector<T> nv(v.begin() + a, v.begin() + b);
-    return std::any(nv);
+    if constexpr (std::is_same_v<C, Bytes>) {
+        return std::any(v.slice(a, b));
+    } else {
+        return std::any(C(v.begin() + a, v.begin() + b));
+    }
 }
 
-template <typename T>
-std::any Assembler::index(std::vector<T> const& v, int64_t index)
+template <typename C>
+std::any Assembler::index(C const& v, int64_t index)
 {
     if (index >= static_cast<int64_t>(v.size())) {
         if (isFinalPass()) {
@@ -161,10 +174,7 @@ Assembler::Block Assembler::includeFile(std::string_view name)
         return it->second;
     }
 
-    utils::File f{fn};
-    stored_includes.push_back(f.readAllString());
-
-    std::string_view source = stored_includes.back();
+    auto source = mapFile(fn);
     auto ast = parser.parse(source, name);
     if (ast == nullptr) {
         throw parse_error("");
@@ -176,6 +186,29 @@ Assembler::Block Assembler::includeFile(std::string_view name)
     return includes.at(fn);
 }
 
+// Binary files are only read once per build, and all users share the data
+Bytes Assembler::loadFile(fs::path const& p)
+{
+    auto fn = p.string();
+    auto it = binaries.find(fn);
+    if (it != binaries.end()) {
+        return it->second;
+    }
+    utils::File f{fn};
+    Bytes data = f.readAll();
+    binaries[fn] = data;
+    return data;
+}
+
+std::string_view Assembler::mapFile(std::string const& fileName)
+{
+    auto& source = sources[fileName];
+    if (source == nullptr) {
+        source = std::make_unique<MappedFile>(fileName, mapSources);
+    }
+    return source->view();
+}
+
 void Assembler::evaluateBlock(Block const& block)
 {
     parser.evaluate(block.node);
@@ -211,38 +244,343 @@ void Assembler::addTest(std::string name, uint32_t start, RegState const& regs)
     }
 }
 
-void Assembler::runTest(Test const& test)
+void Assembler::addBench(Bench bench)
 {
-    using sixfive::Reg;
-    AnyMap res;
+    if (passNo == 0) {
+        AnyMap res = {{"cycles", num(0)}, {"min", num(0)}, {"max", num(0)},
+                      {"mean", num(0)},   {"runs", num(0)}};
+        syms.set("tests."s + bench.name, res);
+    }
+    benches.push_back(std::move(bench));
+}
+
+// Append the value of a symbol to the inputs of a test
+static void addValue(std::string& inputs, std::any const& val)
+{
+    if (auto const* n = std::any_cast<Number>(&val)) {
+        inputs.append(reinterpret_cast<char const*>(n), sizeof(Number));
+    } else if (auto const* v = std::any_cast<Bytes>(&val)) {
+        inputs.append(reinterpret_cast<char const*>(v->data()), v->size());
+    } else if (auto const* sv = std::any_cast<std::string_view>(&val)) {
+        inputs.append(*sv);
+    } else if (auto const* str = std::any_cast<std::string>(&val)) {
+        inputs.append(*str);
+    } else {
+        inputs.append(val.type().name());
+    }
+    inputs.push_back(0);
+}
 
-    auto start = test.start;
+// Everything except memory and registers that the outcome of tests depends
+// on; the CPU, and all checks along with the symbols they refer to
+std::string Assembler::testInputs() const
+{
+    std::string inputs = mach->is65C02() ? "65c02" : "6502";
+    // Checks may call Lua functions
+    inputs += "\n" + scripting.getSources();
+    std::map<int32_t, std::vector<EmuAction>> sorted(actions.begin(),
+                                                     actions.end());
+    for (auto const& [pc, list] : sorted) {
+        for (auto const& a : list) {
+            auto text = std::get<Check>(a.action).expression.contents;
+            inputs += fmt::format("\n{:x} {}\n", pc, text);
+            // Values of all symbols named in the expression, and all
+            // symbols below them
+            auto isName = [&](size_t i, bool first) {
+                if (i >= text.size()) return false;
+                auto c = static_cast<unsigned char>(text[i]);
+                return isalpha(c) || c == '_' ||
+                       (!first && (isdigit(c) || c == '.'));
+            };
+            size_t i = 0;
+            while (i < text.size()) {
+                if (!isName(i, true)) {
+                    i++;
+                    continue;
+                }
+                auto start = i;
+                while (isName(i, false)) {
+                    i++;
+                }
+                auto name = std::string(text.substr(start, i - start));
+                std::map<std::string, std::any> values;
+                syms.forAll([&](std::string const& n, std::any const& v) {
+                    if (n == name || n.rfind(name + ".", 0) == 0) {
+                        values[n] = v;
+                    }
+                });
+                for (auto const& [n, v] : values) {
+                    inputs += n;
+                    inputs.push_back(0);
+                    addValue(inputs, v);
+                }
+            }
+        }
+    }
+    return inputs;
+}
+
+// Run all tests, each starting from the same memory image. Unless tests
+// have side effects (logging, scripts or bank functions), they are spread
+// over several emulators running in parallel, and their results are kept
+// between builds. Results are always reported in source order.
+void Assembler::runTests()
+{
+    mach->runSetup();
+    auto image = mach->snapshot();
+
+    bool onlyChecks = std::all_of(actions.begin(), actions.end(), [](auto& a) {
+        return std::all_of(a.second.begin(), a.second.end(), [](auto& ea) {
+            return std::holds_alternative<Check>(ea.action);
+        });
+    });
+    bool pure = onlyChecks && !mach->hasBankFunctions() && !mach->hasWatches();
+    replayTests = pure;
+
+    // Tests that ran before from the same inputs do not have to run again
+    std::vector<std::optional<RunResult>> results(tests.size());
+    std::vector<std::string> keys;
+    TestCache cache{testCacheDir};
+    if (profile != nullptr) {
+        profile->clear();
+    }
+    if (coverage != nullptr) {
+        coverage->clear();
+    }
+    if (pure && cacheTests && profile == nullptr) {
+        auto common = testInputs();
+        // Results stored without coverage can not add to it
+        if (coverage != nullptr) {
+            common += "\ncoverage";
+        }
+        for (size_t i = 0; i < tests.size(); i++) {
+            auto const& test = tests[i];
+            auto inputs = common;
+            auto const& r = test.regs.regs;
+            inputs += fmt::format("\n{:x} {} {} {}", test.start, r[0], r[1],
+                                  r[2]);
+            std::map<uint16_t, uint8_t> pokes(test.regs.ram.begin(),
+                                              test.regs.ram.end());
+            for (auto const& [adr, val] : pokes) {
+                inputs += fmt::format(" {:x}:{:x}", adr, val);
+            }
+            keys.push_back(TestCache::makeKey(inputs));
+            results[i] = cache.find(keys.back(), image);
+        }
+    }
+    std::vector<bool> cached(tests.size());
+    for (size_t i = 0; i < tests.size(); i++) {
+        cached[i] = results[i].has_value();
+        if (cached[i] && coverage != nullptr) {
+            coverage->add(results[i]->covered);
+        }
+    }
+    auto left = static_cast<unsigned>(
+        std::count(cached.begin(), cached.end(), false));
+
+    unsigned threads = testThreads != 0 ? testThreads
+                                        : std::thread::hardware_concurrency();
+    threads = std::min(threads, left);
+    auto errorCount = errors.size();
+    if (threads > 1 && pure && !runTestsParallel(image, threads, results)) {
+        // Failed checks should be reported exactly as when running in order
+        errors.resize(errorCount);
+    }
+
+    for (size_t i = 0; i < tests.size(); i++) {
+        auto const& test = tests[i];
+        printOut("Running code at ${:x}\n", test.start);
+        if (!results[i]) {
+            results[i] = runTest(image, test.regs, test.start);
+        } else if (!results[i]->ended) {
+            // Ran on a worker
+            printOut("Code at ${:x} did not end\n", test.start);
+            printHistory(image, test.regs, test.start);
+        }
+        reportTest(test, *results[i]);
+        if (!keys.empty() && !cached[i]) {
+            cache.store(keys[i], *results[i]);
+        }
+    }
+    runBenches(image);
+}
+
+// Run every bench once per input, starting from `image` each time, and
+// report the fewest, most and mean cycles. A bench that goes over its
+// budget fails the build.
+void Assembler::runBenches(MemSnapshot const& image)
+{
+    for (auto const& bench : benches) {
+        uint32_t least = ~0U;
+        uint32_t most = 0;
+        uint64_t total = 0;
+        for (auto const& regs : bench.runs) {
+            auto result = runTest(image, regs, bench.start);
+            if (!result.ended) {
+                printOut("*** Bench {} : did not end!\n", bench.name);
+                errors.emplace_back(
+                    bench.line, 0,
+                    fmt::format("Bench '{}' did not end", bench.name));
+                errors.back().file = fileName;
+                throw parse_error("Bench did not end");
+            }
+            least = std::min(least, result.cycles);
+            most = std::max(most, result.cycles);
+            total += result.cycles;
+        }
+        auto runs = bench.runs.size();
+        auto mean = static_cast<Number>(total) / static_cast<Number>(runs);
+        printOut("*** Bench '{}' : {} runs, {}/{:.1f}/{} cycles "
+                 "(min/mean/max)\n",
+                 bench.name, runs, least, mean, most);
+
+        AnyMap res = {{"cycles", num(most)}, {"min", num(least)},
+                      {"max", num(most)},    {"mean", mean},
+                      {"runs", num(runs)}};
+        syms.set("tests."s + bench.name, res);
+
+        if (bench.budget != 0 && most > bench.budget) {
+            errors.emplace_back(
+                bench.line, 0,
+                fmt::format("Bench '{}' took {} cycles, budget is {}",
+                            bench.name, most, bench.budget));
+            errors.back().file = fileName;
+            throw parse_error("!bench");
+        }
+    }
+}
+
+// Run one test. If a check fails or it does not end, its last
+// instructions are printed. Tests with side effects remember them while
+// running, others run again to find them.
+RunResult Assembler::runTest(MemSnapshot const& image, RegState const& regs,
+                             uint32_t start)
+{
+    if (!replayTests) {
+        mach->setHistory(HistorySize);
+    }
+    try {
+        auto result = mach->runFrom(image, regs, start);
+        if (!result.ended) {
+            printOut("Code at ${:x} did not end\n", start);
+            printHistory(image, regs, start);
+        }
+        mach->setHistory(0);
+        return result;
+    } catch (parse_error&) {
+        printHistory(image, regs, start);
+        mach->setHistory(0);
+        throw;
+    }
+}
 
-    inTest++;
+void Assembler::printHistory(MemSnapshot const& image, RegState const& regs,
+                             uint32_t start)
+{
+    if (replayTests) {
+        // The failure is reported again, but only the first report is
+        // kept, and logs and watches are not printed twice
+        auto errorCount = errors.size();
+        replaying = true;
+        mach->setHistory(HistorySize);
+        try {
+            mach->runFrom(image, regs, start);
+        } catch (parse_error&) {
+        }
+        replaying = false;
+        errors.resize(errorCount);
+    }
+    auto history = mach->getHistory();
+    mach->setHistory(0);
+
+    printOut("Last instructions:\n");
+    for (auto const& [a, x, y, sr, sp, pc] : history) {
+        auto it = mach->dis.find(pc);
+        auto text = it != mach->dis.end() ? it->second : "???"s;
+        printOut("  {:04x}  {:<16} A=${:02x} X=${:02x} Y=${:02x} "
+                 "SR=${:02x} SP=${:02x}\n",
+                 pc, text, a, x, y, sr, sp);
+    }
+}
 
-    mach->setRegs(test.regs);
+// Run tests that have no result yet on `threads` threads. Returns false if
+// any test failed, in which case that test and any that were not run
+// are left without a result.
+bool Assembler::runTestsParallel(MemSnapshot const& image, unsigned threads,
+                                 std::vector<std::optional<RunResult>>& results)
+{
+    std::atomic<bool> failed{false};
+    std::atomic<size_t> next{0};
+    std::mutex mergeMutex;
+    auto worker = [&] {
+        Machine::Worker emu(*mach);
+        // Each worker marks and counts in its own copies, added to the
+        // totals when done
+        std::unique_ptr<sixfive::Coverage> covered;
+        if (coverage != nullptr) {
+            covered = std::make_unique<sixfive::Coverage>();
+            emu.setCoverage(covered.get());
+        }
+        std::unique_ptr<sixfive::Profile> counted;
+        if (profile != nullptr) {
+            counted = std::make_unique<sixfive::Profile>();
+            emu.setProfile(counted.get());
+        }
+        for (size_t i = next++; i < tests.size() && !failed; i = next++) {
+            if (results[i]) {
+                continue;
+            }
+            auto const& test = tests[i];
+            try {
+                auto result = emu.run(image, test.regs, test.start);
+                if (result.cycles > 16777200) {
+                    failed = true;
+                } else {
+                    results[i] = std::move(result);
+                }
+            } catch (...) {
+                failed = true;
+            }
+        }
+        std::lock_guard lock(mergeMutex);
+        if (covered) {
+            coverage->merge(*covered);
+        }
+        if (counted) {
+            profile->merge(*counted);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : pool) {
+        t.join();
+    }
+    return !failed;
+}
 
-    auto cycles = mach->run(start);
-    if (cycles > 16777200) {
-        fmt::print("*** Test {} : did not end!\n", test.name);
+void Assembler::reportTest(Test const& test, RunResult const& result)
+{
+    auto const& [ra, rx, ry, sr, sp, pc] = result.regs;
+    if (result.cycles > 16777200) {
+        printOut("*** Test {} : did not end!\n", test.name);
         throw parse_error("Test did not end");
     }
-    auto ra = mach->getReg(Reg::A);
-    auto rx = mach->getReg(Reg::X);
-    auto ry = mach->getReg(Reg::Y);
 
-    fmt::print("*** Test '{}' : {} cycles, [A=${:02x} X=${:02x} Y=${:02x}]\n",
-               test.name, cycles, ra, rx, ry);
+    printOut("*** Test '{}' : {} cycles, [A=${:02x} X=${:02x} Y=${:02x}]\n",
+             test.name, result.cycles, ra, rx, ry);
 
     if (test.name != "unnamed") {
-        res = {{"A", num(ra)},
-               {"X", num(rx)},
-               {"Y", num(ry)},
-               {"SR", num(mach->getReg(Reg::SR))},
-               {"SP", num(mach->getReg(Reg::SP))},
-               {"PC", num(mach->getReg(Reg::PC))},
-               {"cycles", num(cycles)},
-               {"ram", mach->getRam()}};
+        AnyMap res = {{"A", num(ra)},
+                      {"X", num(rx)},
+                      {"Y", num(ry)},
+                      {"SR", num(sr)},
+                      {"SP", num(sp)},
+                      {"PC", num(pc)},
+                      {"cycles", num(result.cycles)},
+                      {"ram", result.ram()}};
         syms.set("tests."s + test.name, res);
     }
 }
@@ -346,7 +684,7 @@ void initMeta(Assembler& assem);
 void initFunctions(Assembler& ass);
 void registerLuaFunctions(Assembler& a, Scripting& s);
 
-void Assembler::setRegSymbols()
+void Assembler::setRegSymbols(bool withRam)
 {
     using sixfive::Reg;
     syms.erase("A");
@@ -362,11 +700,15 @@ void Assembler::setRegSymbols()
     syms.set("SR", num(mach->getReg(Reg::SR)));
     syms.set("SP", num(mach->getReg(Reg::SP)));
     syms.set("PC", num(mach->getReg(Reg::PC)));
-    syms.set("RAM", mach->getRam());
+    // Reading all of RAM makes cached test results depend on every page
+    if (withRam) {
+        syms.set("RAM", mach->getRam());
+    }
 }
 
 void Assembler::machineLog(std::string_view text)
 {
+    if (replaying) return;
     fmt::dynamic_format_arg_store<fmt::format_context> store;
     store.push_back(fmt::arg("X", mach->getReg(sixfive::Reg::X)));
     store.push_back(fmt::arg("Y", mach->getReg(sixfive::Reg::Y)));
@@ -381,20 +723,37 @@ Assembler::Assembler() : parser(grammar6502)
     parser.packrat();
     mach = std::make_shared<Machine>();
 
+    mach->setWatchFunction([this](uint16_t adr, uint8_t value, int kind) {
+        if (replaying) return;
+        auto pc = mach->getReg(sixfive::Reg::PC);
+        if (kind == sixfive::WatchExec) {
+            printOut("Watch: exec ${:04x}\n", adr);
+        } else {
+            printOut("Watch: {} ${:04x} = ${:02x} (PC=${:04x})\n",
+                     kind == sixfive::WatchRead ? "read" : "write", adr,
+                     value, pc);
+        }
+    });
+
     checkFunction = [this](uint32_t) {
+        // Tests may run on several threads
+        std::lock_guard lock(actionMutex);
         auto pc = mach->getReg(sixfive::Reg::PC);
         for (auto const& action : actions[pc]) {
             auto saved = syms;
-            setRegSymbols();
-            if (std::holds_alternative<Check>(action.action)) {
-                auto const& check = std::get<Check>(action.action);
-                std::any v = parser.evaluate(check.expression.node);
+            auto const* check = std::get_if<Check>(&action.action);
+            setRegSymbols(check == nullptr ||
+                          check->expression.contents.find("RAM") !=
+                              std::string_view::npos);
+            if (check != nullptr) {
+                std::any v = parser.evaluate(check->expression.node);
                 // evaluateExpression(check.expression, action.line);
                 if (!number<bool>(v)) {
                     syms = saved;
-                    errors.emplace_back(action.line, 0,
-                                        fmt::format("Check '{}' failed",
-                                                    check.expression.contents));
+                    errors.emplace_back(
+                        action.line, 0,
+                        fmt::format("Check '{}' failed",
+                                    check->expression.contents));
                     errors.back().file = fileName;
                     throw parse_error("!check");
                 }
@@ -424,6 +783,19 @@ Assembler::~Assembler()
 void Assembler::useCache(bool on)
 {
     parser.use_cache(on);
+    cacheTests = on;
+}
+
+void Assembler::setProfile(sixfive::Profile* p)
+{
+    profile = p;
+    mach->setProfile(p);
+}
+
+void Assembler::setCoverage(sixfive::Coverage* c)
+{
+    coverage = c;
+    mach->setCoverage(c);
 }
 
 void Assembler::handleLabel(std::any const& lbl)
@@ -460,7 +832,13 @@ void Assembler::handleLabel(std::any const& lbl)
         }
     }
     // LOGI("Label %s=%x", label, mach->getPC());
-    syms.set(label, static_cast<Number>(mach->getPC()));
+    setSymbol(label, currentAddress());
+    if (profile != nullptr && label.rfind("__special_", 0) != 0) {
+        labelAt.emplace(mach->getPC(), label);
+    }
+    if (stripUnused) {
+        labelSections[label] = mach->getCurrentSection().name;
+    }
     if (pendingTest != nullptr) {
         auto* test = pendingTest;
         pendingTest = nullptr;
@@ -479,20 +857,14 @@ void Assembler::handleLabel(std::any const& lbl)
     }
 }
 
-std::vector<uint8_t> operator+(const std::vector<uint8_t>& lhs,
-                               const std::vector<uint8_t>& rhs)
-{
-    std::vector<uint8_t> result = lhs;
-    result.reserve(lhs.size() + rhs.size());
-    result.insert(result.end(), rhs.begin(), rhs.end());
-    return result;
-}
-
 template <typename A, typename B>
 std::variant<A, bool> operation(std::string_view ope, A const& a, B const& b)
 {
     // clang-format off
-    if (ope == "+") return a + b;
+    // Strings are concatenated by the caller, since they need to be interned
+    if constexpr (!std::is_same_v<A, std::string_view>) {
+        if (ope == "+") return a + b;
+    }
     if (ope == "==") return a == b;
     if (ope == "!=") return a != b;
     if constexpr ((std::is_same_v<A, Num> || std::is_arithmetic_v<A>) &&
@@ -539,11 +911,11 @@ void Assembler::setupRules()
             }
             auto value = sv[1];
             if (auto* macro = any_cast<Macro>(&value)) {
-                auto view = persist(sym);
+                auto view = strings.intern(sym);
                 definitions[view] = *macro;
 
             } else {
-                syms.set(sym, value);
+                setSymbol(sym, value);
             }
         } else if (sv.size() == 1) {
             mach->getCurrentSection().pc = number<uint16_t>(sv[0]);
@@ -803,12 +1175,14 @@ void Assembler::setupRules()
         for (size_t n = 0; n < sv.size(); n++) {
             auto arg = sv[n];
             if (auto* i = any_cast<Instruction>(&arg)) {
-                auto it = macros.find(i->opcode);
+                auto it = macros.empty() ? macros.end()
+                                         : macros.find(i->opcode);
                 if (it != macros.end()) {
                     LOGD("Found macro %s", it->second.name);
                     Call c{i->opcode, {}};
                     if (i->mode > sixfive::Mode::ACC) {
-                        c.args.emplace_back(any_num(i->val));
+                        c.args.emplace_back(i->reloc ? std::any(*i->reloc)
+                                                     : any_num(i->val));
                     }
                     auto sz = it->second.args.size();
                     if ((sz == 0 && c.args.empty()) ||
@@ -818,7 +1192,22 @@ void Assembler::setupRules()
                     }
                 }
 
-                auto res = mach->assemble(*i);
+                std::optional<ObjectFile::Reloc> reloc;
+                if (i->reloc) {
+                    reloc = prepareReloc(*i, *i->reloc);
+                }
+
+                auto* enc = any_cast<EncodedOp>(&sv.cache());
+                if (enc == nullptr) {
+                    enc = &sv.cache().emplace<EncodedOp>();
+                }
+                auto at = mach->getPC();
+                auto res = mach->assemble(*i, *enc);
+                if (profile != nullptr || coverage != nullptr) {
+                    // Only branches are encoded for a specific address
+                    sourceLines[at] = {intern(sv.file_name()), sv.line(),
+                                       enc->pc >= 0};
+                }
                 if (res == AsmResult::Truncated && !isFinalPass()) {
                     // Accept long branches unless final pass
                     res = AsmResult::Ok;
@@ -827,6 +1216,9 @@ void Assembler::setupRules()
                     throw parse_error(
                         fmt::format("Illegal instruction '{}'", i->opcode));
                 }
+                if (reloc) {
+                    relocs.push_back(*reloc);
+                }
             } else if (auto* c = any_cast<Call>(&arg)) {
                 applyMacro(*c);
             }
@@ -846,6 +1238,7 @@ void Assembler::setupRules()
             }
             instruction.mode = arg.mode;
             instruction.val = arg.val;
+            instruction.reloc = arg.reloc;
         }
         return std::any(instruction);
     });
@@ -856,10 +1249,19 @@ void Assembler::setupRules()
         {"Ind", Mode::IND}, {"IndX", Mode::INDX}, {"IndY", Mode::INDY},
         {"Acc", Mode::ACC}, {"Imm", Mode::IMM},
     };
-    auto buildArg = [](SV& sv) -> std::any {
+    auto buildArg = [&](SV& sv) -> std::any {
         auto mode = modeMap.at(std::string(sv.name()));
-        return Instruction{"", mode,
-                           mode == Mode::ACC ? 0 : any_cast<Number>(sv[0])};
+        if (mode == Mode::ACC) {
+            return Instruction{"", mode, 0};
+        }
+        auto arg = sv[0];
+        if (auto const* rv = any_cast<reloc::Value>(&arg)) {
+            // Fixed up in OpLine, where the opcode is known
+            Instruction instr{"", mode, 0};
+            instr.reloc = *rv;
+            return instr;
+        }
+        return Instruction{"", mode, any_cast<Number>(arg)};
     };
     for (auto const& [name, _] : modeMap) {
         parser.after(name.c_str(), buildArg);
@@ -965,7 +1367,7 @@ void Assembler::setupRules()
         return v;
     });
 
-    parser.after("Star", [&](SV&) -> Number { return mach->getPC(); });
+    parser.after("Star", [&](SV&) { return currentAddress(); });
 
     parser.after("Expression", [&](SV& sv) {
         if (sv.size() == 1) {
@@ -978,21 +1380,29 @@ void Assembler::setupRules()
             sv[2].type() == typeid(std::string_view)) {
             auto a = any_cast<std::string_view>(sv[0]);
             auto b = any_cast<std::string_view>(sv[2]);
+            if (ope == "+") {
+                auto s = std::string(a);
+                s += b;
+                return std::any(strings.intern(s));
+            }
             auto v = operation(ope, a, b);
             if (std::holds_alternative<bool>(v)) {
                 return std::any(static_cast<Number>(std::get<bool>(v)));
             }
             return std::any(std::get<std::string_view>(v));
         }
-        if (sv[0].type() == typeid(std::vector<uint8_t>) &&
-            sv[2].type() == typeid(std::vector<uint8_t>)) {
-            auto a = any_cast<std::vector<uint8_t>>(sv[0]);
-            auto b = any_cast<std::vector<uint8_t>>(sv[2]);
+        if (sv[0].type() == typeid(Bytes) && sv[2].type() == typeid(Bytes)) {
+            auto a = any_cast<Bytes>(sv[0]);
+            auto b = any_cast<Bytes>(sv[2]);
             auto v = operation(ope, a, b);
             if (std::holds_alternative<bool>(v)) {
                 return std::any(static_cast<Number>(std::get<bool>(v)));
             }
-            return std::any(std::get<std::vector<uint8_t>>(v));
+            return std::any(std::get<Bytes>(v));
+        }
+        if (sv[0].type() == typeid(reloc::Value) ||
+            sv[2].type() == typeid(reloc::Value)) {
+            return relocOperation(ope, sv[0], sv[2]);
         }
 
         auto a = Num(any_cast<Number>(sv[0]));
@@ -1044,7 +1454,7 @@ void Assembler::setupRules()
             if (sv.size() > 3 && sv[3].has_value()) {
                 b = number<int64_t>(sv[3]);
             }
-            if (auto const* v8 = any_cast<std::vector<uint8_t>>(&vec)) {
+            if (auto const* v8 = any_cast<Bytes>(&vec)) {
                 return slice(*v8, a, b);
             }
             if (auto const* vn = any_cast<std::vector<Number>>(&vec)) {
@@ -1054,7 +1464,7 @@ void Assembler::setupRules()
         }
 
         auto i = number<size_t>(sv[1]);
-        if (auto const* v8 = any_cast<std::vector<uint8_t>>(&vec)) {
+        if (auto const* v8 = any_cast<Bytes>(&vec)) {
             return index(*v8, i);
         }
         if (auto const* vn = any_cast<std::vector<Number>>(&vec)) {
@@ -1068,6 +1478,12 @@ void Assembler::setupRules()
 
     parser.after("Unary", [&](SV& sv) -> Number {
         auto ope = any_cast<char>(sv[0]);
+        if (sv[1].type() == typeid(reloc::Value)) {
+            if (isFinalPass()) {
+                throw parse_error("Expression can not be relocated");
+            }
+            return 0;
+        }
         auto num = number(sv[1]);
         auto inum = number<int64_t>(num);
         switch (ope) {
@@ -1081,15 +1497,25 @@ void Assembler::setupRules()
             throw parse_error("Unknown unary operator");
         }
     });
-    parser.after("Unary2", [&](SV& sv) -> Number {
+    parser.after("Unary2", [&](SV& sv) -> std::any {
         auto ope = any_cast<char>(sv[0]);
-        auto num = number(sv[1]);
-        auto inum = number<int64_t>(num);
+        auto arg = sv[1];
+        if (auto const* rv = any_cast<reloc::Value>(&arg)) {
+            if (rv->kind == RelocKind::Word) {
+                return reloc::Value{ope == '<' ? RelocKind::Lo : RelocKind::Hi,
+                                    rv->target, rv->addend};
+            }
+            if (isFinalPass()) {
+                throw parse_error("Expression can not be relocated");
+            }
+            return any_num(0);
+        }
+        auto inum = number<int64_t>(arg);
         switch (ope) {
         case '<':
-            return static_cast<Number>(inum & 0xff);
+            return any_num(inum & 0xff);
         case '>':
-            return static_cast<Number>(inum >> 8);
+            return any_num(inum >> 8);
         default:
             throw parse_error("Unknown unary operator");
         }
@@ -1109,7 +1535,8 @@ void Assembler::setupRules()
         }
 
         if (sv.token_view()[0] == '.') {
-            full = std::string(lastLabel) + sv.token_view();
+            full = std::string(lastLabel);
+            full += sv.token_view();
         } else {
 
             std::vector<std::string_view> parts;
@@ -1120,7 +1547,15 @@ void Assembler::setupRules()
             full = utils::join(parts.begin(), parts.end(), ".");
         }
 
+        if (objectMode && !syms.is_defined(full) &&
+            syms.collect(full).empty()) {
+            // Not defined in this file (yet), so assume it is imported
+            return std::any(importValue(full));
+        }
         val = syms.get(full);
+        if (stripUnused) {
+            sectionRefs[mach->getCurrentSection().name].insert(full);
+        }
         // Set undefined numbers to PC, to increase likelihood of
         // correct code generation (less passes)
         if (val.type() == typeid(Number) && !syms.is_defined(full)) {
@@ -1139,10 +1574,16 @@ bool Assembler::pass(AstNode const& ast)
 {
     labelNum = 0;
     mach->clear();
+    labelAt.clear();
+    sourceLines.clear();
     syms.clear();
     errors.clear();
     tests.clear();
+    benches.clear();
     actions.clear();
+    labelSections.clear();
+    sectionRefs.clear();
+    relocs.clear();
     needsFinalPass = false;
     try {
         parser.evaluate(ast);
@@ -1174,9 +1615,7 @@ bool Assembler::pass(AstNode const& ast)
 bool Assembler::parse_path(fs::path const& p)
 {
     currentPath = fs::absolute(p).parent_path();
-    utils::File f{p.string()};
-
-    return parse(f.readAllString() + "\n", p.string());
+    return parse(mapFile(p.string()), p.string());
 }
 
 bool Assembler::parse(std::string_view source, std::string const& fname)
@@ -1191,7 +1630,7 @@ bool Assembler::parse(std::string_view source, std::string const& fname)
 
     fileName = fname;
 
-    fmt::print("* PARSING\n");
+    printOut("* PARSING\n");
     auto ast = parser.parse(source, fname);
     if (!ast) {
         errors.push_back(parser.getError());
@@ -1204,13 +1643,20 @@ bool Assembler::parse(std::string_view source, std::string const& fname)
             errors.emplace_back(0, 0, "Max number of passes");
             return false;
         }
-        fmt::print("* PASS {}\n", passNo + 1);
+        printOut("* PASS {}\n", passNo + 1);
         if (!pass(ast)) {
             // throw parse_error("Syntax error");
             return false;
         }
 
-        auto layoutOk = mach->layoutSections();
+        bool layoutOk = false;
+        try {
+            layoutOk = mach->layoutSections();
+        } catch (machine_error& e) {
+            errors.emplace_back(0, 0, e.what());
+            errors.back().file = fileName;
+            return false;
+        }
 
         for (auto const& s : mach->getSections()) {
             LOGD("%s : %x -> %x (%d) [%x]\n", s.name, s.start, s.start + s.size,
@@ -1223,7 +1669,7 @@ bool Assembler::parse(std::string_view source, std::string const& fname)
 
             syms.set(prefix + ".start", start);
             syms.set(prefix + ".end", end);
-            syms.set(prefix + ".data", s.data);
+            syms.set(prefix + ".data", s.bytes());
         }
 
         passNo++;
@@ -1234,27 +1680,34 @@ bool Assembler::parse(std::string_view source, std::string const& fname)
         }
         if (rc == ERROR) {
             tests.clear();
+            benches.clear();
             needsFinalPass = true;
         }
 
         if (!layoutOk) {
             continue;
         }
+        if (stripUnused && stripSections()) {
+            continue;
+        }
+        if (foldData && foldSections()) {
+            continue;
+        }
         break;
     }
-    auto err = mach->checkOverlap();
-    if (err.line != 0) {
-        err.file = fileName;
-        errors.push_back(err);
+    auto overlaps = mach->checkOverlap();
+    if (!overlaps.empty()) {
+        for (auto& err : overlaps) {
+            err.file = fileName;
+            errors.push_back(err);
+        }
         return false;
     }
 
-    if (!tests.empty()) {
-        fmt::print("* TESTS ({})\n", tests.size());
+    if (!tests.empty() || !benches.empty()) {
+        printOut("* TESTS ({})\n", tests.size() + benches.size());
         try {
-            for (auto const& test : tests) {
-                runTest(test);
-            }
+            runTests();
         } catch (parse_error& e) {
             LOGE("Error %s", e.what());
             return false;
@@ -1263,7 +1716,7 @@ bool Assembler::parse(std::string_view source, std::string const& fname)
 
     if (needsFinalPass) {
         finalPass = true;
-        fmt::print("* FINAL PASS\n");
+        printOut("* FINAL PASS\n");
         syms.acceptUndefined(false);
         return pass(ast);
     }
@@ -1283,7 +1736,7 @@ void Assembler::printSymbols()
 {
     syms.forAll([](std::string const& name, std::any const& val) {
         if (!utils::startsWith(name, "__"))
-            fmt::print("{} == {}\n", name, any_to_string(val));
+            printOut("{} == {}\n", name, any_to_string(val));
     });
 }
 
@@ -1330,10 +1783,417 @@ void Assembler::popScope()
     scopes.pop_back();
 }
 
+// Index of the current section in the object file. Higher targets are
+// imports, so there is a limit on the number of sections.
+int32_t Assembler::sectionTarget() const
+{
+    auto index = mach->getSectionIndex(mach->getCurrentSection().name);
+    if (index >= reloc::ImportBase) {
+        throw parse_error(fmt::format(
+            "Object files can have at most {} sections", reloc::ImportBase));
+    }
+    return index;
+}
+
+std::any Assembler::currentAddress() const
+{
+    auto pc = mach->getPC();
+    if (objectMode) {
+        auto const& cs = mach->getCurrentSection();
+        if ((cs.flags & FixedStart) == 0) {
+            return reloc::Value{RelocKind::Word, sectionTarget(),
+                                static_cast<int32_t>(pc) - cs.start};
+        }
+    }
+    return any_num(pc);
+}
+
+reloc::Value Assembler::importValue(std::string const& name)
+{
+    auto it = importIndex.find(name);
+    if (it == importIndex.end()) {
+        it = importIndex.emplace(name, static_cast<int32_t>(imports.size()))
+                 .first;
+        imports.push_back(name);
+    }
+    // Make another pass in case it is defined later in the file
+    syms.undefined.insert(name);
+    return {RelocKind::Word, reloc::ImportBase + it->second, 0};
+}
+
+// Relocatable values are set by type, so changes between passes are
+// noticed like for numbers
+void Assembler::setSymbol(std::string const& name, std::any const& value)
+{
+    if (auto const* rv = std::any_cast<reloc::Value>(&value)) {
+        syms.set(name, *rv);
+    } else {
+        syms.set(name, value);
+    }
+}
+
+// Apply a binary operator where at least one side is relocatable. Only
+// adding or subtracting a number, and the difference between two labels
+// in the same section, can be relocated.
+std::any Assembler::relocOperation(std::string_view ope, std::any const& a,
+                                   std::any const& b)
+{
+    auto const* ra = std::any_cast<reloc::Value>(&a);
+    auto const* rb = std::any_cast<reloc::Value>(&b);
+    auto const* na = std::any_cast<Number>(&a);
+    auto const* nb = std::any_cast<Number>(&b);
+    bool const words = (ra == nullptr || ra->kind == RelocKind::Word) &&
+                       (rb == nullptr || rb->kind == RelocKind::Word);
+    std::string error = "Expression can not be relocated";
+
+    if (words && ra != nullptr && nb != nullptr &&
+        (ope == "+" || ope == "-")) {
+        auto offset = static_cast<int32_t>(*nb);
+        return reloc::Value{ra->kind, ra->target,
+                            ope == "+" ? ra->addend + offset
+                                       : ra->addend - offset};
+    }
+    if (words && na != nullptr && rb != nullptr && ope == "+") {
+        return reloc::Value{rb->kind, rb->target,
+                            rb->addend + static_cast<int32_t>(*na)};
+    }
+    if (words && ra != nullptr && rb != nullptr && ope == "-") {
+        if (ra->target == rb->target && ra->target < reloc::ImportBase) {
+            return any_num(ra->addend - rb->addend);
+        }
+        if (ra->target < reloc::ImportBase &&
+            rb->target < reloc::ImportBase) {
+            error = "Difference between labels in different sections can "
+                    "not be relocated";
+        }
+    }
+    if (isFinalPass()) {
+        throw parse_error(error);
+    }
+    return any_num(0);
+}
+
+// Prepare `instr` for assembly with a placeholder argument, and return the
+// relocation that will patch in the real value at link time
+std::optional<ObjectFile::Reloc> Assembler::prepareReloc(Instruction& instr,
+                                                         reloc::Value const& rv)
+{
+    using sixfive::Mode;
+    auto const& cs = mach->getCurrentSection();
+    auto section = sectionTarget();
+    auto pc = static_cast<int32_t>(mach->getPC());
+    ObjectFile::Reloc r{static_cast<uint32_t>(section),
+                        static_cast<uint32_t>(pc - cs.start + 1), rv.kind,
+                        rv.target, rv.addend};
+
+    // Values may still be undefined before the final pass
+    auto fail = [&](char const* msg) -> std::optional<ObjectFile::Reloc> {
+        if (isFinalPass()) {
+            throw parse_error(msg);
+        }
+        instr.val = 0;
+        return std::nullopt;
+    };
+
+    if (mach->isBranch(instr.opcode)) {
+        if (rv.kind != RelocKind::Word) {
+            return fail("Illegal branch target");
+        }
+        if (rv.target == section) {
+            // Branches within the section need no relocation
+            instr.val = cs.start + rv.addend;
+            return std::nullopt;
+        }
+        instr.val = pc;
+        r.kind = RelocKind::Rel;
+        return r;
+    }
+    if (rv.kind == RelocKind::Word) {
+        if (instr.mode != Mode::ABS && instr.mode != Mode::ABSX &&
+            instr.mode != Mode::ABSY && instr.mode != Mode::IND) {
+            return fail("Relocatable address needs absolute addressing");
+        }
+        // Large enough to keep the absolute addressing mode
+        instr.val = 0x100;
+    } else {
+        if (instr.mode != Mode::IMM) {
+            return fail("Relocatable byte needs immediate addressing");
+        }
+        instr.val = 0;
+    }
+    return r;
+}
+
+Number Assembler::dataValue(std::any const& v, int size)
+{
+    auto const* rv = std::any_cast<reloc::Value>(&v);
+    if (rv == nullptr) {
+        return number(v);
+    }
+    char const* error = nullptr;
+    if (size == 1 && rv->kind == RelocKind::Word) {
+        error = "Relocatable byte needs '<' or '>'";
+    } else if (size == 2 && rv->kind != RelocKind::Word) {
+        error = "Can not relocate byte as word";
+    }
+    if (error != nullptr) {
+        if (isFinalPass()) {
+            throw parse_error(error);
+        }
+        return 0;
+    }
+    auto const& cs = mach->getCurrentSection();
+    relocs.push_back({static_cast<uint32_t>(sectionTarget()),
+                      static_cast<uint32_t>(mach->getPC() - cs.start),
+                      rv->kind, rv->target, rv->addend});
+    return 0;
+}
+
+ObjectFile Assembler::makeObject() const
+{
+    ObjectFile obj;
+    for (auto const& s : mach->getSections()) {
+        ObjectFile::Section os;
+        os.name = s.name;
+        os.parent = s.parent;
+        os.start = (s.flags & FixedStart) != 0 ? s.start : -1;
+        os.size = (s.flags & FixedSize) != 0 ? s.size : -1;
+        os.flags = s.flags;
+        os.align = s.align;
+        os.data = s.data;
+        obj.sections.push_back(std::move(os));
+    }
+
+    syms.forAll([&](std::string const& name, std::any const& val) {
+        if (utils::startsWith(name, "__") ||
+            utils::startsWith(name, "section.") ||
+            utils::startsWith(name, "sections.") ||
+            utils::startsWith(name, "tests.")) {
+            return;
+        }
+        if (auto const* n = std::any_cast<Number>(&val)) {
+            obj.symbols.push_back({name, -1, *n});
+        } else if (auto const* rv = std::any_cast<reloc::Value>(&val)) {
+            // Bytes of addresses and imports can not be exported
+            if (rv->kind == RelocKind::Word &&
+                rv->target < reloc::ImportBase) {
+                obj.symbols.push_back(
+                    {name, rv->target, static_cast<Number>(rv->addend)});
+            }
+        }
+    });
+    obj.imports = imports;
+    obj.relocs = relocs;
+    return obj;
+}
+
+// Strip all removable sections that can not be reached from a
+// non-removable section by following label references. Returns true if
+// any section was stripped, in which case another pass is needed.
+bool Assembler::stripSections()
+{
+    std::unordered_set<std::string> reached;
+    std::vector<std::string> work;
+    for (auto const& s : mach->getSections()) {
+        if ((s.flags & Removable) == 0) {
+            reached.insert(s.name);
+            work.push_back(s.name);
+        }
+    }
+    while (!work.empty()) {
+        auto name = work.back();
+        work.pop_back();
+        // A folded section needs the section holding its data
+        auto const& into = mach->getSection(name).foldedInto;
+        if (!into.empty() && reached.insert(into).second) {
+            work.push_back(into);
+        }
+        auto it = sectionRefs.find(name);
+        if (it == sectionRefs.end()) {
+            continue;
+        }
+        for (auto const& sym : it->second) {
+            auto ls = labelSections.find(sym);
+            if (ls != labelSections.end() &&
+                reached.insert(ls->second).second) {
+                work.push_back(ls->second);
+            }
+        }
+    }
+
+    std::vector<std::string> unused;
+    size_t saved = 0;
+    for (auto const& s : mach->getSections()) {
+        if (!s.stripped && !s.data.empty() && reached.count(s.name) == 0) {
+            unused.push_back(s.name);
+            saved += s.data.size();
+        }
+    }
+    if (unused.empty()) {
+        return false;
+    }
+
+    printOut("* STRIP\n");
+    for (auto const& name : unused) {
+        std::vector<std::string> labels;
+        for (auto const& [label, section] : labelSections) {
+            if (section == name) {
+                labels.push_back(label);
+            }
+        }
+        std::sort(labels.begin(), labels.end());
+        printOut("{} ({} bytes) {}\n", name,
+                 mach->getSection(name).data.size(),
+                 utils::join(labels.begin(), labels.end(), " "));
+        mach->stripSection(name);
+    }
+    printOut("{} bytes saved\n", saved);
+    return true;
+}
+
+// Fold read only sections whose data can be found in another read only
+// section, so they are placed on top of that data instead. Sections are
+// checked from the largest down, and a section can fold into one that
+// has identical data or data that contains it (such as a string that is
+// the tail of another string). Returns true if the folds changed, in
+// which case another pass is needed.
+bool Assembler::foldSections()
+{
+    auto isCandidate = [](Section const& s) {
+        return (s.flags & ReadOnly) != 0 && (s.flags & NoStorage) == 0 &&
+               s.valid && !s.stripped && !s.data.empty();
+    };
+
+    // Data of folded sections may change between passes (for instance
+    // tables of addresses), so first check that earlier folds still hold
+    bool changed = false;
+    for (auto const& s : mach->getSections()) {
+        if (s.foldedInto.empty()) {
+            continue;
+        }
+        auto const& into = mach->getSection(s.foldedInto).data;
+        auto offset = static_cast<size_t>(s.foldOffset);
+        if (!isCandidate(s) || offset + s.data.size() > into.size() ||
+            !std::equal(s.data.begin(), s.data.end(),
+                        into.begin() + s.foldOffset)) {
+            LOGI("Unfolding %s", s.name);
+            mach->unfoldSection(s.name);
+            changed = true;
+        }
+    }
+    if (changed) {
+        return true;
+    }
+
+    // Folded data must stay in the same root section (and so the same
+    // bank), and in the same output file
+    auto placement = [&](Section const& s) {
+        std::string file;
+        auto const* p = &s;
+        while (true) {
+            if (file.empty() && (p->flags & WriteToDisk) != 0) {
+                file = p->name;
+            }
+            if (p->parent.empty()) {
+                break;
+            }
+            p = &mach->getSection(p->parent);
+        }
+        return std::pair(p->name, file);
+    };
+
+    std::vector<Section const*> candidates;
+    for (auto const& s : mach->getSections()) {
+        if (isCandidate(s) && s.foldedInto.empty()) {
+            candidates.push_back(&s);
+        }
+    }
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](auto const* a, auto const* b) {
+                         return a->data.size() > b->data.size();
+                     });
+
+    struct Fold
+    {
+        Section const* section;
+        Section const* into;
+        int32_t offset;
+    };
+    std::vector<Fold> folds;
+    std::vector<Section const*> kept;
+    for (auto const* s : candidates) {
+        bool movable = (s->flags & (FixedStart | Floating)) == 0 &&
+                       s->align <= 1 && s->children.empty();
+        bool folded = false;
+        for (auto const* k : kept) {
+            if (!movable) {
+                break;
+            }
+            if (placement(*s) != placement(*k)) {
+                continue;
+            }
+            auto it = std::search(
+                k->data.begin(), k->data.end(),
+                std::boyer_moore_horspool_searcher(s->data.begin(),
+                                                   s->data.end()));
+            if (it != k->data.end()) {
+                folds.push_back(
+                    {s, k, static_cast<int32_t>(it - k->data.begin())});
+                folded = true;
+                break;
+            }
+        }
+        if (!folded) {
+            kept.push_back(s);
+        }
+    }
+    if (folds.empty()) {
+        return false;
+    }
+
+    printOut("* FOLD\n");
+    size_t saved = 0;
+    for (auto const& f : folds) {
+        printOut("{} -> {}+{} ({} bytes)\n", f.section->name, f.into->name,
+                 f.offset, f.section->data.size());
+        saved += f.section->data.size();
+        mach->foldSection(f.section->name, f.into->name, f.offset);
+    }
+    printOut("{} bytes saved\n", saved);
+    return true;
+}
+
 void Assembler::clear()
 {
     macros.clear();
     definitions.clear();
     errors.clear();
+    binaries.clear();
+    includes.clear();
+    imports.clear();
+    importIndex.clear();
+    mach->clearStripped();
+
+    // Drop symbols that refer to strings or sources from the previous build
+    auto owned = [&](std::string_view sv) {
+        if (strings.owns(sv)) {
+            return true;
+        }
+        return std::any_of(sources.begin(), sources.end(),
+                           [&](auto const& s) { return s.second->owns(sv); });
+    };
+    std::vector<std::string> stale;
+    syms.forAll([&](std::string const& name, std::any const& val) {
+        auto const* sv = std::any_cast<std::string_view>(&val);
+        if (sv != nullptr && owned(*sv)) {
+            stale.push_back(name);
+        }
+    });
+    for (auto const& name : stale) {
+        syms.erase(name);
+    }
+    lastLabel = {};
+    strings.clear();
+    sources.clear();
     passNo = 0;
 }
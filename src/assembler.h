@@ -5,14 +5,25 @@
 #include "script.h"
 
 #include "any_callable.h"
+#include "chars.h"
+#include "mapped_file.h"
+#include "object_file.h"
 #include "symbol_table.h"
 
+#include <map>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <variant>
 #include <vector>
 
 class Machine;
+namespace sixfive {
+struct Profile;
+struct Coverage;
+} // namespace sixfive
 
 
 inline void Check(bool v, std::string const& txt)
@@ -34,6 +45,17 @@ public:
         RegState regs;
     };
 
+    // A test that runs once for every entry in `runs`, each from the same
+    // start state, failing the build if any run takes over `budget` cycles
+    struct Bench
+    {
+        std::string name;
+        uint32_t start;
+        std::vector<RegState> runs;
+        uint32_t budget = 0; // 0 for no budget
+        size_t line = 0;
+    };
+
     struct Block
     {
         std::string_view contents;
@@ -69,11 +91,29 @@ public:
     fs::path getCurrentPath() const { return currentPath; }
     SymbolTable& getSymbols();
     Machine& getMachine();
+    CharTranslator& getTranslator() { return translator; }
     void printSymbols();
     void writeSymbols(fs::path const& p);
     Block includeFile(std::string_view fileName);
+    std::string_view mapFile(std::string const& fileName);
+    Bytes loadFile(fs::path const& p);
 
     void setMaxPasses(int mp) { maxPasses = mp; }
+    // Strip removable sections that no other section refers to
+    void setStripUnused(bool on) { stripUnused = on; }
+    // Fold read only sections whose data already exists in another one
+    void setFoldData(bool on) { foldData = on; }
+    // Number of threads used to run tests, 0 for one per core
+    void setTestThreads(unsigned n) { testThreads = n; }
+    // Assemble into a relocatable object instead of a finished program
+    void setObjectMode(bool on) { objectMode = on; }
+    ObjectFile makeObject() const;
+
+    // Current address as a number, or a `reloc::Value` in object mode
+    std::any currentAddress() const;
+    // Return the value to write for data of `size` bytes at the current
+    // address, recording a relocation if needed
+    Number dataValue(std::any const& v, int size);
 
     bool isFinalPass()
     {
@@ -117,8 +157,18 @@ public:
 
     void evaluateBlock(Block const& block);
 
-    void runTest(Test const& test);
+    void runTests();
+    bool runTestsParallel(MemSnapshot const& image, unsigned threads,
+                          std::vector<std::optional<RunResult>>& results);
+    std::string testInputs() const;
+    void reportTest(Test const& test, RunResult const& result);
     void addTest(std::string name, uint32_t start, RegState const& state);
+    RunResult runTest(MemSnapshot const& image, RegState const& regs,
+                      uint32_t start);
+    void printHistory(MemSnapshot const& image, RegState const& regs,
+                      uint32_t start);
+    void runBenches(MemSnapshot const& image);
+    void addBench(Bench bench);
 
     enum DebugFlags
     {
@@ -135,7 +185,10 @@ public:
     fs::path evaluatePath(std::string_view name);
     std::string_view getLastLabel() const { return lastLabel; }
     void setLastLabel(std::string_view l) { lastLabel = l; }
-    void setLastLabel(std::string const& l) { lastLabel = persist(l); }
+    void setLastLabel(std::string const& l) { lastLabel = strings.intern(l); }
+
+    // Store a string for the duration of the build
+    std::string_view intern(std::string_view s) { return strings.intern(s); }
 
     std::any applyDefine(Macro const& fn, Call const& call);
 
@@ -143,6 +196,38 @@ public:
 
     void useCache(bool on);
 
+    // Cache test results in `dir` instead of the default location. Test
+    // results are only cached after `useCache(true)`.
+    void setTestCache(fs::path const& dir) { testCacheDir = dir; }
+
+    // Read source files into memory instead of mapping them, for files
+    // that may be rewritten while in use.
+    void setMapSources(bool on) { mapSources = on; }
+
+    // Count tests in `profile`, which is cleared first. Cached results have
+    // no counts, so tests do not use the test cache while profiled. Labels
+    // and source lines of all instructions are then kept for the report.
+    void setProfile(sixfive::Profile* p);
+    // Mark the instructions all tests run in `c`, which is cleared first.
+    // Cached tests add what they covered when they were stored.
+    void setCoverage(sixfive::Coverage* c);
+
+    struct SourceLine
+    {
+        std::string_view file;
+        size_t line;
+        bool branch = false;
+    };
+
+    std::map<uint32_t, std::string> const& getLabels() const
+    {
+        return labelAt;
+    }
+    std::map<uint32_t, SourceLine> const& getSourceLines() const
+    {
+        return sourceLines;
+    }
+
 private:
     template <typename T>
     T& sym(std::string const& s)
@@ -150,12 +235,12 @@ private:
         return syms.get<T>(s);
     }
 
-    template <typename T>
-    std::any slice(std::vector<T> const& v, int64_t a, int64_t b);
-    template <typename T>
-    std::any index(std::vector<T> const& v, int64_t index);
+    template <typename C>
+    std::any slice(C const& v, int64_t a, int64_t b);
+    template <typename C>
+    std::any index(C const& v, int64_t index);
 
-    void setRegSymbols();
+    void setRegSymbols(bool withRam = true);
 
     std::vector<Error> errors;
 
@@ -172,6 +257,15 @@ private:
 
     void applyMacro(Call const& call);
     int checkUndefined();
+    bool stripSections();
+    bool foldSections();
+    int32_t sectionTarget() const;
+    reloc::Value importValue(std::string const& name);
+    std::any relocOperation(std::string_view ope, std::any const& a,
+                            std::any const& b);
+    std::optional<ObjectFile::Reloc> prepareReloc(Instruction& instr,
+                                                  reloc::Value const& rv);
+    void setSymbol(std::string const& name, std::any const& value);
     bool pass(AstNode const& ast);
     void setupRules();
 
@@ -203,11 +297,17 @@ private:
 
     fs::path currentPath;
     std::unordered_map<std::string, Block> includes;
-    std::deque<std::string> stored_includes;
+    // Source files by path. These are kept until `clear()` since the AST
+    // and symbols refer directly to their contents.
+    std::unordered_map<std::string, std::unique_ptr<MappedFile>> sources;
+    bool mapSources = true;
+    std::unordered_map<std::string, Bytes> binaries;
+    StringPool strings;
     std::shared_ptr<Machine> mach;
     std::unordered_map<std::string_view, Macro> macros;
     std::unordered_map<std::string_view, Macro> definitions;
     SymbolTable syms;
+    CharTranslator translator;
     std::string_view lastLabel;
     bool finalPass{false};
     bool needsFinalPass{false};
@@ -220,18 +320,46 @@ private:
     int labelNum = 0;
     int inMacro = 0;
 
-    int inTest = 0;
     int maxPasses = 10;
 
+    bool stripUnused = false;
+    bool foldData = false;
+    unsigned testThreads = 0;
+    bool cacheTests = false;
+    fs::path testCacheDir = fs::path(getHomeDir()) / ".basscache" / "tests";
+    std::mutex actionMutex;
+
+    bool objectMode = false;
+    std::vector<std::string> imports;
+    std::unordered_map<std::string, int32_t> importIndex;
+    std::vector<ObjectFile::Reloc> relocs;
+    // The section each label was defined in, and the symbols referenced
+    // from each section. Used to find unreferenced sections.
+    std::unordered_map<std::string, std::string> labelSections;
+    std::unordered_map<std::string, std::unordered_set<std::string>>
+        sectionRefs;
+
     std::function<bool(uint32_t)> logFunction;
     std::function<bool(uint32_t)> checkFunction;
 
+    // Set while a failed test runs again to find its last instructions
+    bool replaying = false;
+    // Tests with side effects are not run again, and instead remember
+    // their last instructions while running
+    bool replayTests = true;
     Test* pendingTest = nullptr;
     std::vector<Test> tests;
+    std::vector<Bench> benches;
 
     std::deque<std::string_view> scopes;
 
     Number nextEnumValue = 0;
 
-    Scripting scripting;
+    Scripting scripting{strings};
+    sixfive::Profile* profile = nullptr;
+    sixfive::Coverage* coverage = nullptr;
+    // First label and source line at each address, when profiling or
+    // covering
+    std::map<uint32_t, std::string> labelAt;
+    std::map<uint32_t, SourceLine> sourceLines;
 };
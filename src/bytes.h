@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Immutable, reference counted byte buffer used for binary data values.
+// Copying or slicing a `Bytes` is O(1); all copies and slices share the
+// same underlying storage.
+class Bytes
+{
+public:
+    Bytes() = default;
+
+    // Take ownership of the contents of `v`
+    Bytes(std::vector<uint8_t> v) // NOLINT
+        : store(std::make_shared<std::vector<uint8_t> const>(std::move(v))),
+          len(store->size())
+    {}
+
+    Bytes(uint8_t const* ptr, size_t size)
+        : Bytes(std::vector<uint8_t>(ptr, ptr + size))
+    {}
+
+    // Share an existing buffer
+    explicit Bytes(std::shared_ptr<std::vector<uint8_t> const> s)
+        : store(std::move(s)), len(store ? store->size() : 0)
+    {}
+
+    uint8_t const* data() const
+    {
+        return store ? store->data() + offset : nullptr;
+    }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+
+    uint8_t const* begin() const { return data(); }
+    uint8_t const* end() const { return data() + len; }
+
+    uint8_t operator[](size_t i) const { return data()[i]; }
+
+    // Return the bytes in [a, b) as a buffer sharing storage with this one
+    Bytes slice(size_t a, size_t b) const
+    {
+        Bytes result = *this;
+        result.offset += a;
+        result.len = b - a;
+        return result;
+    }
+
+    std::vector<uint8_t> vector() const { return {begin(), end()}; }
+
+    bool operator==(Bytes const& other) const
+    {
+        if (len != other.len) return false;
+        if (store == other.store && offset == other.offset) return true;
+        return std::equal(begin(), end(), other.begin());
+    }
+    bool operator!=(Bytes const& other) const { return !(*this == other); }
+
+private:
+    std::shared_ptr<std::vector<uint8_t> const> store;
+    size_t offset = 0;
+    size_t len = 0;
+};
+
+inline Bytes operator+(Bytes const& lhs, Bytes const& rhs)
+{
+    if (lhs.empty()) return rhs;
+    if (rhs.empty()) return lhs;
+    std::vector<uint8_t> result;
+    result.reserve(lhs.size() + rhs.size());
+    result.insert(result.end(), lhs.begin(), lhs.end());
+    result.insert(result.end(), rhs.begin(), rhs.end());
+    return result;
+}
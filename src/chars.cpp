@@ -8,13 +8,10 @@
 #include <cstdint>
 #include <unordered_map>
 
-static std::unordered_map<int32_t, uint8_t> char_translate;
-
 static std::array translationNames{"ascii", "petscii_upper", "petscii_lower",
                                    "screencode_upper", "screencode_lower"};
-Translation currentTranslation = Translation::Ascii;
 
-void setTranslation(Translation t)
+void CharTranslator::setTranslation(Translation t)
 {
     int32_t (*ptr)(uint8_t) = nullptr;
     currentTranslation = t;
@@ -35,14 +32,14 @@ void setTranslation(Translation t)
         ptr = &sc2uni_lo;
         break;
     }
-    char_translate.clear();
+    charTranslate.clear();
     for (int i = 0; i < 128; i++) {
 
         auto u = ptr(i);
-        char_translate[u] = i;
+        charTranslate[u] = i;
     }
 }
-void setTranslation(std::string_view name)
+void CharTranslator::setTranslation(std::string_view name)
 {
     for (size_t i = 0; i < translationNames.size(); i++) {
         auto const& n = translationNames[i];
@@ -54,15 +51,15 @@ void setTranslation(std::string_view name)
     throw parse_error(fmt::format("Unknown encoding '{}'", name));
 }
 
-void setTranslation(char32_t c, uint8_t p)
+void CharTranslator::setTranslation(char32_t c, uint8_t p)
 {
-    char_translate[c] = p;
+    charTranslate[c] = p;
 }
 
-uint8_t translateChar(uint32_t c)
+uint8_t CharTranslator::translateChar(uint32_t c) const
 {
-    auto it = char_translate.find(c);
-    if (it != char_translate.end()) {
+    auto it = charTranslate.find(c);
+    if (it != charTranslate.end()) {
         return it->second;
     }
     auto s = utils::utf8_encode({c});
@@ -1,7 +1,8 @@
 #pragma once
 
-#include <string>
 #include <cstdint>
+#include <string>
+#include <unordered_map>
 
 enum class Translation
 {
@@ -12,9 +13,19 @@ enum class Translation
     ScreencodeLower
 };
 
-void setTranslation(Translation t);
-void setTranslation(std::string_view t);
-void setTranslation(char32_t c, uint8_t p);
+// Translates unicode characters in text to the target character set.
+// Every assembler owns one, since the translation can be changed from
+// the source.
+class CharTranslator
+{
+public:
+    void setTranslation(Translation t);
+    void setTranslation(std::string_view t);
+    void setTranslation(char32_t c, uint8_t p);
 
-uint8_t translateChar(uint32_t c);
+    uint8_t translateChar(uint32_t c) const;
 
+private:
+    std::unordered_map<int32_t, uint8_t> charTranslate;
+    Translation currentTranslation = Translation::Ascii;
+};
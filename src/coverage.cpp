@@ -0,0 +1,123 @@
+#include "coverage.h"
+#include "assembler.h"
+#include "emulator.h"
+
+#include <coreutils/file.h>
+#include <fmt/format.h>
+
+namespace {
+
+// What the instructions of one source line did. Lines assembled more than
+// once (macros, `!rept`) count as run if any copy was run.
+struct LineCoverage
+{
+    struct Branch
+    {
+        bool run;
+        bool taken;
+        bool notTaken;
+    };
+    bool run = false;
+    std::vector<Branch> branches;
+};
+
+using FileCoverage = std::map<size_t, LineCoverage>;
+
+std::map<std::string, FileCoverage> collect(sixfive::Coverage const& coverage,
+                                            Assembler& assem)
+{
+    using sixfive::Coverage;
+    std::map<std::string, FileCoverage> files;
+    for (auto const& [adr, source] : assem.getSourceLines()) {
+        auto name = source.file.empty() ? std::string("<source>")
+                                         : fs::absolute(source.file).string();
+        auto& line = files[name][source.line];
+        bool run = Coverage::test(coverage.executed, adr);
+        line.run = line.run || run;
+        if (source.branch) {
+            line.branches.push_back({run, Coverage::test(coverage.taken, adr),
+                                     Coverage::test(coverage.notTaken, adr)});
+        }
+    }
+    return files;
+}
+
+std::string lcov(std::map<std::string, FileCoverage> const& files)
+{
+    std::string text;
+    for (auto const& [name, lines] : files) {
+        text += fmt::format("TN:\nSF:{}\n", name);
+        size_t found = 0;
+        size_t hit = 0;
+        size_t branches = 0;
+        size_t branchesHit = 0;
+        for (auto const& [no, line] : lines) {
+            for (size_t i = 0; i < line.branches.size(); i++) {
+                auto const& branch = line.branches[i];
+                for (int b = 0; b < 2; b++) {
+                    bool done = b == 0 ? branch.taken : branch.notTaken;
+                    text += fmt::format("BRDA:{},{},{},{}\n", no, i, b,
+                                        branch.run ? (done ? "1" : "0") : "-");
+                    branches++;
+                    branchesHit += done ? 1 : 0;
+                }
+            }
+            text += fmt::format("DA:{},{}\n", no, line.run ? 1 : 0);
+            found++;
+            hit += line.run ? 1 : 0;
+        }
+        text += fmt::format("BRF:{}\nBRH:{}\nLF:{}\nLH:{}\nend_of_record\n",
+                            branches, branchesHit, found, hit);
+    }
+    return text;
+}
+
+std::string report(std::map<std::string, FileCoverage> const& files)
+{
+    std::string text;
+    size_t totalLines = 0;
+    size_t totalHit = 0;
+    for (auto const& [name, lines] : files) {
+        size_t hit = 0;
+        size_t branches = 0;
+        size_t branchesHit = 0;
+        std::string missed;
+        for (auto const& [no, line] : lines) {
+            hit += line.run ? 1 : 0;
+            branches += line.branches.size() * 2;
+            if (!line.run) {
+                missed += fmt::format("  {}: not run\n", no);
+                continue;
+            }
+            for (auto const& branch : line.branches) {
+                branchesHit +=
+                    (branch.taken ? 1 : 0) + (branch.notTaken ? 1 : 0);
+                if (!branch.taken) {
+                    missed += fmt::format("  {}: branch never taken\n", no);
+                } else if (!branch.notTaken) {
+                    missed += fmt::format("  {}: branch always taken\n", no);
+                }
+            }
+        }
+        text += fmt::format("{}: {}/{} lines, {}/{} branches\n{}", name, hit,
+                            lines.size(), branchesHit, branches, missed);
+        totalLines += lines.size();
+        totalHit += hit;
+    }
+    auto percent = totalLines == 0 ? 100.0 : totalHit * 100.0 / totalLines;
+    text += fmt::format("TOTAL: {}/{} lines ({:.1f}%)\n", totalHit,
+                        totalLines, percent);
+    return text;
+}
+
+} // namespace
+
+void writeCoverage(std::string const& fileName,
+                   sixfive::Coverage const& coverage, Assembler& assem)
+{
+    auto files = collect(coverage, assem);
+    auto ext = fs::path(fileName).extension();
+    utils::File f{fileName, utils::File::Mode::Write};
+    f.writeString(ext == ".info" || ext == ".lcov" ? lcov(files)
+                                                   : report(files));
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+class Assembler;
+namespace sixfive {
+struct Coverage;
+} // namespace sixfive
+
+// Write the source lines and branches covered by `coverage` to `fileName`,
+// using the source lines `assem` kept for each instruction. Files ending in
+// `.info` or `.lcov` are written in LCOV format, others as a text report
+// listing what was not covered.
+void writeCoverage(std::string const& fileName,
+                   sixfive::Coverage const& coverage, Assembler& assem);
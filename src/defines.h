@@ -1,37 +1,30 @@
 #pragma once
 
 #include "6502.h"
+#include "bytes.h"
+#include "reloc.h"
 #include "symbol_table.h"
 
 #include <any>
 #include <coreutils/file.h>
 #include <memory>
+#include <optional>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
 #include <filesystem>
+#include <functional>
+#include <thread>
 namespace fs = std::filesystem;
 
-// using Number = double;
-
-// Update string view so contents is stored persistently
-inline std::string const& persist(std::string_view& sv)
-{
-    static std::unordered_set<std::string> persisted;
-    auto const& res = *persisted.emplace(sv).first;
-    sv = res;
-    return res;
-}
+#ifdef _WIN32
+#    include <process.h>
+#else
+#    include <unistd.h>
+#endif
 
-// Store string and return string_view to it
-inline std::string_view persist(std::string const& s)
-{
-    std::string_view sv(s);
-    persist(sv);
-    return sv;
-}
+// using Number = double;
 
 inline utils::File createFile(fs::path const& p)
 {
@@ -101,17 +94,6 @@ struct Num
     explicit operator bool() const { return d != 0; }
 };
 
-inline std::string_view operator+(std::string_view sv, Num n)
-{
-    return persist(std::string(sv) + std::to_string(n.i()));
-}
-
-inline std::string_view operator+(std::string_view sv,
-                                  std::string_view n)
-{
-    return persist(std::string(sv) + std::string(n));
-}
-
 using Number = double;
 
 inline Num div(Num a, Num b)
@@ -167,6 +149,8 @@ struct Instruction
     std::string_view opcode;
     sixfive::Mode mode;
     int32_t val;
+    // Relocatable argument, when assembling an object file
+    std::optional<reloc::Value> reloc;
 };
 
 inline std::string getHomeDir()
@@ -193,21 +177,49 @@ inline std::string getHomeDir()
     return homeDir;
 }
 
+// Suffix for temporary files that is unique to the calling process and
+// thread, so files can be written next to their target and then renamed
+inline std::string tempSuffix()
+{
+#ifdef _WIN32
+    auto pid = _getpid();
+#else
+    auto pid = getpid();
+#endif
+    return fmt::format(".{}.{:x}", pid,
+                       std::hash<std::thread::id>{}(std::this_thread::get_id()));
+}
+
+// While set, output of the calling thread is collected here instead of
+// going to stdout, so sources assembled side by side do not interleave
+inline thread_local std::string* outputBuffer = nullptr;
+
+template <typename... ARGS>
+void printOut(std::string_view format, ARGS const&... args)
+{
+    auto text = fmt::format(format, args...);
+    if (outputBuffer != nullptr) {
+        *outputBuffer += text;
+    } else {
+        fputs(text.c_str(), stdout);
+    }
+}
+
 std::string any_to_string(std::any const& val);
 
 inline void printArg(std::any const& arg)
 {
     if (auto const* l = std::any_cast<Number>(&arg)) {
         if (*l == trunc(*l)) {
-            fmt::print("${:x}", static_cast<int32_t>(*l));
+            printOut("${:x}", static_cast<int32_t>(*l));
         } else {
-            fmt::print("{}", *l);
+            printOut("{}", *l);
         }
     } else if (auto const* s = std::any_cast<std::string_view>(&arg)) {
-        fmt::print("{}", *s);
-    } else if (auto const* v = std::any_cast<std::vector<uint8_t>>(&arg)) {
+        printOut("{}", *s);
+    } else if (auto const* v = std::any_cast<Bytes>(&arg)) {
         for (auto const& item : *v) {
-            fmt::print("{:02x} ", item);
+            printOut("{:02x} ", item);
         }
     }
 }
@@ -218,3 +230,34 @@ struct RegState
     std::unordered_map<uint16_t, uint8_t> ram;
 };
 
+// Copy of the entire emulator memory
+using MemSnapshot = std::shared_ptr<std::vector<uint8_t> const>;
+
+// Registers and memory after running code in the emulator
+struct RunResult
+{
+    uint32_t cycles = 0;
+    // False if stopped before returning, by the cycle limit or a break
+    bool ended = true;
+    // A, X, Y, SR, SP, PC
+    std::array<unsigned, 6> regs{};
+    // Memory before running, and the pages that may have changed since
+    MemSnapshot base;
+    std::vector<std::pair<uint8_t, std::array<uint8_t, 256>>> pages;
+    // The pages of `base` that were read while running
+    std::vector<uint8_t> reads;
+    // What the run covered, as returned by `sixfive::Coverage::marked()`
+    std::vector<std::pair<uint16_t, uint8_t>> covered;
+
+    Bytes ram() const
+    {
+        if (pages.empty()) return Bytes(base);
+        auto data = *base;
+        for (auto const& [page, contents] : pages) {
+            std::copy(contents.begin(), contents.end(),
+                      data.begin() + page * 256);
+        }
+        return data;
+    }
+};
+
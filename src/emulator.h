@@ -1,8 +1,11 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <limits>
+#include <map>
+#include <memory>
 #include <tuple>
 #include <vector>
 
@@ -22,10 +25,197 @@ struct Machine;
 
 enum EmulatedMemoryAccess
 {
-    Direct,  // Access `ram` array directly; Means no bank switching, ROM areas
-             // or IO areas
-    Banked,  // Access memory through `wbank` and `rbank`; Means no IO areas
-    Callback // Access memory via function pointer per bank
+    Direct,   // Access `ram` array directly; Means no bank switching, ROM
+              // areas or IO areas
+    Banked,   // Access memory through `wbank` and `rbank`; Means no IO areas
+    Callback, // Access memory via function pointer per bank
+    Mapped    // Use function pointers only for banks mapped to callbacks,
+              // and `wbank` and `rbank` for all others
+};
+
+enum EmulatorCore
+{
+    JumpTable, // Call each instruction through a table of function pointers
+    Switch,    // Dispatch through one switch with all instructions inlined
+    Blocks     // Run cached blocks of predecoded instructions
+};
+
+// What a watchpoint reacts to; see `Machine::watch()`
+enum WatchKind
+{
+    WatchRead = 1,
+    WatchWrite = 2,
+    WatchExec = 4
+};
+
+enum EmulatorTiming
+{
+    FixedCycles, // Count the cycles from the instruction table only
+    ExactCycles  // Also count page crossings, branches and 65C02 decimal mode
+};
+
+// Execution counters, collected while a profile is set with
+// `set_profile()`. Counts are indexed by the address of each instruction.
+// Subroutines are found from `jsr` and `rts`; a `rts` returns from every
+// subroutine whose return address it pops.
+struct Profile
+{
+    struct Calls
+    {
+        uint64_t calls = 0;
+        uint64_t inclusive = 0; // Cycles including called subroutines
+        uint64_t exclusive = 0; // Only for `functions`
+    };
+
+    std::vector<uint64_t> counts = std::vector<uint64_t>(0x10000);
+    std::vector<uint64_t> cycles = std::vector<uint64_t>(0x10000);
+    // Executions per opcode
+    std::array<uint64_t, 256> opcodes{};
+    // Subroutines by start address, and calls between them by caller and
+    // callee. The code that a run started in also counts as a subroutine.
+    std::map<uint16_t, Calls> functions;
+    std::map<std::pair<uint16_t, uint16_t>, Calls> edges;
+    uint64_t total = 0;
+
+    void record(unsigned pc, unsigned code, uint32_t spent, uint8_t sp,
+                unsigned to)
+    {
+        counts[pc]++;
+        cycles[pc] += spent;
+        opcodes[code]++;
+        total += spent;
+        if (frames.empty()) {
+            frames.push_back({static_cast<uint16_t>(pc), 0xff, total - spent});
+        }
+        if (code == 0x20) { // jsr
+            frames.push_back({static_cast<uint16_t>(to), sp, total});
+        } else if (code == 0x60) { // rts
+            while (frames.size() > 1 && frames.back().sp < sp) {
+                leave();
+            }
+        }
+    }
+
+    // Leave all subroutines; Called when a run ends
+    void finish()
+    {
+        while (!frames.empty()) {
+            leave();
+        }
+    }
+
+    // Add the counts of `other`, which must be finished
+    void merge(Profile const& other)
+    {
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += other.counts[i];
+            cycles[i] += other.cycles[i];
+        }
+        for (size_t i = 0; i < opcodes.size(); i++) {
+            opcodes[i] += other.opcodes[i];
+        }
+        for (auto const& [adr, calls] : other.functions) {
+            auto& fn = functions[adr];
+            fn.calls += calls.calls;
+            fn.inclusive += calls.inclusive;
+            fn.exclusive += calls.exclusive;
+        }
+        for (auto const& [edge, calls] : other.edges) {
+            auto& e = edges[edge];
+            e.calls += calls.calls;
+            e.inclusive += calls.inclusive;
+        }
+        total += other.total;
+    }
+
+    void clear() { *this = Profile{}; }
+
+private:
+    struct Frame
+    {
+        uint16_t function;
+        uint8_t sp; // Stack pointer after the return address was pushed
+        uint64_t start;
+        uint64_t children = 0;
+    };
+    std::vector<Frame> frames;
+
+    void leave()
+    {
+        auto frame = frames.back();
+        frames.pop_back();
+        auto inclusive = total - frame.start;
+        auto& fn = functions[frame.function];
+        fn.calls++;
+        fn.inclusive += inclusive;
+        fn.exclusive += inclusive - frame.children;
+        if (!frames.empty()) {
+            auto& parent = frames.back();
+            parent.children += inclusive;
+            auto& edge = edges[{parent.function, frame.function}];
+            edge.calls++;
+            edge.inclusive += inclusive;
+        }
+    }
+};
+
+// Addresses of executed instructions, collected while set with
+// `set_coverage()`. For branches, also whether they were taken and not
+// taken. Each is a bitmap with one bit per address.
+struct Coverage
+{
+    std::vector<uint8_t> executed = std::vector<uint8_t>(0x2000);
+    std::vector<uint8_t> taken = std::vector<uint8_t>(0x2000);
+    std::vector<uint8_t> notTaken = std::vector<uint8_t>(0x2000);
+
+    static bool test(std::vector<uint8_t> const& bits, unsigned adr)
+    {
+        return (bits[adr >> 3] & (1 << (adr & 7))) != 0;
+    }
+    static void set(std::vector<uint8_t>& bits, unsigned adr)
+    {
+        bits[adr >> 3] |= 1 << (adr & 7);
+    }
+
+    // Add everything covered in `other`
+    void merge(Coverage const& other)
+    {
+        for (size_t i = 0; i < executed.size(); i++) {
+            executed[i] |= other.executed[i];
+            taken[i] |= other.taken[i];
+            notTaken[i] |= other.notTaken[i];
+        }
+    }
+
+    // The non zero bytes of all bitmaps, as offsets into them laid end to
+    // end, so what one run covered can be kept and added again later
+    std::vector<std::pair<uint16_t, uint8_t>> marked() const
+    {
+        std::vector<std::pair<uint16_t, uint8_t>> result;
+        size_t offset = 0;
+        for (auto const* bits : {&executed, &taken, &notTaken}) {
+            for (size_t i = 0; i < bits->size(); i++) {
+                if ((*bits)[i] != 0) {
+                    result.emplace_back(offset + i, (*bits)[i]);
+                }
+            }
+            offset += bits->size();
+        }
+        return result;
+    }
+
+    // Add bytes returned by `marked()`
+    void add(std::vector<std::pair<uint16_t, uint8_t>> const& bytes)
+    {
+        for (auto [offset, bits] : bytes) {
+            auto& map = offset < 0x2000   ? executed
+                        : offset < 0x4000 ? taken
+                                          : notTaken;
+            map[offset & 0x1fff] |= bits;
+        }
+    }
+
+    void clear() { *this = Coverage{}; }
 };
 
 // The Policy defines the compile & runtime time settings for the emulator
@@ -40,13 +230,27 @@ struct DefaultPolicy
     static constexpr int PC_AccessMode = Banked;
 
     // Generic reads and writes should normally not be direct
-    static constexpr int Read_AccessMode = Callback;
-    static constexpr int Write_AccessMode = Callback;
+    static constexpr int Read_AccessMode = Mapped;
+    static constexpr int Write_AccessMode = Mapped;
 
     static constexpr int MemSize = 65536;
 
+    // How instructions are dispatched; see `EmulatorCore`
+    static constexpr int Core = JumpTable;
+
+    // How cycles are counted; see `EmulatorTiming`
+    static constexpr int Timing = FixedCycles;
+
+    // Mark coverage from the `Switch` and `Blocks` cores, at the cost of a
+    // test per instruction, instead of running the traced loop
+    static constexpr bool CoreCoverage = false;
+
     // This function is run after each opcode. Return true to stop emulation.
     static constexpr bool eachOp(DefaultPolicy&) { return false; }
+
+    // Checked at the start of `run()`. Return false if `eachOp()` does not
+    // need to be called at all, so the loop can do without it.
+    static constexpr bool watchOps(DefaultPolicy&) { return true; }
 };
 
 template <typename POLICY = DefaultPolicy>
@@ -82,12 +286,7 @@ struct Machine
     Machine(Machine&& op) noexcept = default;
     Machine& operator=(Machine&& op) noexcept = default;
 
-    Opcode illgal_opcode = {
-        0xff, 0, Mode::IMM, [](Machine& m) {
-            fmt::print("** Illegal opcode at {:04x}\n", m.regPC());
-            m.realCycles = m.cycles;
-            m.cycles = std::numeric_limits<uint32_t>::max() - 32;
-        }};
+    Opcode illgal_opcode = {0xff, 0, Mode::IMM, Illegal};
 
     Machine()
     {
@@ -105,12 +304,17 @@ struct Machine
             wcallbacks.at(i) = &write_bank;
             wcbdata.at(i) = this;
         }
+        if constexpr (Predecoded) {
+            blocks.resize(0x10000);
+            codeBytes.resize(0x10000);
+        }
         set_cpu(false);
         jumpTable = &jumpTable_normal[0];
     }
 
     void set_cpu(bool cpu6502)
     {
+        cpu65c02 = cpu6502;
 
         for (int i = 0; i < 256; i++) {
             jumpTable_normal[i] = illgal_opcode;
@@ -124,26 +328,84 @@ struct Machine
             for (const auto& o : i.opcodes)
                 jumpTable_bcd[o.code] = o;
         }
+        invalidate_blocks();
     }
 
-    POLICY& policy()
+    POLICY& policy() { return currentPolicy; }
+
+    // Count every instruction in `p` while running, or stop counting if
+    // null. Runs are slower with a profile, since instructions are always
+    // dispatched through the jump table.
+    void set_profile(Profile* p) { currentProfile = p; }
+    Profile* profile() const { return currentProfile; }
+
+    // Mark executed instructions in `c` while running, or stop if null.
+    // Like with a profile, runs go through the jump table.
+    void set_coverage(Coverage* c) { currentCoverage = c; }
+    Coverage* coverage() const { return currentCoverage; }
+
+    // Put the registers back in their power on state
+    void reset_regs()
     {
-        static POLICY policy(*this);
-        return policy;
+        sp = 0xff;
+        a = x = y = 0;
+        sr = 0x30;
+        result = 0;
+        jumpTable = &jumpTable_normal[0];
+        irqPending = false;
     }
 
     // Access ram directly
 
     const Word& get_stack(const Word& adr) const { return stack[adr]; }
 
-    void write_ram(uint16_t org, const Word data) { ram[org] = data; }
+    void write_ram(uint16_t org, const Word data)
+    {
+        mark_dirty(org >> 8);
+        invalidate_code(org);
+        ram[org] = data;
+    }
 
     void write_ram(uint16_t org, const uint8_t* data, size_t size)
     {
-        for (size_t i = 0; i < size; i++)
+        for (size_t i = 0; i < size; i++) {
+            mark_dirty((org + i) >> 8);
+            invalidate_code(org + i);
             ram[org + i] = data[i];
+        }
     }
 
+    using Snapshot = std::shared_ptr<std::vector<Word> const>;
+
+    // Save the contents of RAM. From now on, writes remember which pages
+    // they touched, so `restore()` only needs to copy those back.
+    Snapshot snapshot()
+    {
+        static_assert(POLICY::MemSize == 0x10000);
+        auto s = std::make_shared<std::vector<Word> const>(ram.begin(),
+                                                           ram.end());
+        clear_dirty();
+        return s;
+    }
+
+    void restore(Snapshot const& s)
+    {
+        for (unsigned i = 0; i < dirtyCount; i++) {
+            auto offset = dirtyList[i] * 256;
+            std::copy_n(s->begin() + offset, 256, ram.begin() + offset);
+            invalidate_page(dirtyList[i]);
+        }
+        clear_dirty();
+    }
+
+    // Pages that may have been written since the last snapshot or restore
+    uint8_t const* dirty_pages() const { return dirtyList.data(); }
+    unsigned dirty_count() const { return dirtyCount; }
+
+    // Pages that were read since the last snapshot or restore
+    std::array<bool, 256> const& read_pages() const { return readPages; }
+    void mark_read(unsigned page) const { readPages[page] = true; }
+
     void write_memory(uint16_t org, const uint8_t* data, size_t size)
     {
         for (size_t i = 0; i < size; i++)
@@ -176,36 +438,152 @@ struct Machine
             rbank[bank++] = const_cast<Word*>(data); // NOLINT
             data += 256;
         }
+        invalidate_blocks();
     }
 
     void map_read_callback(uint8_t bank, int len, void* data,
                          uint8_t (*cb)(uint16_t, void*))
     {
         while (len > 0) {
-            rcallbacks[bank] = cb;  // NOLINT
-            rcbdata[bank++] = data; // NOLINT
+            if (rcallbacks[bank] == &watch_read) {
+                // Keep watching, on top of the new callback
+                watchedReads[bank++] = {cb, data};
+                len--;
+                continue;
+            }
+            readMapped[bank] = cb != &read_bank; // NOLINT
+            rcallbacks[bank] = cb;               // NOLINT
+            rcbdata[bank++] = data;              // NOLINT
             len--;
         }
+        invalidate_blocks();
     }
     void map_write_callback(uint8_t bank, int len, void* data,
                           void (*cb)(uint16_t, uint8_t, void*))
     {
         while (len > 0) {
-            wcallbacks[bank] = cb;  // NOLINT
-            wcbdata[bank++] = data; // NOLINT
+            if (wcallbacks[bank] == &watch_write) {
+                watchedWrites[bank++] = {cb, data};
+                len--;
+                continue;
+            }
+            writeMapped[bank] = cb != &write_bank; // NOLINT
+            wcallbacks[bank] = cb;                 // NOLINT
+            wcbdata[bank++] = data;                // NOLINT
             len--;
         }
     }
 
-    void irq(unsigned adr)
+    // Called with the address, value and `WatchKind` of a watched access
+    using WatchFn = void (*)(Machine&, unsigned adr, unsigned value, int kind,
+                             void*);
+
+    // Call `fn` for every access of a `WatchKind` in `kinds` to addresses
+    // from `start` up to (not including) `end`. For reads and writes, the
+    // callbacks of pages with watches are replaced by ones that check the
+    // address, so only those pages take the slow path, and only with
+    // `Callback` or `Mapped` access. Watching execution makes runs go
+    // through the jump table.
+    void watch(unsigned start, unsigned end, int kinds, WatchFn fn,
+               void* data)
     {
-        stack[sp] = pc >> 8;
-        stack[sp - 1] = pc & 0xff;
-        stack[sp - 2] = get_SR();
-        sp -= 3;
-        pc = adr;
+        if (watched.empty()) {
+            watched.resize(0x10000);
+        }
+        watchFn = fn;
+        watchData = data;
+        end = std::min(end, 0x10000U);
+        for (auto adr = start; adr < end; adr++) {
+            watched[adr] |= kinds;
+        }
+        for (auto page = hi(start); start < end && page <= hi(end - 1);
+             page++) {
+            update_watches(page);
+        }
+        execWatched = execWatched || (kinds & WatchExec) != 0;
+    }
+
+    void clear_watches()
+    {
+        if (watched.empty()) return;
+        std::fill(watched.begin(), watched.end(), 0);
+        for (unsigned page = 0; page < 256; page++) {
+            update_watches(page);
+        }
+        execWatched = false;
+    }
+
+    // Registers before an instruction was run
+    struct HistoryEntry
+    {
+        uint16_t pc;
+        uint8_t a;
+        uint8_t x;
+        uint8_t y;
+        uint8_t sr;
+        uint8_t sp;
+    };
+
+    // Remember the last `size` instructions run, or stop if 0. Like
+    // watching execution, this makes runs go through the jump table.
+    void set_history(unsigned size)
+    {
+        historyRing.assign(size, {});
+        historyCount = 0;
+    }
+
+    // The remembered instructions, oldest first
+    std::vector<HistoryEntry> history() const
+    {
+        auto size = static_cast<unsigned>(historyRing.size());
+        auto count = std::min(historyCount, size);
+        std::vector<HistoryEntry> result;
+        result.reserve(count);
+        for (auto i = historyCount - count; i < historyCount; i++) {
+            result.push_back(historyRing[i % size]);
+        }
+        return result;
+    }
+
+    // Take an interrupt through the IRQ vector. Machines with the vector
+    // elsewhere can give its address. If the I flag is set, returns false
+    // and keeps the interrupt pending, like a held IRQ line, until `cli`,
+    // `plp` or `rti` clears the flag or `clear_irq()` is called.
+    bool irq(unsigned vector = 0xfffe)
+    {
+        if ((sr & (1 << IRQ)) != 0) {
+            irqPending = true;
+            irqVector = vector;
+            return false;
+        }
+        irqPending = false;
+        interrupt(vector);
+        return true;
     }
 
+    // Drop a pending interrupt, once its source was acknowledged
+    void clear_irq() { irqPending = false; }
+
+    // Take a non maskable interrupt through the NMI vector
+    void nmi() { interrupt(0xfffa); }
+
+    using EventFn = void (*)(Machine&, void*);
+
+    // Call `fn` once `elapsed()` reaches `at`. Events are run between
+    // instructions, so they can be up to one instruction late. `run()`
+    // stops its loop at the next event, so pending events cost nothing
+    // per instruction.
+    void schedule(uint64_t at, EventFn fn, void* data)
+    {
+        events.push_back({at, fn, data});
+        std::push_heap(events.begin(), events.end(), laterEvent);
+    }
+
+    void clear_events() { events.clear(); }
+
+    // Cycles run since the machine was created
+    uint64_t elapsed() const { return totalCycles + cycles; }
+
     template <enum Reg REG>
     unsigned get() const
     {
@@ -218,26 +596,39 @@ struct Machine
     }
 
     Adr regPC() const { return pc; }
+    // Cycles used by the last `run()`
+    uint32_t run_cycles() const { return cycles; }
     void setPC(const uint16_t& p) { pc = p; }
 
     uint32_t run(uint32_t toCycles = 0x01000000)
     {
-        auto& p = policy();
         cycles = 0;
         realCycles = 0;
-        while (cycles < toCycles) {
-            if (POLICY::eachOp(p)) break;
-            auto code = ReadPC();
-            auto& op = jumpTable[code];
-            op.op(*this);
-            cycles += op.cycles;
+        bool watch = POLICY::watchOps(policy());
+        while (true) {
+            runEvents();
+            if (cycles >= toCycles) break;
+            uint32_t limit = toCycles;
+            if (!events.empty() && events.front().at < totalCycles + limit) {
+                limit = events.front().at - totalCycles;
+            }
+            if (watch) {
+                runCore<true>(limit);
+            } else {
+                runCore<false>(limit);
+            }
+            // Stopped by the program or by `eachOp()`
+            if (realCycles != 0 || cycles < limit) break;
         }
         if (realCycles != 0) {
             cycles = realCycles;
             realCycles = 0;
-        } else
+        } else {
+            totalCycles += cycles;
             return 0;
+        }
 
+        totalCycles += cycles;
         return cycles;
     }
 
@@ -273,6 +664,22 @@ private:
 
     // Current jumptable
     const Opcode* jumpTable;
+    bool cpu65c02 = false;
+
+    static constexpr bool Predecoded = POLICY::Core == Blocks;
+    static constexpr bool CoveredInCore =
+        POLICY::CoreCoverage && POLICY::Core != JumpTable;
+
+    struct Block;
+    // With the block core; Cached blocks by start address, the blocks
+    // touching each page and the addresses they were decoded from
+    std::vector<std::unique_ptr<Block>> blocks;
+    std::array<std::vector<uint16_t>, 256> pageBlocks;
+    std::vector<uint8_t> codeBytes;
+    std::unique_ptr<Block> uncachedBlock;
+    bool blocksChanged = false;
+    // Operand bytes of the current predecoded instruction
+    unsigned operand = 0;
 
     // Stack normally points to ram[0x100];
     Word* stack;
@@ -283,6 +690,167 @@ private:
     BreakFn breakFunction = nullptr;
     void* breakData = nullptr;
 
+    // Set by `irq()` while the I flag kept it from being taken
+    bool irqPending = false;
+    unsigned irqVector = 0xfffe;
+
+    Profile* currentProfile = nullptr;
+    Coverage* currentCoverage = nullptr;
+
+    // `WatchKind` bits by address, empty until something is watched
+    std::vector<uint8_t> watched;
+    bool execWatched = false;
+    bool stackWatched = false;
+    WatchFn watchFn = nullptr;
+    void* watchData = nullptr;
+    // The callbacks replaced on watched pages
+    std::array<std::pair<Word (*)(uint16_t, void*), void*>, 256>
+        watchedReads{};
+    std::array<std::pair<void (*)(uint16_t, Word, void*), void*>, 256>
+        watchedWrites{};
+
+    std::vector<HistoryEntry> historyRing;
+    unsigned historyCount = 0;
+
+    // Put `watch_read` and `watch_write` on `page` if it has watches,
+    // or restore the original callbacks if not
+    void update_watches(unsigned page)
+    {
+        int kinds = 0;
+        for (unsigned i = 0; i < 256; i++) {
+            kinds |= watched[page * 256 + i];
+        }
+        bool reading = rcallbacks[page] == &watch_read;
+        if ((kinds & WatchRead) != 0 && !reading) {
+            watchedReads[page] = {rcallbacks[page], rcbdata[page]};
+            rcallbacks[page] = &watch_read;
+            rcbdata[page] = this;
+            readMapped[page] = true;
+        } else if ((kinds & WatchRead) == 0 && reading) {
+            std::tie(rcallbacks[page], rcbdata[page]) = watchedReads[page];
+            readMapped[page] = rcallbacks[page] != &read_bank;
+        }
+        bool writing = wcallbacks[page] == &watch_write;
+        if ((kinds & WatchWrite) != 0 && !writing) {
+            watchedWrites[page] = {wcallbacks[page], wcbdata[page]};
+            wcallbacks[page] = &watch_write;
+            wcbdata[page] = this;
+            writeMapped[page] = true;
+        } else if ((kinds & WatchWrite) == 0 && writing) {
+            std::tie(wcallbacks[page], wcbdata[page]) = watchedWrites[page];
+            writeMapped[page] = wcallbacks[page] != &write_bank;
+        }
+        if (page == 1) {
+            stackWatched = (kinds & (WatchRead | WatchWrite)) != 0;
+        }
+    }
+
+    // The stack is used directly, so watches on it are checked here
+    Word stackRead(int offset)
+    {
+        auto v = stack[offset];
+        if (stackWatched) watchStack(offset, v, WatchRead);
+        return v;
+    }
+
+    void stackWrite(int offset, Word v)
+    {
+        stack[offset] = v;
+        if (stackWatched) watchStack(offset, v, WatchWrite);
+    }
+
+    void watchStack(int offset, Word v, int kind)
+    {
+        auto adr = (0x100 + offset) & 0xffff;
+        if ((watched[adr] & kind) != 0) {
+            watchFn(*this, adr, v, kind, watchData);
+        }
+    }
+
+    static Word watch_read(uint16_t adr, void* ptr)
+    {
+        auto* m = static_cast<Machine*>(ptr);
+        auto const& [cb, data] = m->watchedReads[adr >> 8];
+        auto v = cb(adr, data);
+        if ((m->watched[adr] & WatchRead) != 0) {
+            m->watchFn(*m, adr, v, WatchRead, m->watchData);
+        }
+        return v;
+    }
+
+    static void watch_write(uint16_t adr, Word v, void* ptr)
+    {
+        auto* m = static_cast<Machine*>(ptr);
+        auto const& [cb, data] = m->watchedWrites[adr >> 8];
+        cb(adr, v, data);
+        if ((m->watched[adr] & WatchWrite) != 0) {
+            m->watchFn(*m, adr, v, WatchWrite, m->watchData);
+        }
+    }
+
+    // Instructions need to be looked at one at a time
+    bool traced() const
+    {
+        return currentProfile != nullptr ||
+               (currentCoverage != nullptr && !CoveredInCore) || execWatched ||
+               !historyRing.empty();
+    }
+
+    struct Event
+    {
+        uint64_t at;
+        EventFn fn;
+        void* data;
+    };
+
+    // Scheduled events, as a heap with the earliest event first
+    std::vector<Event> events;
+    // Cycles of all earlier calls to `run()`
+    uint64_t totalCycles = 0;
+
+    static bool laterEvent(Event const& a, Event const& b)
+    {
+        return a.at > b.at;
+    }
+
+    void runEvents()
+    {
+        while (!events.empty() && events.front().at <= elapsed()) {
+            std::pop_heap(events.begin(), events.end(), laterEvent);
+            auto e = events.back();
+            events.pop_back();
+            e.fn(*this, e.data);
+        }
+    }
+
+    // Take a pending interrupt after an instruction cleared the I flag
+    void pendingIrq()
+    {
+        if (irqPending && (sr & (1 << IRQ)) == 0) {
+            irqPending = false;
+            interrupt(irqVector);
+        }
+    }
+
+    void interrupt(unsigned vector)
+    {
+        stackWrite(sp, pc >> 8);
+        stackWrite(sp - 1, pc & 0xff);
+        // The B flag is only set when pushed by `brk`
+        stackWrite(sp - 2, get_SR() & ~(1 << BRK));
+        sp -= 3;
+        sr |= 1 << IRQ;
+        if (cpu65c02) {
+            sr &= ~d_FLAG;
+            setDec<false>();
+        }
+        pc = read_mem(vector) | (read_mem(vector + 1) << 8);
+    }
+
+    // Each machine has its own policy, so several machines can be used
+    // at the same time
+    POLICY currentPolicy{*this};
+
     // Banks normally point to corresponding ram
     std::array<const Word*, 256> rbank{};
     std::array<Word*, 256> wbank{};
@@ -290,20 +858,50 @@ private:
     std::array<Word (*)(uint16_t, void*), 256> rcallbacks{};
     std::array<void*, 256> rcbdata{};
     std::array<void (*)(uint16_t, Word, void*), 256> wcallbacks{};
+    // Banks with callbacks other than `read_bank` and `write_bank`
+    std::array<bool, 256> readMapped{};
+    std::array<bool, 256> writeMapped{};
     std::array<void*, 256> wcbdata{};
 
     std::array<Opcode, 256> jumpTable_normal;
     std::array<Opcode, 256> jumpTable_bcd;
 
+    // Pages written since the last snapshot
+    std::array<bool, 256> dirty{};
+    std::array<uint8_t, 256> dirtyList{};
+    unsigned dirtyCount = 0;
+    // Pages read since the last snapshot
+    mutable std::array<bool, 256> readPages{};
+
     static void write_bank(uint16_t adr, Word v, void* ptr)
     {
         auto* m = static_cast<Machine*>(ptr);
+        m->mark_dirty(adr >> 8);
         m->wbank[adr >> 8][adr & 0xff] = v & 0xff;
     }
 
+    void mark_dirty(unsigned page)
+    {
+        if (!dirty[page]) {
+            dirty[page] = true;
+            dirtyList[dirtyCount++] = page;
+        }
+    }
+
+    void clear_dirty()
+    {
+        dirty.fill(false);
+        dirtyCount = 0;
+        readPages.fill(false);
+        // The stack is accessed directly, so always count it as used
+        mark_dirty(1);
+        mark_read(1);
+    }
+
     static Word read_bank(uint16_t adr, void* ptr)
     {
         auto* m = static_cast<Machine*>(ptr);
+        m->mark_read(adr >> 8);
         return m->rbank[adr >> 8][adr & 0xff];
     }
 
@@ -435,34 +1033,64 @@ private:
     template <int ACCESS_MODE = POLICY::Read_AccessMode>
     unsigned Read(unsigned adr) const
     {
-        if constexpr (ACCESS_MODE == Direct)
+        if constexpr (ACCESS_MODE == Direct) {
+            mark_read(hi(adr));
             return ram[adr];
-        else if constexpr (ACCESS_MODE == Banked)
+        } else if constexpr (ACCESS_MODE == Banked) {
+            mark_read(hi(adr));
             return rbank[hi(adr)][lo(adr)];
-        else
+        } else if constexpr (ACCESS_MODE == Mapped) {
+            if (readMapped[hi(adr)]) {
+                return rcallbacks[hi(adr)](adr, rcbdata[hi(adr)]);
+            }
+            mark_read(hi(adr));
+            return rbank[hi(adr)][lo(adr)];
+        } else
             return rcallbacks[hi(adr)](adr, rcbdata[hi(adr)]);
     }
 
     template <int ACCESS_MODE = POLICY::Write_AccessMode>
     void Write(unsigned adr, unsigned v)
     {
-        if constexpr (ACCESS_MODE == Direct)
+        invalidate_code(adr);
+        if constexpr (ACCESS_MODE == Direct) {
+            mark_dirty(hi(adr));
             ram[adr] = v;
-        else if constexpr (ACCESS_MODE == Banked)
+        } else if constexpr (ACCESS_MODE == Banked) {
+            mark_dirty(hi(adr));
             wbank[hi(adr)][lo(adr)] = v;
-        else
+        } else if constexpr (ACCESS_MODE == Mapped) {
+            if (writeMapped[hi(adr)]) {
+                wcallbacks[hi(adr)](adr, v, wcbdata[hi(adr)]);
+                return;
+            }
+            mark_dirty(hi(adr));
+            wbank[hi(adr)][lo(adr)] = v;
+        } else
             wcallbacks[hi(adr)](adr, v, wcbdata[hi(adr)]);
     }
 
-    unsigned ReadPC() { return Read<POLICY::PC_AccessMode>(pc++); }
-
-    unsigned ReadPC8(unsigned offs = 0)
+    // With predecoded instructions, operand bytes are taken from
+    // `operand` instead of memory
+    unsigned ReadPC()
     {
-        return (Read<POLICY::PC_AccessMode>(pc++) + offs) & 0xff;
+        if constexpr (Predecoded) {
+            pc++;
+            auto v = operand & 0xff;
+            operand >>= 8;
+            return v;
+        } else
+            return Read<POLICY::PC_AccessMode>(pc++);
     }
 
+    unsigned ReadPC8(unsigned offs = 0) { return (ReadPC() + offs) & 0xff; }
+
     unsigned ReadPC16(unsigned offs = 0)
     {
+        if constexpr (Predecoded) {
+            pc += 2;
+            return operand + offs;
+        }
         auto adr = to_adr(Read<POLICY::PC_AccessMode>(pc),
                           Read<POLICY::PC_AccessMode>(pc + 1));
         pc += 2;
@@ -500,9 +1128,62 @@ private:
     template <enum Mode MODE>
     unsigned LoadEA()
     {
+        if constexpr (Predecoded && MODE == Mode::IMM) return ReadPC();
+        if constexpr (POLICY::Timing == ExactCycles &&
+                      (MODE == Mode::ABSX || MODE == Mode::ABSY ||
+                       MODE == Mode::INDY)) {
+            // Indexed reads take one more cycle when crossing a page
+            auto base = MODE == Mode::INDY ? Read16(ReadPC8()) : ReadPC16();
+            auto adr = base + (MODE == Mode::ABSX ? x : y);
+            if (hi(adr) != hi(base)) cycles++;
+            return Read(adr);
+        }
         return Read(ReadEA<MODE>());
     }
 
+    // The 65C02 spends one more cycle on `adc` and `sbc` in decimal mode
+    void DecimalCycle()
+    {
+        if constexpr (POLICY::Timing == ExactCycles) {
+            if (cpu65c02) cycles++;
+        }
+    }
+
+    // A taken branch takes one more cycle, and another one if it lands on
+    // a different page
+    // Mark the branch of `size` bytes at `at`, which just ran, as taken or
+    // not. A branch to the next instruction counts as not taken.
+    void coverBranch(unsigned at, unsigned size)
+    {
+        if constexpr (CoveredInCore) {
+            if (currentCoverage == nullptr) return;
+            at &= 0xffff;
+            bool taken = (pc & 0xffff) != ((at + size) & 0xffff);
+            Coverage::set(taken ? currentCoverage->taken
+                                : currentCoverage->notTaken,
+                          at);
+        }
+    }
+
+    // Mark the instruction at `at` as executed
+    void coverOp(unsigned at)
+    {
+        if constexpr (CoveredInCore) {
+            if (currentCoverage == nullptr) return;
+            Coverage::set(currentCoverage->executed, at & 0xffff);
+        }
+    }
+
+    void TakeBranch(int8_t diff)
+    {
+        auto target = pc + diff;
+        if constexpr (POLICY::Timing == ExactCycles) {
+            if (hi(target) != hi(pc)) cycles++;
+        }
+        pc = target;
+        cycles++;
+    }
+
     /////////////////////////////////////////////////////////////////////////
     ///
     ///   OPCODES
@@ -515,6 +1196,7 @@ private:
     {
         if constexpr (FLAG == DECIMAL) m.setDec<ON>();
         m.sr = (m.sr & ~(1 << FLAG)) | (ON << FLAG);
+        if constexpr (FLAG == IRQ && !ON) m.pendingIrq();
     }
 
     template <enum Reg REG, enum Mode MODE>
@@ -539,21 +1221,17 @@ private:
     template <int FLAG, bool ON>
     static constexpr void Branch(Machine& m)
     {
-        auto pc = m.pc;
-        int8_t diff = m.Read<POLICY::PC_AccessMode>(pc++);
-        if (m.check<FLAG, ON>()) {
-            pc += diff;
-            m.cycles++;
-        }
-        m.pc = pc;
+        auto at = m.pc - 1;
+        int8_t diff = m.ReadPC();
+        if (m.check<FLAG, ON>()) m.TakeBranch(diff);
+        m.coverBranch(at, 2);
     }
     static constexpr void Branch(Machine& m)
     {
-        auto pc = m.pc;
-        int8_t diff = m.Read<POLICY::PC_AccessMode>(pc++);
-        pc += diff;
-        m.cycles++;
-        m.pc = pc;
+        auto at = m.pc - 1;
+        int8_t diff = m.ReadPC();
+        m.TakeBranch(diff);
+        m.coverBranch(at, 2);
     }
 
     template <enum Mode MODE, int INC>
@@ -594,6 +1272,7 @@ private:
     static constexpr void Sbc(Machine& m)
     {
         if constexpr (DEC) {
+            m.DecimalCycle();
             unsigned z = m.LoadEA<MODE>();
             auto al = (m.a & 0xf) - (z & 0xf) + (m.carry() - 1);
             auto ah = (m.a >> 4) - (z >> 4);
@@ -619,6 +1298,7 @@ private:
         unsigned z = m.LoadEA<MODE>();
         unsigned rc = m.a + z + m.carry();
         if constexpr (DEC) {
+            m.DecimalCycle();
             if (((m.a & 0xf) + (z & 0xf) + m.carry()) >= 10) rc += 6;
             if ((rc & 0xff0) > 0x90) rc += 0x60;
         }
@@ -721,32 +1401,102 @@ private:
         if constexpr (TO != Reg::SP) m.set<SZ>(m.Reg<TO>());
     }
 
+    // === STACK & JUMPS
+
+    static constexpr void Nop(Machine&) {}
+
+    template <enum Reg REG>
+    static constexpr void Push(Machine& m)
+    {
+        m.stackWrite(m.sp--, m.Reg<REG>());
+    }
+
+    template <enum Reg REG>
+    static constexpr void Pull(Machine& m)
+    {
+        m.Reg<REG>() = m.stackRead(++m.sp);
+    }
+
+    static constexpr void Php(Machine& m)
+    {
+        m.stackWrite(m.sp--, m.get_SR());
+    }
+
+    static constexpr void Plp(Machine& m)
+    {
+        m.set_SR(m.stackRead(++m.sp));
+        m.pendingIrq();
+    }
+
+    static constexpr void Rti(Machine& m)
+    {
+        m.set_SR(m.stackRead(m.sp + 1));
+        m.pc = (m.stackRead(m.sp + 2) | (m.stackRead(m.sp + 3) << 8));
+        m.sp += 3;
+        m.pendingIrq();
+    }
+
+    static void Brk(Machine& m)
+    {
+        auto what = m.ReadPC();
+        if (m.breakFunction != nullptr) {
+            m.breakFunction(what, m.breakData);
+        } else {
+            m.stackWrite(m.sp, m.pc >> 8);
+            m.stackWrite(m.sp - 1, m.pc & 0xff);
+            m.stackWrite(m.sp - 2, m.get_SR());
+            m.sp -= 3;
+            m.pc = m.Read16(m.to_adr(0xfe, 0xff));
+        }
+    }
+
+    static constexpr void Rts(Machine& m)
+    {
+        if constexpr (POLICY::ExitOnStackWrap) {
+            if (m.sp == 0xff) {
+                m.realCycles = m.cycles;
+                m.cycles = std::numeric_limits<decltype(m.cycles)>::max() - 32;
+                return;
+            }
+        }
+        m.pc = (m.stackRead(m.sp + 1) | (m.stackRead(m.sp + 2) << 8)) + 1;
+        m.sp += 2;
+    }
+
+    template <enum Mode MODE>
+    static constexpr void Jmp(Machine& m)
+    {
+        m.pc = m.ReadEA<MODE>();
+    }
+
+    static constexpr void Jsr(Machine& m)
+    {
+        m.stackWrite(m.sp, (m.pc + 1) >> 8);
+        m.stackWrite(m.sp - 1, (m.pc + 1) & 0xff);
+        m.sp -= 2;
+        m.pc = m.ReadPC16();
+    }
+
     // 65c02 opcodes
 
     template <int BIT>
     static constexpr void Bbr(Machine& m)
     {
+        auto at = m.pc - 1;
         auto val = m.LoadEA<Mode::ZP>();
-        auto pc = m.pc;
-        int8_t diff = m.Read<POLICY::PC_AccessMode>(pc++) - 1;
-        if (!(val & 1 << BIT)) {
-            pc += diff;
-            m.cycles++;
-        }
-        m.pc = pc;
+        int8_t diff = m.ReadPC() - 1;
+        if (!(val & 1 << BIT)) m.TakeBranch(diff);
+        m.coverBranch(at, 3);
     }
 
     template <int BIT>
     static constexpr void Bbs(Machine& m)
     {
+        auto at = m.pc - 1;
         auto val = m.LoadEA<Mode::ZP>();
-        auto pc = m.pc;
-        int8_t diff = m.Read<POLICY::PC_AccessMode>(pc++) - 1;
-        if (val & 1 << BIT) {
-            pc += diff;
-            m.cycles++;
-        }
-        m.pc = pc;
+        int8_t diff = m.ReadPC() - 1;
+        if (val & 1 << BIT) m.TakeBranch(diff);
+        m.coverBranch(at, 3);
     }
 
     template <int BIT>
@@ -799,6 +1549,26 @@ private:
         m.set<SZ>(m.a);
     }
 
+    static constexpr void Lxa(Machine& m)
+    {
+        m.a &= m.LoadEA<Mode::IMM>();
+        m.x = m.a;
+    }
+
+    // Read the operand and do nothing
+    template <enum Mode MODE>
+    static constexpr void Skip(Machine& m)
+    {
+        m.LoadEA<MODE>();
+    }
+
+    static void Illegal(Machine& m)
+    {
+        fmt::print("** Illegal opcode at {:04x}\n", m.regPC());
+        m.realCycles = m.cycles;
+        m.cycles = std::numeric_limits<uint32_t>::max() - 32;
+    }
+
     /////////////////////////////////////////////////////////////////////////
     ///
     ///   INSTRUCTION TABLE
@@ -810,7 +1580,7 @@ private:
     {
         std::vector<Instruction> instructionTable = {
 
-            { "nop", {{ 0xea, 2, Mode::NONE, [](Machine& ) {} }} },
+            { "nop", {{ 0xea, 2, Mode::NONE, Nop }} },
 
             { "lda", {
                 { 0xa9, 2, Mode::IMM, Load<Reg::A, Mode::IMM>},
@@ -887,21 +1657,10 @@ private:
             { "dey", { { 0x88, 2, Mode::NONE, Inc<Reg::Y, -1> } } },
             { "iny", { { 0xc8, 2, Mode::NONE, Inc<Reg::Y, 1> } } },
 
-            { "pha", { { 0x48, 3, Mode::NONE, [](Machine& m) {
-                m.stack[m.sp--] = m.a;
-            } } } },
-
-            { "pla", { { 0x68, 4, Mode::NONE, [](Machine& m) {
-                m.a = m.stack[++m.sp];
-            } } } },
-
-            { "php", { { 0x08, 3, Mode::NONE, [](Machine& m) {
-                m.stack[m.sp--] = m.get_SR();
-            } } } },
-
-            { "plp", { { 0x28, 4, Mode::NONE, [](Machine& m) {
-                m.set_SR(m.stack[++m.sp]);
-            } } } },
+            { "pha", { { 0x48, 3, Mode::NONE, Push<Reg::A> } } },
+            { "pla", { { 0x68, 4, Mode::NONE, Pull<Reg::A> } } },
+            { "php", { { 0x08, 3, Mode::NONE, Php } } },
+            { "plp", { { 0x28, 4, Mode::NONE, Plp } } },
 
             { "bcc", { { 0x90, 2, Mode::REL, Branch<CARRY, CLEAR> }, } },
             { "bcs", { { 0xb0, 2, Mode::REL, Branch<CARRY, SET> }, } },
@@ -1039,68 +1798,28 @@ private:
                 { 0x2c, 4, Mode::ABS, Bit<Mode::ABS>},
             } },
 
-            { "rti", {
-                { 0x40, 6, Mode::NONE, [](Machine& m) {
-                    m.set_SR(m.stack[m.sp+1]);
-                    m.pc = (m.stack[m.sp+2] | (m.stack[m.sp+3]<<8));
-                    m.sp += 3;
-                } }
-            } },
+            { "rti", { { 0x40, 6, Mode::NONE, Rti } } },
 
             { "brk", {
                 { 0x00, 7, Mode::NONE, [](Machine& m) {
                     m.ReadPC();
-                    m.stack[m.sp] = m.pc >> 8;
-                    m.stack[m.sp-1] = m.pc & 0xff;
-                    m.stack[m.sp-2] = m.get_SR();
+                    m.stackWrite(m.sp, m.pc >> 8);
+                    m.stackWrite(m.sp-1, m.pc & 0xff);
+                    m.stackWrite(m.sp-2, m.get_SR());
                     m.sp -= 3;
                     m.pc = m.Read16(m.to_adr(0xfe, 0xff));
                 } },
-                { 0x00, 7, Mode::IMM, [](Machine& m) {
-                    auto what = m.ReadPC();
-                    if(m.breakFunction != nullptr) {
-                        m.breakFunction(what, m.breakData);
-                    } else {
-                        m.stack[m.sp] = m.pc >> 8;
-                        m.stack[m.sp-1] = m.pc & 0xff;
-                        m.stack[m.sp-2] = m.get_SR();
-                        m.sp -= 3;
-                        m.pc = m.Read16(m.to_adr(0xfe, 0xff));
-                    }
-                } }
+                { 0x00, 7, Mode::IMM, Brk }
             } },
 
-            { "rts", {
-                { 0x60, 6, Mode::NONE, [](Machine& m) {
-                    if constexpr (POLICY::ExitOnStackWrap) {
-                        if (m.sp == 0xff) {
-                            m.realCycles = m.cycles;
-                            m.cycles = std::numeric_limits<decltype(m.cycles)>::max()-32;
-                            return;
-                        }
-                    }
-                    m.pc = (m.stack[m.sp+1] | (m.stack[m.sp+2]<<8))+1;
-                    m.sp += 2;
-                } }
-            } },
+            { "rts", { { 0x60, 6, Mode::NONE, Rts } } },
 
             { "jmp", {
-                { 0x4c, 3, Mode::ABS, [](Machine& m) {
-                    m.pc = m.ReadPC16();
-                } },
-                { 0x6c, 5, Mode::IND, [](Machine& m) {
-                    m.pc = m.Read16(m.ReadPC16());
-                } }
+                { 0x4c, 3, Mode::ABS, Jmp<Mode::ABS> },
+                { 0x6c, 5, Mode::IND, Jmp<Mode::IND> }
             } },
 
-            { "jsr", {
-                { 0x20, 6, Mode::ABS, [](Machine& m) {
-                    m.stack[m.sp] = (m.pc+1) >> 8;
-                    m.stack[m.sp-1] = (m.pc+1) & 0xff;
-                    m.sp -= 2;
-                    m.pc = m.ReadPC16();
-                } }
-            } },
+            { "jsr", { { 0x20, 6, Mode::ABS, Jsr } } },
 
 
         };
@@ -1130,18 +1849,10 @@ private:
                 {"ora", {{0x12, 5, Mode::INDZ, Ora<Mode::INDZ>}}},
                 {"sbc", {{0xf2, 5, Mode::INDZ, Sbc<Mode::INDZ, USE_BCD>}}},
                 {"sta", {{0x92, 5, Mode::INDZ, Store<Reg::A, Mode::INDZ>}}},
-                {"phx",
-                 {{0xda, 3, Mode::NONE,
-                   [](Machine& m) { m.stack[m.sp--] = m.x; }}}},
-                {"phy",
-                 {{0x5a, 3, Mode::NONE,
-                   [](Machine& m) { m.stack[m.sp--] = m.y; }}}},
-                {"plx",
-                 {{0xfa, 4, Mode::NONE,
-                   [](Machine& m) { m.x = m.stack[++m.sp]; }}}},
-                {"ply",
-                 {{0x7a, 4, Mode::NONE,
-                   [](Machine& m) { m.y = m.stack[++m.sp]; }}}},
+                {"phx", {{0xda, 3, Mode::NONE, Push<Reg::X>}}},
+                {"phy", {{0x5a, 3, Mode::NONE, Push<Reg::Y>}}},
+                {"plx", {{0xfa, 4, Mode::NONE, Pull<Reg::X>}}},
+                {"ply", {{0x7a, 4, Mode::NONE, Pull<Reg::Y>}}},
                 {"stz",
                  {{0x64, 3, Mode::ZP, Store0<Mode::ZP>},
                   {0x74, 4, Mode::ZPX, Store0<Mode::ZPX>},
@@ -1216,20 +1927,12 @@ private:
                      {0x8f, 4, Mode::ABS, Sax<Mode::ABS>},
                      {0x83, 6, Mode::INDX, Sax<Mode::INDX>},
                  }},
-                {"lxa",
-                 {{0xab, 2, Mode::IMM,
-                   [](Machine& m) {
-                       m.a &= m.LoadEA<Mode::IMM>();
-                       m.x = m.a;
-                   }}}},
+                {"lxa", {{0xab, 2, Mode::IMM, Lxa}}},
                 {"nop",
                  {
-                     {0xe2, 2, Mode::IMM,
-                      [](Machine& m) { m.LoadEA<Mode::IMM>(); }},
-                     {0x04, 3, Mode::ZP,
-                      [](Machine& m) { m.LoadEA<Mode::ZP>(); }},
-                     {0x0c, 4, Mode::ABS,
-                      [](Machine& m) { m.LoadEA<Mode::ABS>(); }},
+                     {0xe2, 2, Mode::IMM, Skip<Mode::IMM>},
+                     {0x04, 3, Mode::ZP, Skip<Mode::ZP>},
+                     {0x0c, 4, Mode::ABS, Skip<Mode::ABS>},
                  }},
             };
             mergeInstructions(instructionsIllegal);
@@ -1238,6 +1941,865 @@ private:
         return instructionTable;
     }
 
+    // Without WATCH, `eachOp()` is never called
+    template <bool WATCH>
+    void runCore(uint32_t toCycles)
+    {
+        if (traced()) {
+            runTraced<WATCH>(toCycles);
+        } else if constexpr (POLICY::Core == Switch) {
+            if (cpu65c02) {
+                runSwitch<true, WATCH>(toCycles);
+            } else {
+                runSwitch<false, WATCH>(toCycles);
+            }
+        } else if constexpr (Predecoded) {
+            runBlocks<WATCH>(toCycles);
+        } else {
+            auto& p = policy();
+            while (cycles < toCycles) {
+                if (WATCH && POLICY::eachOp(p)) break;
+                auto code = ReadPC();
+                auto& op = jumpTable[code];
+                op.op(*this);
+                cycles += op.cycles;
+            }
+        }
+    }
+
+    // The jump table loop, recording each instruction in the profile,
+    // coverage and history, and calling execution watches
+    template <bool WATCH>
+    void runTraced(uint32_t toCycles)
+    {
+        auto& p = policy();
+        while (cycles < toCycles) {
+            if (WATCH && POLICY::eachOp(p)) break;
+            auto at = pc & 0xffff;
+            if (!historyRing.empty()) {
+                historyRing[historyCount++ % historyRing.size()] = {
+                    static_cast<uint16_t>(at),
+                    static_cast<uint8_t>(a),
+                    static_cast<uint8_t>(x),
+                    static_cast<uint8_t>(y),
+                    get_SR(),
+                    static_cast<uint8_t>(sp)};
+            }
+            if (execWatched && (watched[at] & WatchExec) != 0) {
+                watchFn(*this, at, Read<POLICY::PC_AccessMode>(at),
+                        WatchExec, watchData);
+            }
+            auto code = Read<POLICY::PC_AccessMode>(pc++);
+            auto& op = jumpTable[code];
+            if constexpr (Predecoded) {
+                operand = 0;
+                for (int i = 1; i < opSize(op.mode); i++) {
+                    operand |= Read<POLICY::PC_AccessMode>(pc + i - 1)
+                               << (8 * (i - 1));
+                }
+            }
+            auto before = cycles;
+            op.op(*this);
+            cycles += op.cycles;
+            if (currentCoverage != nullptr) {
+                Coverage::set(currentCoverage->executed, at);
+                if ((op.mode == Mode::REL || op.mode == Mode::ZP_REL) &&
+                    !CoveredInCore) {
+                    // A branch to the next instruction counts as not taken
+                    bool taken =
+                        (pc & 0xffff) != ((at + opSize(op.mode)) & 0xffff);
+                    Coverage::set(taken ? currentCoverage->taken
+                                        : currentCoverage->notTaken,
+                                  at);
+                }
+            }
+            // The `rts` ending the run is not counted in the profile
+            if (realCycles != 0) break;
+            if (currentProfile != nullptr) {
+                currentProfile->record(at, code, cycles - before, sp, pc);
+            }
+        }
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    ///
+    ///   SWITCH CORE
+    ///
+    /////////////////////////////////////////////////////////////////////////
+
+    // The same instructions as the tables above, but selected by a switch
+    // so the compiler can inline each of them into the loop. One copy is
+    // made for each combination of decimal mode, CPU and WATCH.
+    // `opcodetest.cpp` checks that both cores do the same thing.
+
+    template <bool C02, bool WATCH>
+    void runSwitch(uint32_t toCycles)
+    {
+        // Run until done, switching loops when decimal mode changes
+        while (cycles < toCycles) {
+            bool done = (sr & d_FLAG) != 0
+                            ? switchLoop<true, C02, WATCH>(toCycles)
+                            : switchLoop<false, C02, WATCH>(toCycles);
+            if (done) break;
+        }
+    }
+
+    template <OpFunc OP, int CYCLES>
+    void Exec()
+    {
+        OP(*this);
+        cycles += CYCLES;
+    }
+
+    // Returns false if decimal mode changed, true when done
+    template <bool BCD, bool C02, bool WATCH>
+    bool switchLoop(uint32_t toCycles)
+    {
+        auto& p = policy();
+        while (cycles < toCycles) {
+            if (WATCH && POLICY::eachOp(p)) return true;
+            coverOp(pc);
+            // clang-format off
+            switch (ReadPC()) {
+            case 0x00: Exec<Brk, 7>(); continue;
+            case 0x01: Exec<Ora<Mode::INDX>, 6>(); continue;
+            case 0x04:
+                if constexpr (C02) {
+                    Exec<Tsb<Mode::ZP>, 5>();
+                } else {
+                    Exec<Skip<Mode::ZP>, 3>();
+                }
+                continue;
+            case 0x05: Exec<Ora<Mode::ZP>, 3>(); continue;
+            case 0x06: Exec<Asl<Mode::ZP>, 5>(); continue;
+            case 0x07:
+                if constexpr (C02) {
+                    Exec<Rmb<0>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x08: Exec<Php, 3>(); continue;
+            case 0x09: Exec<Ora<Mode::IMM>, 2>(); continue;
+            case 0x0a: Exec<Asl<Mode::ACC>, 2>(); continue;
+            case 0x0c:
+                if constexpr (C02) {
+                    Exec<Tsb<Mode::ABS>, 6>();
+                } else {
+                    Exec<Skip<Mode::ABS>, 4>();
+                }
+                continue;
+            case 0x0d: Exec<Ora<Mode::ABS>, 4>(); continue;
+            case 0x0e: Exec<Asl<Mode::ABS>, 6>(); continue;
+            case 0x0f:
+                if constexpr (C02) {
+                    Exec<Bbr<0>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x10: Exec<Branch<SIGN, CLEAR>, 2>(); continue;
+            case 0x11: Exec<Ora<Mode::INDY>, 5>(); continue;
+            case 0x12:
+                if constexpr (C02) {
+                    Exec<Ora<Mode::INDZ>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x14:
+                if constexpr (C02) {
+                    Exec<Trb<Mode::ZP>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x15: Exec<Ora<Mode::ZPX>, 4>(); continue;
+            case 0x16: Exec<Asl<Mode::ZPX>, 6>(); continue;
+            case 0x17:
+                if constexpr (C02) {
+                    Exec<Rmb<1>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x18: Exec<Set<CARRY, false>, 2>(); continue;
+            case 0x19: Exec<Ora<Mode::ABSY>, 4>(); continue;
+            case 0x1c:
+                if constexpr (C02) {
+                    Exec<Trb<Mode::ABS>, 6>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x1d: Exec<Ora<Mode::ABSX>, 4>(); continue;
+            case 0x1e: Exec<Asl<Mode::ABSX>, 7>(); continue;
+            case 0x1f:
+                if constexpr (C02) {
+                    Exec<Bbr<1>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x20: Exec<Jsr, 6>(); continue;
+            case 0x21: Exec<And<Mode::INDX>, 6>(); continue;
+            case 0x24: Exec<Bit<Mode::ZP>, 3>(); continue;
+            case 0x25: Exec<And<Mode::ZP>, 3>(); continue;
+            case 0x26: Exec<Rol<Mode::ZP>, 5>(); continue;
+            case 0x27:
+                if constexpr (C02) {
+                    Exec<Rmb<2>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x28: Exec<Plp, 4>(); break;
+            case 0x29: Exec<And<Mode::IMM>, 2>(); continue;
+            case 0x2a: Exec<Rol<Mode::ACC>, 2>(); continue;
+            case 0x2c: Exec<Bit<Mode::ABS>, 4>(); continue;
+            case 0x2d: Exec<And<Mode::ABS>, 4>(); continue;
+            case 0x2e: Exec<Rol<Mode::ABS>, 6>(); continue;
+            case 0x2f:
+                if constexpr (C02) {
+                    Exec<Bbr<2>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x30: Exec<Branch<SIGN, SET>, 2>(); continue;
+            case 0x31: Exec<And<Mode::INDY>, 5>(); continue;
+            case 0x32:
+                if constexpr (C02) {
+                    Exec<And<Mode::INDZ>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x35: Exec<And<Mode::ZPX>, 4>(); continue;
+            case 0x36: Exec<Rol<Mode::ZPX>, 6>(); continue;
+            case 0x37:
+                if constexpr (C02) {
+                    Exec<Rmb<3>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x38: Exec<Set<CARRY, true>, 2>(); continue;
+            case 0x39: Exec<And<Mode::ABSY>, 4>(); continue;
+            case 0x3d: Exec<And<Mode::ABSX>, 4>(); continue;
+            case 0x3e: Exec<Rol<Mode::ABSX>, 7>(); continue;
+            case 0x3f:
+                if constexpr (C02) {
+                    Exec<Bbr<3>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x40: Exec<Rti, 6>(); break;
+            case 0x41: Exec<Eor<Mode::INDX>, 6>(); continue;
+            case 0x45: Exec<Eor<Mode::ZP>, 3>(); continue;
+            case 0x46: Exec<Lsr<Mode::ZP>, 5>(); continue;
+            case 0x47:
+                if constexpr (C02) {
+                    Exec<Rmb<4>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x48: Exec<Push<Reg::A>, 3>(); continue;
+            case 0x49: Exec<Eor<Mode::IMM>, 2>(); continue;
+            case 0x4a: Exec<Lsr<Mode::ACC>, 2>(); continue;
+            case 0x4c: Exec<Jmp<Mode::ABS>, 3>(); continue;
+            case 0x4d: Exec<Eor<Mode::ABS>, 4>(); continue;
+            case 0x4e: Exec<Lsr<Mode::ABS>, 6>(); continue;
+            case 0x4f:
+                if constexpr (C02) {
+                    Exec<Bbr<4>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x50: Exec<Branch<OVER, CLEAR>, 2>(); continue;
+            case 0x51: Exec<Eor<Mode::INDY>, 5>(); continue;
+            case 0x52:
+                if constexpr (C02) {
+                    Exec<Eor<Mode::INDZ>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x55: Exec<Eor<Mode::ZPX>, 4>(); continue;
+            case 0x56: Exec<Lsr<Mode::ZPX>, 6>(); continue;
+            case 0x57:
+                if constexpr (C02) {
+                    Exec<Rmb<5>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x58: Exec<Set<IRQ, false>, 2>(); continue;
+            case 0x59: Exec<Eor<Mode::ABSY>, 4>(); continue;
+            case 0x5a:
+                if constexpr (C02) {
+                    Exec<Push<Reg::Y>, 3>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x5d: Exec<Eor<Mode::ABSX>, 4>(); continue;
+            case 0x5e: Exec<Lsr<Mode::ABSX>, 7>(); continue;
+            case 0x5f:
+                if constexpr (C02) {
+                    Exec<Bbr<5>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x60: Exec<Rts, 6>(); continue;
+            case 0x61: Exec<Adc<Mode::INDX, BCD>, 6>(); continue;
+            case 0x64:
+                if constexpr (C02) {
+                    Exec<Store0<Mode::ZP>, 3>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x65: Exec<Adc<Mode::ZP, BCD>, 3>(); continue;
+            case 0x66: Exec<Ror<Mode::ZP>, 5>(); continue;
+            case 0x67:
+                if constexpr (C02) {
+                    Exec<Rmb<6>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x68: Exec<Pull<Reg::A>, 4>(); continue;
+            case 0x69: Exec<Adc<Mode::IMM, BCD>, 2>(); continue;
+            case 0x6a: Exec<Ror<Mode::ACC>, 2>(); continue;
+            case 0x6c: Exec<Jmp<Mode::IND>, 5>(); continue;
+            case 0x6d: Exec<Adc<Mode::ABS, BCD>, 4>(); continue;
+            case 0x6e: Exec<Ror<Mode::ABS>, 6>(); continue;
+            case 0x6f:
+                if constexpr (C02) {
+                    Exec<Bbr<6>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x70: Exec<Branch<OVER, SET>, 2>(); continue;
+            case 0x71: Exec<Adc<Mode::INDY, BCD>, 5>(); continue;
+            case 0x72: Exec<Adc<Mode::INDZ, BCD>, 5>(); continue;
+            case 0x74:
+                if constexpr (C02) {
+                    Exec<Store0<Mode::ZPX>, 4>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x75: Exec<Adc<Mode::ZPX, BCD>, 4>(); continue;
+            case 0x76: Exec<Ror<Mode::ZPX>, 6>(); continue;
+            case 0x77:
+                if constexpr (C02) {
+                    Exec<Rmb<7>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x78: Exec<Set<IRQ, true>, 2>(); continue;
+            case 0x79: Exec<Adc<Mode::ABSY, BCD>, 4>(); continue;
+            case 0x7a:
+                if constexpr (C02) {
+                    Exec<Pull<Reg::Y>, 4>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x7d: Exec<Adc<Mode::ABSX, BCD>, 4>(); continue;
+            case 0x7e: Exec<Ror<Mode::ABSX>, 7>(); continue;
+            case 0x7f:
+                if constexpr (C02) {
+                    Exec<Bbr<7>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x80:
+                if constexpr (C02) {
+                    Exec<Branch, 2>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x81: Exec<Store<Reg::A, Mode::INDX>, 6>(); continue;
+            case 0x83:
+                if constexpr (C02) {
+                    Exec<Illegal, 0>();
+                } else {
+                    Exec<Sax<Mode::INDX>, 6>();
+                }
+                continue;
+            case 0x84: Exec<Store<Reg::Y, Mode::ZP>, 3>(); continue;
+            case 0x85: Exec<Store<Reg::A, Mode::ZP>, 3>(); continue;
+            case 0x86: Exec<Store<Reg::X, Mode::ZP>, 3>(); continue;
+            case 0x87:
+                if constexpr (C02) {
+                    Exec<Smb<0>, 5>();
+                } else {
+                    Exec<Sax<Mode::ZP>, 3>();
+                }
+                continue;
+            case 0x88: Exec<Inc<Reg::Y, -1>, 2>(); continue;
+            case 0x8a: Exec<Transfer<Reg::X, Reg::A>, 2>(); continue;
+            case 0x8c: Exec<Store<Reg::Y, Mode::ABS>, 4>(); continue;
+            case 0x8d: Exec<Store<Reg::A, Mode::ABS>, 4>(); continue;
+            case 0x8e: Exec<Store<Reg::X, Mode::ABS>, 4>(); continue;
+            case 0x8f:
+                if constexpr (C02) {
+                    Exec<Bbs<0>, 5>();
+                } else {
+                    Exec<Sax<Mode::ABS>, 4>();
+                }
+                continue;
+            case 0x90: Exec<Branch<CARRY, CLEAR>, 2>(); continue;
+            case 0x91: Exec<Store<Reg::A, Mode::INDY>, 6>(); continue;
+            case 0x92:
+                if constexpr (C02) {
+                    Exec<Store<Reg::A, Mode::INDZ>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x94: Exec<Store<Reg::Y, Mode::ZPX>, 4>(); continue;
+            case 0x95: Exec<Store<Reg::A, Mode::ZPX>, 4>(); continue;
+            case 0x96: Exec<Store<Reg::X, Mode::ZPY>, 4>(); continue;
+            case 0x97:
+                if constexpr (C02) {
+                    Exec<Smb<1>, 5>();
+                } else {
+                    Exec<Sax<Mode::ZPY>, 4>();
+                }
+                continue;
+            case 0x98: Exec<Transfer<Reg::Y, Reg::A>, 2>(); continue;
+            case 0x99: Exec<Store<Reg::A, Mode::ABSY>, 5>(); continue;
+            case 0x9a: Exec<Transfer<Reg::X, Reg::SP>, 2>(); continue;
+            case 0x9c:
+                if constexpr (C02) {
+                    Exec<Store0<Mode::ABS>, 4>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x9d: Exec<Store<Reg::A, Mode::ABSX>, 5>(); continue;
+            case 0x9e:
+                if constexpr (C02) {
+                    Exec<Store0<Mode::ABSX>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0x9f:
+                if constexpr (C02) {
+                    Exec<Bbs<1>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xa0: Exec<Load<Reg::Y, Mode::IMM>, 2>(); continue;
+            case 0xa1: Exec<Load<Reg::A, Mode::INDX>, 6>(); continue;
+            case 0xa2: Exec<Load<Reg::X, Mode::IMM>, 2>(); continue;
+            case 0xa3:
+                if constexpr (C02) {
+                    Exec<Illegal, 0>();
+                } else {
+                    Exec<Lax<Mode::INDX>, 6>();
+                }
+                continue;
+            case 0xa4: Exec<Load<Reg::Y, Mode::ZP>, 3>(); continue;
+            case 0xa5: Exec<Load<Reg::A, Mode::ZP>, 3>(); continue;
+            case 0xa6: Exec<Load<Reg::X, Mode::ZP>, 3>(); continue;
+            case 0xa7:
+                if constexpr (C02) {
+                    Exec<Smb<2>, 5>();
+                } else {
+                    Exec<Lax<Mode::ZP>, 3>();
+                }
+                continue;
+            case 0xa8: Exec<Transfer<Reg::A, Reg::Y>, 2>(); continue;
+            case 0xa9: Exec<Load<Reg::A, Mode::IMM>, 2>(); continue;
+            case 0xaa: Exec<Transfer<Reg::A, Reg::X>, 2>(); continue;
+            case 0xab:
+                if constexpr (C02) {
+                    Exec<Illegal, 0>();
+                } else {
+                    Exec<Lxa, 2>();
+                }
+                continue;
+            case 0xac: Exec<Load<Reg::Y, Mode::ABS>, 4>(); continue;
+            case 0xad: Exec<Load<Reg::A, Mode::ABS>, 4>(); continue;
+            case 0xae: Exec<Load<Reg::X, Mode::ABS>, 4>(); continue;
+            case 0xaf:
+                if constexpr (C02) {
+                    Exec<Bbs<2>, 5>();
+                } else {
+                    Exec<Lax<Mode::ABS>, 4>();
+                }
+                continue;
+            case 0xb0: Exec<Branch<CARRY, SET>, 2>(); continue;
+            case 0xb1: Exec<Load<Reg::A, Mode::INDY>, 5>(); continue;
+            case 0xb2:
+                if constexpr (C02) {
+                    Exec<Load<Reg::A, Mode::INDZ>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xb3:
+                if constexpr (C02) {
+                    Exec<Illegal, 0>();
+                } else {
+                    Exec<Lax<Mode::INDY>, 5>();
+                }
+                continue;
+            case 0xb4: Exec<Load<Reg::Y, Mode::ZPX>, 4>(); continue;
+            case 0xb5: Exec<Load<Reg::A, Mode::ZPX>, 4>(); continue;
+            case 0xb6: Exec<Load<Reg::X, Mode::ZPY>, 4>(); continue;
+            case 0xb7:
+                if constexpr (C02) {
+                    Exec<Smb<3>, 5>();
+                } else {
+                    Exec<Lax<Mode::ZPY>, 4>();
+                }
+                continue;
+            case 0xb8: Exec<Set<OVER, false>, 2>(); continue;
+            case 0xb9: Exec<Load<Reg::A, Mode::ABSY>, 4>(); continue;
+            case 0xba: Exec<Transfer<Reg::SP, Reg::X>, 2>(); continue;
+            case 0xbc: Exec<Load<Reg::Y, Mode::ABSX>, 4>(); continue;
+            case 0xbd: Exec<Load<Reg::A, Mode::ABSX>, 4>(); continue;
+            case 0xbe: Exec<Load<Reg::X, Mode::ABSY>, 4>(); continue;
+            case 0xbf:
+                if constexpr (C02) {
+                    Exec<Bbs<3>, 5>();
+                } else {
+                    Exec<Lax<Mode::ABSY>, 4>();
+                }
+                continue;
+            case 0xc0: Exec<Cmp<Reg::Y, Mode::IMM>, 2>(); continue;
+            case 0xc1: Exec<Cmp<Reg::A, Mode::INDX>, 6>(); continue;
+            case 0xc4: Exec<Cmp<Reg::Y, Mode::ZP>, 3>(); continue;
+            case 0xc5: Exec<Cmp<Reg::A, Mode::ZP>, 3>(); continue;
+            case 0xc6: Exec<Inc<Mode::ZP, -1>, 5>(); continue;
+            case 0xc7:
+                if constexpr (C02) {
+                    Exec<Smb<4>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xc8: Exec<Inc<Reg::Y, 1>, 2>(); continue;
+            case 0xc9: Exec<Cmp<Reg::A, Mode::IMM>, 2>(); continue;
+            case 0xca: Exec<Inc<Reg::X, -1>, 2>(); continue;
+            case 0xcc: Exec<Cmp<Reg::Y, Mode::ABS>, 4>(); continue;
+            case 0xcd: Exec<Cmp<Reg::A, Mode::ABS>, 4>(); continue;
+            case 0xce: Exec<Inc<Mode::ABS, -1>, 6>(); continue;
+            case 0xcf:
+                if constexpr (C02) {
+                    Exec<Bbs<4>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xd0: Exec<Branch<ZERO, CLEAR>, 2>(); continue;
+            case 0xd1: Exec<Cmp<Reg::A, Mode::INDY>, 5>(); continue;
+            case 0xd2:
+                if constexpr (C02) {
+                    Exec<Cmp<Reg::A, Mode::INDZ>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xd5: Exec<Cmp<Reg::A, Mode::ZPX>, 4>(); continue;
+            case 0xd6: Exec<Inc<Mode::ZPX, -1>, 6>(); continue;
+            case 0xd7:
+                if constexpr (C02) {
+                    Exec<Smb<5>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xd8: Exec<Set<DECIMAL, false>, 2>(); break;
+            case 0xd9: Exec<Cmp<Reg::A, Mode::ABSY>, 4>(); continue;
+            case 0xda:
+                if constexpr (C02) {
+                    Exec<Push<Reg::X>, 3>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xdd: Exec<Cmp<Reg::A, Mode::ABSX>, 4>(); continue;
+            case 0xde: Exec<Inc<Mode::ABSX, -1>, 7>(); continue;
+            case 0xdf:
+                if constexpr (C02) {
+                    Exec<Bbs<5>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xe0: Exec<Cmp<Reg::X, Mode::IMM>, 2>(); continue;
+            case 0xe1: Exec<Sbc<Mode::INDX, BCD>, 6>(); continue;
+            case 0xe2:
+                if constexpr (C02) {
+                    Exec<Illegal, 0>();
+                } else {
+                    Exec<Skip<Mode::IMM>, 2>();
+                }
+                continue;
+            case 0xe4: Exec<Cmp<Reg::X, Mode::ZP>, 3>(); continue;
+            case 0xe5: Exec<Sbc<Mode::ZP, BCD>, 3>(); continue;
+            case 0xe6: Exec<Inc<Mode::ZP, 1>, 5>(); continue;
+            case 0xe7:
+                if constexpr (C02) {
+                    Exec<Smb<6>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xe8: Exec<Inc<Reg::X, 1>, 2>(); continue;
+            case 0xe9: Exec<Sbc<Mode::IMM, BCD>, 2>(); continue;
+            case 0xea: Exec<Nop, 2>(); continue;
+            case 0xec: Exec<Cmp<Reg::X, Mode::ABS>, 4>(); continue;
+            case 0xed: Exec<Sbc<Mode::ABS, BCD>, 4>(); continue;
+            case 0xee: Exec<Inc<Mode::ABS, 1>, 6>(); continue;
+            case 0xef:
+                if constexpr (C02) {
+                    Exec<Bbs<6>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xf0: Exec<Branch<ZERO, SET>, 2>(); continue;
+            case 0xf1: Exec<Sbc<Mode::INDY, BCD>, 5>(); continue;
+            case 0xf2:
+                if constexpr (C02) {
+                    Exec<Sbc<Mode::INDZ, BCD>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xf5: Exec<Sbc<Mode::ZPX, BCD>, 4>(); continue;
+            case 0xf6: Exec<Inc<Mode::ZPX, 1>, 6>(); continue;
+            case 0xf7:
+                if constexpr (C02) {
+                    Exec<Smb<7>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xf8: Exec<Set<DECIMAL, true>, 2>(); break;
+            case 0xf9: Exec<Sbc<Mode::ABSY, BCD>, 4>(); continue;
+            case 0xfa:
+                if constexpr (C02) {
+                    Exec<Pull<Reg::X>, 4>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            case 0xfd: Exec<Sbc<Mode::ABSX, BCD>, 4>(); continue;
+            case 0xfe: Exec<Inc<Mode::ABSX, 1>, 7>(); continue;
+            case 0xff:
+                if constexpr (C02) {
+                    Exec<Bbs<7>, 5>();
+                } else {
+                    Exec<Illegal, 0>();
+                }
+                continue;
+            default: Exec<Illegal, 0>(); continue;
+            }
+            // clang-format on
+            // Only instructions that can change decimal mode get here
+            if (((sr & d_FLAG) != 0) != BCD) return false;
+        }
+        return true;
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    ///
+    ///   BLOCK CORE
+    ///
+    /////////////////////////////////////////////////////////////////////////
+
+    // Straight runs of instructions are decoded once, from the current
+    // jump table, and cached by start address. Executing a block does not
+    // read opcodes or operands from memory; the operand bytes are passed
+    // to the same opcode functions through `operand`.
+    // Code is always fetched through `rbank`. Writes to memory holding
+    // decoded instructions drop all blocks on that page, so self modifying
+    // code works (although slowly). The stack page is never cached, since
+    // the stack is written directly.
+
+    struct Decoded
+    {
+        OpFunc op;
+        unsigned operand;
+        uint8_t cycles;
+    };
+
+    struct Block
+    {
+        const Opcode* table; // The jump table the block was decoded with
+        unsigned start;
+        unsigned end;
+        uint8_t firstPage;
+        uint8_t lastPage;
+        std::vector<Decoded> ops;
+    };
+
+    static constexpr size_t MaxBlockOps = 32;
+
+    // Instructions that may jump, take a pending interrupt or change decimal
+    // mode end a block
+    static bool endsBlock(Opcode const& op)
+    {
+        switch (op.code) {
+        case 0x00: // brk
+        case 0x20: // jsr
+        case 0x28: // plp
+        case 0x40: // rti
+        case 0x4c: // jmp
+        case 0x58: // cli
+        case 0x60: // rts
+        case 0x6c: // jmp ()
+        case 0xd8: // cld
+        case 0xf8: // sed
+            return true;
+        default:
+            return op.mode == Mode::REL || op.mode == Mode::ZP_REL ||
+                   op.op == &Illegal;
+        }
+    }
+
+    std::unique_ptr<Block> decodeBlock(unsigned start, size_t maxOps)
+    {
+        auto block = std::make_unique<Block>();
+        block->table = jumpTable;
+        block->start = start;
+        auto adr = start;
+        while (block->ops.size() < maxOps) {
+            auto const& op = jumpTable[Read<Banked>(adr & 0xffff)];
+            unsigned arg = 0;
+            for (int i = 1; i < opSize(op.mode); i++) {
+                arg |= Read<Banked>((adr + i) & 0xffff) << (8 * (i - 1));
+            }
+            block->ops.push_back({op.op, arg, op.cycles});
+            adr += opSize(op.mode);
+            if (endsBlock(op)) break;
+        }
+        block->end = adr;
+        block->firstPage = hi(start);
+        block->lastPage = hi((adr - 1) & 0xffff);
+        return block;
+    }
+
+    // Find the cached block starting at PC, or decode a new one
+    Block const& getBlock()
+    {
+        auto& block = blocks[pc & 0xffff];
+        if (block != nullptr && block->table == jumpTable) {
+            mark_read(block->firstPage);
+            mark_read(block->lastPage);
+            return *block;
+        }
+        // Re-decoding for another decimal mode covers the same bytes
+        bool known = block != nullptr;
+        block = decodeBlock(pc & 0xffff, MaxBlockOps);
+        if (block->firstPage == 1 || block->lastPage == 1) {
+            // Run one instruction at a time on the stack page
+            block = nullptr;
+            uncachedBlock = decodeBlock(pc & 0xffff, 1);
+            return *uncachedBlock;
+        }
+        if (!known) {
+            for (auto page : {block->firstPage, block->lastPage}) {
+                // A block dropped from one of its pages is still listed
+                // in the other
+                auto& starts = pageBlocks[page];
+                if (std::find(starts.begin(), starts.end(), block->start) ==
+                    starts.end()) {
+                    starts.push_back(block->start);
+                }
+            }
+            for (auto adr = block->start; adr < block->end; adr++) {
+                codeBytes[adr & 0xffff] = 1;
+            }
+        }
+        return *block;
+    }
+
+    template <bool WATCH>
+    void runBlocks(uint32_t toCycles)
+    {
+        auto& p = policy();
+        bool watch = true;
+        while (cycles < toCycles) {
+            if (WATCH && watch && POLICY::eachOp(p)) return;
+            watch = true;
+            blocksChanged = false;
+            auto const& block = getBlock();
+            auto const* it = block.ops.data();
+            auto const* end = it + block.ops.size();
+            while (true) {
+                // The block may be dropped by the instruction itself
+                auto const d = *it;
+                coverOp(pc);
+                pc++;
+                operand = d.operand;
+                d.op(*this);
+                cycles += d.cycles;
+                if (blocksChanged || ++it == end || cycles >= toCycles) break;
+                if constexpr (WATCH) {
+                    auto at = pc;
+                    if (POLICY::eachOp(p)) return;
+                    if (pc != at) {
+                        // Continue from the new PC without calling
+                        // `eachOp()` again
+                        watch = false;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // Drop cached blocks if `adr` holds decoded code
+    void invalidate_code(unsigned adr)
+    {
+        if constexpr (Predecoded) {
+            if (codeBytes[adr & 0xffff] != 0) invalidate_page(hi(adr & 0xffff));
+        }
+    }
+
+    // Drop all cached blocks that cover any part of `page`
+    void invalidate_page(unsigned page)
+    {
+        if constexpr (Predecoded) {
+            if (pageBlocks[page].empty()) return;
+            for (auto start : pageBlocks[page]) {
+                blocks[start] = nullptr;
+            }
+            pageBlocks[page].clear();
+            // Blocks reaching into the next or previous page may leave
+            // marks there, which only cost an extra invalidation
+            std::fill_n(codeBytes.begin() + page * 256, 256, 0);
+            blocksChanged = true;
+        }
+    }
+
+    void invalidate_blocks()
+    {
+        for (unsigned page = 0; page < 256; page++) {
+            invalidate_page(page);
+        }
+    }
+
 public:
     template <bool USE_BCD = false>
     static const auto& getInstructions()
@@ -23,7 +23,7 @@ Image to_image(AnyMap const& img)
     image.bpp = number<int32_t>(img.at("bpp"));
     image.width = number<int32_t>(img.at("width"));
     image.height = number<int32_t>(img.at("height"));
-    image.pixels = std::any_cast<std::vector<uint8_t>>(img.at("pixels"));
+    image.pixels = std::any_cast<Bytes>(img.at("pixels")).vector();
     auto colors = std::any_cast<std::vector<Number>>(img.at("colors"));
     image.colors = convert_vector<uint32_t>(colors);
     return image;
@@ -35,7 +35,7 @@ AnyMap from_image(Image const& image)
     res["width"] = num(image.width);
     res["bpp"] = num(image.bpp);
     res["height"] = num(image.height);
-    res["pixels"] = image.pixels;
+    res["pixels"] = Bytes(image.pixels);
     res["colors"] = convert_vector<Number>(image.colors);
     return res;
 }
@@ -49,7 +49,7 @@ void initFunctions(Assembler& a)
 
     // Allowed data types:
     // * Any arithmetic type, but they will always be converted to/from double
-    // * `std::vector<uint8_t>` for binary data
+    // * `Bytes` for binary data (or `std::vector<uint8_t>`, which is copied)
     // * `AnyMap` for returning struct like things
     // * `std::vector<std::any> const&` as single argument.
 
@@ -70,8 +70,7 @@ void initFunctions(Assembler& a)
                        [](double a, double b) { return std::max(a, b); });
     a.registerFunction("pow",
                        [](double a, double b) { return std::pow(a, b); });
-    a.registerFunction("len",
-                       [](std::vector<uint8_t> const& v) { return v.size(); });
+    a.registerFunction("len", [](Bytes const& v) { return v.size(); });
     a.registerFunction("round", [](double a) { return std::round(a); });
     a.registerFunction("trunc", [](double a) { return std::trunc(a); });
     a.registerFunction("abs", [](double a) { return std::abs(a); });
@@ -79,9 +78,9 @@ void initFunctions(Assembler& a)
     a.registerFunction(
         "random", []() { return static_cast<double>(std::rand()) / RAND_MAX; });
 
-    a.registerFunction("compare",
-                       [](std::vector<uint8_t> const& v0,
-                          std::vector<uint8_t> const& v1) { return v0 == v1; });
+    a.registerFunction("compare", [](Bytes const& v0, Bytes const& v1) {
+        return v0 == v1;
+    });
 
     a.registerFunction("load", [&](std::string_view name) {
         auto p = fs::path(name);
@@ -89,27 +88,26 @@ void initFunctions(Assembler& a)
             p = a.getCurrentPath() / p;
         }
         try {
-            utils::File f{p.string()};
-            return f.readAll();
+            return a.loadFile(p);
         } catch (utils::io_exception&) {
             throw parse_error(fmt::format("Could not load {}", name));
         }
     });
 
-    a.registerFunction("word", [](std::vector<uint8_t> const& data) {
+    a.registerFunction("word", [](Bytes const& data) {
         Check(data.size() >= 2, "Need at least 2 bytes");
         return data[0] | (data[1] << 8);
     });
-    a.registerFunction("big_word", [](std::vector<uint8_t> const& data) {
+    a.registerFunction("big_word", [](Bytes const& data) {
         Check(data.size() >= 2, "Need at least 2 bytes");
         return data[1] | (data[0] << 8);
     });
 
-    a.registerFunction("translate", [](std::vector<uint8_t> const& data) {
+    a.registerFunction("translate", [&a](Bytes const& data) {
         std::vector<uint8_t> res;
         res.reserve(data.size());
         for (auto d : data) {
-            res.push_back(translateChar(d));
+            res.push_back(a.getTranslator().translateChar(d));
         }
         return res;
     });
@@ -129,27 +127,24 @@ void initFunctions(Assembler& a)
         return res;
     });
 
-    a.registerFunction("to_upper", [](std::string_view sv) {
+    a.registerFunction("to_upper", [&](std::string_view sv) {
         auto s = std::string(sv);
         for (auto& c : s) {
             c = toupper(c);
         }
-        return persist(s);
+        return a.intern(s);
     });
 
-    a.registerFunction("to_lower", [](std::string_view sv) {
+    a.registerFunction("to_lower", [&](std::string_view sv) {
         auto s = std::string(sv);
         for (auto& c : s) {
             c = tolower(c);
         }
-        return persist(s);
+        return a.intern(s);
     });
 
-    a.registerFunction("str", [](double n) {
-        auto s = std::to_string(static_cast<int64_t>(n));
-        std::string_view sv = s;
-        persist(sv);
-        return sv;
+    a.registerFunction("str", [&](double n) {
+        return a.intern(std::to_string(static_cast<int64_t>(n)));
     });
 
     a.registerFunction("index_tiles",
@@ -225,21 +220,20 @@ void initFunctions(Assembler& a)
     });
 
     // TODO: Remove
-    a.registerFunction("to_monochrome",
-                       [&](std::vector<uint8_t> const& pixels) {
-                           std::vector<uint8_t> result(pixels.size() / 8);
-                           uint8_t* out = result.data();
-                           int32_t v = 0;
-                           int32_t s = 7;
-                           for (auto const& c : pixels) {
-                               v |= ((c & 1) << s);
-                               s--;
-                               if (s == -1) {
-                                   s = 7;
-                                   *out++ = v;
-                                   v = 0;
-                               }
-                           }
-                           return result;
-                       });
+    a.registerFunction("to_monochrome", [&](Bytes const& pixels) {
+        std::vector<uint8_t> result(pixels.size() / 8);
+        uint8_t* out = result.data();
+        int32_t v = 0;
+        int32_t s = 7;
+        for (auto const& c : pixels) {
+            v |= ((c & 1) << s);
+            s--;
+            if (s == -1) {
+                s = 7;
+                *out++ = v;
+                v = 0;
+            }
+        }
+        return result;
+    });
 }
@@ -5,9 +5,9 @@ Program <- Statement*
 
 Statement <- Script / MetaBlock / Line
 
-Line <- EndOfLine / NonEmptyLine
+Line <- EndOfLine / NonEmptyLine / LastComment
 
-NonEmptyLine <- (AssignLine / OpLine / LabelLine / WhiteLine) _ (&'}' / EndOfLine / &EOT)
+NonEmptyLine <- (AssignLine / OpLine / LabelLine / WhiteLine) _ (&'}' / EndOfLine / EndOfText)
 
 WhiteLine <- WS
 
@@ -15,7 +15,7 @@ LabelLine <- Label
 
 OpLine <- Label? _ (MacroCall / Instruction)
 
-MetaBlock <- Label? _ (IfBlock / EnumBlock / (MetaDecl (Block / (&'}' / EndOfLine))))
+MetaBlock <- Label? _ (IfBlock / EnumBlock / (MetaDecl (Block / (&'}' / EndOfLine / EndOfText))))
 
 MetaDecl <- CheckDecl / MacroDecl / GenericDecl
 
@@ -27,8 +27,8 @@ CheckDecl <- '!check' WS DelayedExpression
 
 DelayedExpression <- Expression
 
-IfBlock <- (IfDecl / IfDefDecl / IfNDefDecl) (Block / (&'}' / EndOfLine))
-     (_ 'else' (Block / (&'}' / EndOfLine)))?
+IfBlock <- (IfDecl / IfDefDecl / IfNDefDecl) (Block / (&'}' / EndOfLine / EndOfText))
+     (_ 'else' (Block / (&'}' / EndOfLine / EndOfText)))?
 
 IfDecl <- '!if' WS Expression
 IfDefDecl <- '!ifdef' WS Symbol
@@ -117,6 +117,8 @@ LabelChar <- '-' / '+' / '$'
 Comment <- ';' (!EOL .)*
 EOL <- '\r\n' / '\r' / '\n'
 EOT <- !.
+~EndOfText <- _ Comment? EOT
+~LastComment <- _ Comment EOT
 
 Expression  <- Atom (Operator Atom)* {
                          precedence
@@ -0,0 +1,144 @@
+#include "linker.h"
+#include "machine.h"
+
+#include <fmt/format.h>
+
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+// Where a section of an object file ended up
+struct Placement
+{
+    std::string name;
+    int32_t offset;
+};
+
+bool isAnonymous(std::string const& name)
+{
+    return name.rfind("__anon_", 0) == 0;
+}
+
+} // namespace
+
+void linkObjects(std::vector<ObjectFile> const& objects, Machine& mach)
+{
+    for (auto const& obj : objects) {
+        obj.check();
+    }
+
+    std::vector<std::vector<Placement>> placements(objects.size());
+    std::unordered_set<std::string> withData;
+
+    for (size_t i = 0; i < objects.size(); i++) {
+        // Anonymous sections are renamed, so parents must be looked up
+        std::unordered_map<std::string, std::string> names;
+        for (auto const& s : objects[i].sections) {
+            if (!isAnonymous(s.name) && withData.count(s.name) > 0) {
+                // Append to a section from an earlier object
+                auto& section = mach.getSection(s.name);
+                placements[i].push_back(
+                    {s.name, static_cast<int32_t>(section.data.size())});
+                section.data.insert(section.data.end(), s.data.begin(),
+                                    s.data.end());
+                section.changed();
+                continue;
+            }
+            Section args;
+            args.name = isAnonymous(s.name) ? "" : s.name;
+            auto it = names.find(s.parent);
+            args.parent = it != names.end() ? it->second : s.parent;
+            args.start = s.start;
+            args.size = s.size;
+            args.flags = s.flags & ~(FixedStart | FixedSize);
+            args.align = s.align;
+            auto& section = mach.addSection(args);
+            names[s.name] = section.name;
+            placements[i].push_back({section.name, 0});
+            if (!s.data.empty()) {
+                section.data = s.data;
+                section.changed();
+                withData.insert(section.name);
+            }
+        }
+    }
+
+    int layouts = 0;
+    while (!mach.layoutSections()) {
+        if (++layouts > 10) {
+            throw link_error("Section layout does not converge");
+        }
+    }
+
+    auto sectionAddress = [&](size_t obj, int32_t index) {
+        auto const& p = placements[obj].at(index);
+        return mach.getSection(p.name).start + p.offset;
+    };
+
+    std::unordered_map<std::string, Number> globals;
+    for (size_t i = 0; i < objects.size(); i++) {
+        for (auto const& sym : objects[i].symbols) {
+            auto value = sym.value;
+            if (sym.section >= 0) {
+                value += sectionAddress(i, sym.section);
+            }
+            auto [it, inserted] = globals.emplace(sym.name, value);
+            if (!inserted && it->second != value) {
+                throw link_error(
+                    fmt::format("'{}' defined in more than one object",
+                                sym.name));
+            }
+        }
+    }
+
+    for (size_t i = 0; i < objects.size(); i++) {
+        auto const& obj = objects[i];
+        for (auto const& r : obj.relocs) {
+            int64_t value = r.addend;
+            if (r.target < reloc::ImportBase) {
+                value += sectionAddress(i, r.target);
+            } else {
+                auto const& name = obj.imports.at(r.target - reloc::ImportBase);
+                auto it = globals.find(name);
+                if (it == globals.end()) {
+                    throw link_error(
+                        fmt::format("Undefined symbol '{}'", name));
+                }
+                value += static_cast<int64_t>(it->second);
+            }
+
+            auto const& p = placements[i].at(r.section);
+            auto& section = mach.getSection(p.name);
+            auto pos = static_cast<size_t>(p.offset) + r.offset;
+            auto size = r.kind == RelocKind::Word ? 2 : 1;
+            if (pos + size > section.data.size()) {
+                throw link_error("Relocation outside section " + p.name);
+            }
+            auto& data = section.data;
+            section.changed();
+            switch (r.kind) {
+            case RelocKind::Word:
+                data[pos] = value & 0xff;
+                data[pos + 1] = (value >> 8) & 0xff;
+                break;
+            case RelocKind::Lo:
+                data[pos] = value & 0xff;
+                break;
+            case RelocKind::Hi:
+                data[pos] = (value >> 8) & 0xff;
+                break;
+            case RelocKind::Rel: {
+                auto diff =
+                    value - (section.start + static_cast<int64_t>(pos) + 1);
+                if (diff < -128 || diff > 127) {
+                    throw link_error(
+                        fmt::format("Branch out of range in {}", p.name));
+                }
+                data[pos] = diff & 0xff;
+                break;
+            }
+            }
+        }
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "object_file.h"
+
+#include <vector>
+
+class Machine;
+
+// Combine object files into the sections of `mach`. Sections with the
+// same name are concatenated, the result is laid out as usual and then
+// all relocations are applied. Throws `link_error` on failure.
+void linkObjects(std::vector<ObjectFile> const& objects, Machine& mach);
@@ -2,6 +2,7 @@
 #include "cart.h"
 #include "defines.h"
 #include "emulator.h"
+#include "opcodes.h"
 
 #include <coreutils/algorithm.h>
 #include <coreutils/file.h>
@@ -25,40 +26,63 @@ struct EmuPolicy : public sixfive::DefaultPolicy
     static constexpr int PC_AccessMode = sixfive::Banked;
 
     // Generic reads and writes should normally not be direct
-    static constexpr int Read_AccessMode = sixfive::Callback;
-    static constexpr int Write_AccessMode = sixfive::Callback;
+    static constexpr int Read_AccessMode = sixfive::Mapped;
+    static constexpr int Write_AccessMode = sixfive::Mapped;
 
     static constexpr int MemSize = 65536;
 
-    std::array<Intercept*, 64 * 1024> intercepts{};
+    // Tests spend most of their time in the emulator loop
+    static constexpr int Core = sixfive::Switch;
+
+    // Test cycle counts should match real hardware
+    static constexpr int Timing = sixfive::ExactCycles;
+
+    // Covered tests should run about as fast as other tests
+    static constexpr bool CoreCoverage = true;
+
+    // Intercepts are owned by the `Machine`. Only addresses on pages
+    // marked in `interceptPages` need to be looked up.
+    std::array<Intercept const*, 64 * 1024> intercepts{};
+    std::array<bool, 256> interceptPages{};
+    bool anyIntercepts = false;
 
     sixfive::Machine<EmuPolicy>& machine;
 
+    void copyIntercepts(EmuPolicy const& other)
+    {
+        intercepts = other.intercepts;
+        interceptPages = other.interceptPages;
+        anyIntercepts = other.anyIntercepts;
+    }
+
+    // Without intercepts, the emulator runs a loop without `eachOp()`
+    static bool watchOps(EmuPolicy& policy) { return policy.anyIntercepts; }
+
     // This function is run after each opcode. Return true to stop emulation.
     static bool eachOp(EmuPolicy& policy)
     {
-        static unsigned last_pc = 0xffffffff;
         auto pc = policy.machine.regPC();
-
-        if (pc != last_pc) {
-            // fmt::print("{:04x}\n", pc);
-            if (auto* ptr = policy.intercepts[pc]) {
-                return ptr->fn(pc);
-            }
-            last_pc = pc;
+        if (!policy.interceptPages[pc >> 8]) {
+            return false;
+        }
+        if (auto const* ptr = policy.intercepts[pc]) {
+            return ptr->fn(pc);
         }
         return false;
     }
 };
+
 void Machine::addIntercept(uint32_t address,
                            std::function<bool(uint32_t)> const& fn)
 {
-    auto*& ptr = machine->policy().intercepts[address & 0xffff];
-    if (ptr == nullptr) {
-        ptr = new Intercept();
-    }
-    ptr->type = Call;
-    ptr->fn = fn;
+    auto adr = static_cast<uint16_t>(address);
+    auto& intercept = intercepts[adr];
+    intercept.type = Call;
+    intercept.fn = fn;
+    auto& policy = machine->policy();
+    policy.intercepts[adr] = &intercept;
+    policy.interceptPages[adr >> 8] = true;
+    policy.anyIntercepts = true;
 }
 
 inline void Check(bool v, std::string const& txt)
@@ -66,6 +90,14 @@ inline void Check(bool v, std::string const& txt)
     if (!v) throw machine_error(txt);
 }
 
+static int32_t alignUp(int32_t adr, int32_t align)
+{
+    if (align <= 1) {
+        return adr;
+    }
+    return (adr + align - 1) / align * align;
+}
+
 Machine::Machine()
 {
     machine = std::make_unique<sixfive::Machine<EmuPolicy>>();
@@ -83,23 +115,29 @@ Machine::~Machine() = default;
 
 Section& Machine::addSection(Section const& s)
 {
-    auto [name, in, children, start, pc, size, flags, data, valid] = s;
+    auto name = s.name;
+    auto const& in = s.parent;
+    auto start = s.start;
+    auto pc = s.pc;
+    auto size = s.size;
+    auto flags = s.flags;
 
     if (name.empty()) {
         name = "__anon_" + std::to_string(anonSection++);
     }
 
-    auto it =
-        std::find_if(sections.begin(), sections.end(),
-                     [name = name](auto const& as) { return as.name == name; });
-
-    Section& section =
-        it == sections.end() ? sections.emplace_back(name, -1) : *it;
+    auto* existing = findSection(name);
+    if (existing == nullptr) {
+        sectionIndex[name] = sections.size();
+        existing = &sections.emplace_back(name, -1);
+    }
+    Section& section = *existing;
 
     Check(section.data.empty(),
           fmt::format("Section {} already populated", section.name));
 
     section.flags = flags;
+    section.align = s.align;
     section.pc = pc;
     if (size != -1) {
         section.size = size;
@@ -115,6 +153,8 @@ Section& Machine::addSection(Section const& s)
         auto& parent = getSection(in);
         LOGD("Parent %s at %x/%x", parent.name, parent.start, parent.pc);
         Check(parent.data.empty(), "Parent section must contain no data");
+        Check((parent.flags & Floating) == 0,
+              "Floating section may not have children");
 
         if (section.parent.empty()) {
             section.parent = in;
@@ -124,6 +164,9 @@ Section& Machine::addSection(Section const& s)
         if ((parent.flags & SectionFlags::ReadOnly) != 0) {
             section.flags |= SectionFlags::ReadOnly;
         }
+        if ((parent.flags & SectionFlags::Removable) != 0) {
+            section.flags |= SectionFlags::Removable;
+        }
 
         if (section.start == -1) {
             LOGD("Setting start to %x", parent.pc);
@@ -131,6 +174,17 @@ Section& Machine::addSection(Section const& s)
         }
     }
 
+    if ((section.flags & Floating) != 0) {
+        Check(in.empty(), "Floating section may not have a parent");
+        Check((section.flags & FixedStart) == 0,
+              "Floating section may not have a start");
+        if (section.start == -1) {
+            // Temporary start until the first layout
+            Check(!regions.empty(), "Floating section needs a region");
+            section.start = regions.front().start;
+        }
+    }
+
     if (section.pc == -1) {
         section.pc = section.start;
     }
@@ -142,18 +196,57 @@ Section& Machine::addSection(Section const& s)
 
 void Machine::removeSection(std::string const& name)
 {
-    auto it = std::find_if(sections.begin(), sections.end(),
-                           [&](auto const& s) { return s.name == name; });
-    if (it != sections.end()) {
-        sections.erase(it);
+    auto it = sectionIndex.find(name);
+    if (it == sectionIndex.end()) {
+        return;
+    }
+    auto index = it->second;
+    sections.erase(sections.begin() + static_cast<ptrdiff_t>(index));
+    sectionIndex.erase(it);
+    for (auto& [_, i] : sectionIndex) {
+        if (i > index) {
+            i--;
+        }
+    }
+}
+
+void Machine::stripSection(std::string const& name)
+{
+    auto& section = getSection(name);
+    section.stripped = true;
+    section.data.clear();
+    section.changed();
+}
+
+void Machine::clearStripped()
+{
+    for (auto& s : sections) {
+        s.stripped = false;
+        s.foldedInto.clear();
     }
 }
 
+void Machine::foldSection(std::string const& name, std::string const& into,
+                          int32_t offset)
+{
+    auto& section = getSection(name);
+    section.foldedInto = into;
+    section.foldOffset = offset;
+}
+
+void Machine::unfoldSection(std::string const& name)
+{
+    getSection(name).foldedInto.clear();
+}
+
 // Layout section 's', exactly at address if Floating, otherwise
 // it must at least be placed after address
 // Return section end
 int32_t Machine::layoutSection(int32_t start, Section& s)
 {
+    if (s.stripped || !s.foldedInto.empty()) {
+        return start;
+    }
     if (!s.valid) {
         LOGI("Skipping invalid section %s", s.name);
         return start;
@@ -161,6 +254,7 @@ int32_t Machine::layoutSection(int32_t start, Section& s)
 
     LOGD("Layout %s", s.name);
     if ((s.flags & FixedStart) == 0) {
+        start = alignUp(start, s.align);
         if (s.start != start) {
             LOGD("%s: %x differs from %x", s.name, s.start, start);
             layoutOk = false;
@@ -197,53 +291,191 @@ int32_t Machine::layoutSection(int32_t start, Section& s)
 bool Machine::layoutSections()
 {
     layoutOk = true;
+    std::vector<std::pair<Section*, int32_t>> floating;
     // Lay out all root sections
     for (auto& s : sections) {
         if (s.parent.empty()) {
             // LOGI("Root %s at %x", s.name, s.start);
             auto start = s.start;
-            layoutSection(start, s);
+            auto end = layoutSection(start, s);
+            if ((s.flags & Floating) != 0 && s.valid && !s.stripped &&
+                s.foldedInto.empty()) {
+                floating.emplace_back(&s, end - s.start);
+            }
+        }
+    }
+    if (!floating.empty()) {
+        placeFloating(floating);
+    }
+    // Folded sections follow the section they were folded into
+    for (auto& s : sections) {
+        if (!s.foldedInto.empty()) {
+            auto start = getSection(s.foldedInto).start + s.foldOffset;
+            if (s.start != start) {
+                layoutOk = false;
+                s.start = start;
+            }
         }
     }
     return layoutOk;
 }
 
-Error Machine::checkOverlap()
-{
-    for (auto const& a : sections) {
-        if (!a.data.empty() && ((a.flags & NoStorage) == 0)) {
-            for (auto const& b : sections) {
-                if (&a != &b && !b.data.empty() &&
-                    ((b.flags & NoStorage) == 0)) {
-                    auto as = a.start;
-                    auto ae = as + static_cast<int32_t>(a.data.size());
-                    auto bs = b.start;
-                    auto be = bs + static_cast<int32_t>(b.data.size());
-                    if (as >= bs && as < be) {
-                        return {2, 0,
-                                fmt::format("Section {} overlaps {}", a.name,
-                                            b.name)};
-                    }
-                    if (bs >= as && bs < ae) {
-                        return {2, 0,
-                                fmt::format("Section {} overlaps {}", b.name,
-                                            a.name)};
-                    }
-                }
+void Machine::addRegion(int32_t start, int32_t end)
+{
+    Check(end > start, "Region must not be empty");
+    regions.push_back({start, end});
+}
+
+// Pack floating sections into what is left of the regions after all
+// other sections are placed. Largest sections are placed first, each in
+// the free block where it leaves the least space. Since this only depends
+// on section sizes, placement does not change once the sizes are stable.
+// A section that does not fit stays where it is until then, as sizes from
+// early passes may still shrink.
+void Machine::placeFloating(
+    std::vector<std::pair<Section*, int32_t>> const& floating)
+{
+    auto free = regions;
+    auto reserve = [&](int32_t start, int32_t end) {
+        std::vector<Region> result;
+        for (auto const& r : free) {
+            if (end <= r.start || start >= r.end) {
+                result.push_back(r);
+                continue;
+            }
+            if (r.start < start) {
+                result.push_back({r.start, start});
             }
+            if (end < r.end) {
+                result.push_back({end, r.end});
+            }
+        }
+        free = std::move(result);
+    };
+
+    // Everything the placement depends on
+    std::vector<int32_t> inputs;
+    for (auto const& s : sections) {
+        if (s.valid && !s.stripped && s.foldedInto.empty() &&
+            s.children.empty() && (s.flags & Floating) == 0) {
+            auto size =
+                std::max(static_cast<int32_t>(s.data.size()), s.pc - s.start);
+            reserve(s.start, s.start + size);
+            inputs.push_back(s.start);
+            inputs.push_back(size);
         }
     }
-    return {};
+    for (auto const& f : floating) {
+        inputs.push_back(f.second);
+    }
+    bool const stable = inputs == failedInputs;
+    failedInputs.clear();
+
+    auto order = floating;
+    std::stable_sort(order.begin(), order.end(),
+                     [](auto const& a, auto const& b) {
+                         return a.second > b.second;
+                     });
+
+    for (auto const& [s, size] : order) {
+        if (size == 0) {
+            continue;
+        }
+        Region const* best = nullptr;
+        int32_t bestStart = 0;
+        for (auto const& r : free) {
+            auto start = alignUp(r.start, s->align);
+            if (start + size > r.end) {
+                continue;
+            }
+            if (best == nullptr || r.end - start < best->end - bestStart) {
+                best = &r;
+                bestStart = start;
+            }
+        }
+        if (best == nullptr) {
+            if (stable) {
+                throw machine_error(fmt::format(
+                    "No room for section {} ({} bytes)", s->name, size));
+            }
+            LOGD("%s: No room for %d bytes", s->name, size);
+            layoutOk = false;
+            failedInputs = inputs;
+            continue;
+        }
+        if (s->start != bestStart) {
+            LOGD("%s: Floating from %x to %x", s->name, s->start, bestStart);
+            layoutOk = false;
+            s->start = bestStart;
+        }
+        reserve(bestStart, bestStart + size);
+    }
+}
+
+std::vector<Error> Machine::checkOverlap()
+{
+    struct Range
+    {
+        int32_t start;
+        int32_t end;
+        Section const* section;
+    };
+
+    std::vector<Range> ranges;
+    for (auto const& s : sections) {
+        if (!s.data.empty() && ((s.flags & NoStorage) == 0) &&
+            s.foldedInto.empty()) {
+            ranges.push_back(
+                {s.start, s.start + static_cast<int32_t>(s.data.size()), &s});
+        }
+    }
+    std::stable_sort(ranges.begin(), ranges.end(),
+                     [](auto const& a, auto const& b) {
+                         return a.start < b.start;
+                     });
+
+    // Sweep through the sections in start order, keeping the ones that
+    // are still open at the current address
+    std::vector<Error> errors;
+    std::vector<Range const*> open;
+    for (auto const& r : ranges) {
+        open.erase(std::remove_if(open.begin(), open.end(),
+                                  [&](auto const* o) {
+                                      return o->end <= r.start;
+                                  }),
+                   open.end());
+        for (auto const* o : open) {
+            errors.emplace_back(2, 0,
+                                fmt::format("Section {} overlaps {}",
+                                            r.section->name, o->section->name));
+        }
+        open.push_back(&r);
+    }
+    return errors;
+}
+
+int32_t Machine::getSectionIndex(std::string const& name) const
+{
+    auto it = sectionIndex.find(name);
+    if (it == sectionIndex.end()) {
+        throw machine_error(fmt::format("Unknown section {}", name));
+    }
+    return static_cast<int32_t>(it->second);
+}
+
+Section* Machine::findSection(std::string const& name)
+{
+    auto it = sectionIndex.find(name);
+    return it == sectionIndex.end() ? nullptr : &sections[it->second];
 }
 
 Section& Machine::getSection(std::string const& name)
 {
-    auto it = std::find_if(sections.begin(), sections.end(),
-                           [&](auto const& s) { return s.name == name; });
-    if (it == sections.end()) {
+    auto* section = findSection(name);
+    if (section == nullptr) {
         throw machine_error(fmt::format("Unknown section {}", name));
     }
-    return *it;
+    return *section;
 }
 Section& Machine::getCurrentSection()
 {
@@ -275,9 +507,13 @@ void Machine::setSection(std::string const& name)
 void Machine::clear()
 {
     anonSection = 0;
+    anyWatches = false;
+    machine->clear_watches();
     dis.clear();
+    regions.clear();
     for (auto& s : sections) {
         s.data.clear();
+        s.changed();
         s.pc = s.start;
         s.valid = false;
     }
@@ -344,7 +580,7 @@ void Machine::writeCrt(utils::File const& outFile)
     // 8000 -> bfff
     // e000 -> ffff
     for (auto const& section : sections) {
-        if (section.data.empty()) {
+        if (section.data.empty() || !section.foldedInto.empty()) {
             continue;
         }
         LOGI("Start %x", section.start);
@@ -412,11 +648,12 @@ void Machine::writeListFile(std::string_view name)
 void Machine::write(std::string_view name, OutFmt fmt)
 {
     auto non_empty = utils::filter_to(sections, [](auto const& s) {
-        return !s.data.empty() && ((s.flags & NoStorage) == 0);
+        return !s.data.empty() && ((s.flags & NoStorage) == 0) &&
+               s.foldedInto.empty();
     });
 
     if (non_empty.empty()) {
-        puts("**Warning: No sections");
+        printOut("**Warning: No sections\n");
         return;
     }
 
@@ -434,7 +671,7 @@ void Machine::write(std::string_view name, OutFmt fmt)
                static_cast<int32_t>(non_empty.back().data.size());
 
     if (end <= start) {
-        puts("**Warning: No code generated");
+        printOut("**Warning: No code generated\n");
         return;
     }
 
@@ -504,7 +741,7 @@ void Machine::write(std::string_view name, OutFmt fmt)
 uint32_t Machine::run(uint16_t pc)
 {
     runSetup();
-    fmt::print("Running code at ${:x}\n", pc);
+    printOut("Running code at ${:x}\n", pc);
     return go(pc);
 }
 uint32_t Machine::go(uint16_t pc)
@@ -513,6 +750,170 @@ uint32_t Machine::go(uint16_t pc)
     return machine->run();
 }
 
+// The emulator running on this thread in a `Worker`, if any. Intercepts
+// called from there read and write it instead of the main emulator.
+static thread_local sixfive::Machine<EmuPolicy>* runningCopy = nullptr;
+
+sixfive::Machine<EmuPolicy>& Machine::emu() const
+{
+    return runningCopy != nullptr ? *runningCopy : *machine;
+}
+
+// Restoring only copies back the pages that were written since the last
+// run, and the result keeps just those pages
+static RunResult runEmulator(sixfive::Machine<EmuPolicy>& emu,
+                             MemSnapshot const& snapshot,
+                             RegState const& regs, uint16_t pc)
+{
+    using sixfive::Reg;
+    emu.restore(snapshot);
+    emu.reset_regs();
+    emu.set<Reg::A>(regs.regs[0]);
+    emu.set<Reg::X>(regs.regs[1]);
+    emu.set<Reg::Y>(regs.regs[2]);
+    for (auto const& [adr, val] : regs.ram) {
+        emu.write_ram(adr, val);
+    }
+    emu.setPC(pc);
+
+    // What this run alone covers is kept with the result, so it can be
+    // added again when the result is cached
+    auto* coverage = emu.coverage();
+    sixfive::Coverage covered;
+    if (coverage != nullptr) {
+        emu.set_coverage(&covered);
+    }
+    RunResult result;
+    try {
+        result.cycles = emu.run();
+    } catch (...) {
+        if (coverage != nullptr) {
+            coverage->merge(covered);
+            emu.set_coverage(coverage);
+        }
+        throw;
+    }
+    if (coverage != nullptr) {
+        result.covered = covered.marked();
+        coverage->add(result.covered);
+        emu.set_coverage(coverage);
+    }
+    result.ended = result.cycles != 0;
+    if (auto* profile = emu.profile()) {
+        profile->finish();
+    }
+    result.regs = {emu.get<Reg::A>(),  emu.get<Reg::X>(),
+                   emu.get<Reg::Y>(),  emu.get<Reg::SR>(),
+                   emu.get<Reg::SP>(), emu.get<Reg::PC>()};
+    result.base = snapshot;
+    auto const* pages = emu.dirty_pages();
+    std::array<uint8_t, 256> contents{};
+    for (unsigned i = 0; i < emu.dirty_count(); i++) {
+        auto offset = pages[i] * 256;
+        emu.read_ram(offset, contents.data(), contents.size());
+        // Pages written with the same data can still share the snapshot
+        if (!std::equal(contents.begin(), contents.end(),
+                        snapshot->begin() + offset)) {
+            result.pages.emplace_back(pages[i], contents);
+        }
+    }
+    auto const& read = emu.read_pages();
+    for (unsigned i = 0; i < read.size(); i++) {
+        if (read[i]) {
+            result.reads.push_back(i);
+        }
+    }
+    return result;
+}
+
+void Machine::setProfile(sixfive::Profile* p)
+{
+    machine->set_profile(p);
+}
+
+void Machine::setCoverage(sixfive::Coverage* c)
+{
+    machine->set_coverage(c);
+}
+
+void Machine::watchHit(sixfive::Machine<EmuPolicy>&, unsigned adr,
+                       unsigned value, int kind, void* data)
+{
+    auto* mach = static_cast<Machine*>(data);
+    if (mach->watchFunction) {
+        mach->watchFunction(adr, value, kind);
+    }
+}
+
+void Machine::addWatch(uint32_t start, uint32_t end, int kinds)
+{
+    anyWatches = true;
+    machine->watch(start, end, kinds, &watchHit, this);
+}
+
+void Machine::setHistory(unsigned size)
+{
+    machine->set_history(size);
+}
+
+std::vector<std::array<unsigned, 6>> Machine::getHistory() const
+{
+    std::vector<std::array<unsigned, 6>> result;
+    for (auto const& h : machine->history()) {
+        result.push_back({h.a, h.x, h.y, h.sr, h.sp, h.pc});
+    }
+    return result;
+}
+
+MemSnapshot Machine::snapshot()
+{
+    return machine->snapshot();
+}
+
+RunResult Machine::runFrom(MemSnapshot const& snapshot, RegState const& regs,
+                           uint16_t pc)
+{
+    return runEmulator(*machine, snapshot, regs, pc);
+}
+
+Machine::Worker::Worker(Machine const& m)
+    : emu(std::make_unique<sixfive::Machine<EmuPolicy>>())
+{
+    emu->set_cpu(m.cpu65C02);
+    emu->policy().copyIntercepts(m.machine->policy());
+}
+
+Machine::Worker::~Worker() = default;
+
+void Machine::Worker::setCoverage(sixfive::Coverage* c)
+{
+    emu->set_coverage(c);
+}
+
+void Machine::Worker::setProfile(sixfive::Profile* p)
+{
+    emu->set_profile(p);
+}
+
+RunResult Machine::Worker::run(MemSnapshot const& snapshot,
+                               RegState const& regs, uint16_t pc)
+{
+    if (loaded != snapshot) {
+        // Marks every page as dirty, so all are restored below
+        emu->write_ram(0, snapshot->data(), snapshot->size());
+        loaded = snapshot;
+    }
+    runningCopy = emu.get();
+    try {
+        auto result = runEmulator(*emu, snapshot, regs, pc);
+        runningCopy = nullptr;
+        return result;
+    } catch (...) {
+        runningCopy = nullptr;
+        throw;
+    }
+}
+
 void Machine::runSetup()
 {
     for (auto const& section : sections) {
@@ -530,16 +931,22 @@ void Machine::runSetup()
 
 uint32_t Machine::writeByte(uint8_t b)
 {
-    dis[currentSection->pc] = fmt::format("{:02x}", b);
-    currentSection->data.push_back(b);
+    if (!currentSection->stripped) {
+        dis[currentSection->pc] = fmt::format("{:02x}", b);
+        currentSection->data.push_back(b);
+        currentSection->changed();
+    }
     currentSection->pc++;
     return currentSection->pc;
 }
 
 uint32_t Machine::writeChar(uint8_t b)
 {
-    dis[currentSection->pc] = fmt::format("{:02x}", b);
-    currentSection->data.push_back(b);
+    if (!currentSection->stripped) {
+        dis[currentSection->pc] = fmt::format("{:02x}", b);
+        currentSection->data.push_back(b);
+        currentSection->changed();
+    }
     currentSection->pc++;
     return currentSection->pc;
 }
@@ -580,108 +987,124 @@ std::string Machine::disassemble(uint32_t* pc)
     return fmt::format("{} {}", name, argstr.data());
 }
 
-AsmResult Machine::assemble(Instruction const& instr)
+bool Machine::isBranch(std::string_view opcode) const
+{
+    namespace op = sixfive::opcodes;
+    auto mnemonic = op::findMnemonic(opcode);
+    if (mnemonic < 0) {
+        return false;
+    }
+    auto const& matrix = cpu65C02 ? op::matrix65C02 : op::matrix6502;
+    return matrix[mnemonic][static_cast<size_t>(sixfive::Mode::REL)] >= 0;
+}
+
+EncodedOp Machine::encode(Instruction const& instr, int32_t pc) const
 {
     using sixfive::Mode;
+    namespace op = sixfive::opcodes;
 
-    auto arg = instr;
-    std::string opcode = utils::toLower(std::string(instr.opcode));
+    EncodedOp result;
+    result.instr = instr;
+    result.cpu65C02 = cpu65C02;
 
-    auto const& instructions =
-        sixfive::Machine<EmuPolicy>::getInstructions(cpu65C02);
+    auto arg = instr;
+    auto key = op::makeKey(instr.opcode);
 
-    if (arg.mode == Mode::ZP_REL) {
-        auto bit = arg.val >> 24;
+    if (arg.mode == Mode::ZP_REL && key != 0 && instr.opcode.size() < 4) {
+        // bbr/bbs/rmb/smb have the bit number as part of the name
+        auto bit = static_cast<uint32_t>(arg.val >> 24);
         arg.val &= 0xffffff;
-        opcode = persist(std::string(opcode) + std::to_string(bit));
+        key |= ('0' + bit) << (instr.opcode.size() * 8);
     }
 
-    // Find a matching opcode
-    auto it_ins = utils::find_if(
-        instructions, [&](auto const& i) { return i.name == opcode; });
-
-    if (it_ins == instructions.end()) {
-        return AsmResult::NoSuchOpcode;
+    auto mnemonic = key == 0 ? -1 : op::findMnemonic(key);
+    if (mnemonic < 0) {
+        result.result = AsmResult::NoSuchOpcode;
+        return result;
     }
 
-    auto modeMatches = [&](auto const& opcode, auto const& instruction) {
-        if (instruction.mode == opcode.mode) {
-            return true;
-        }
-
-        // Addressing mode did not match directly. See if we can
-        // 'optimize it' depending on the instruction value
-
-        static std::unordered_map<Mode, Mode> conv{{Mode::INDZ, Mode::IND},
-                                                   {Mode::ZPX, Mode::ABSX},
-                                                   {Mode::ZPY, Mode::ABSY},
-                                                   {Mode::ZP, Mode::ABS}};
-
-        if (instruction.val >= 0 && instruction.val <= 0xff) {
-            auto it = conv.find(opcode.mode);
-            if (it != conv.end() && it->second == instruction.mode) {
-                return true;
-            }
-        }
-
-        return (instruction.mode == Mode::ABS && opcode.mode == Mode::REL);
-    };
-
-    // Find a matching addressing mode
-    auto it_op =
-        std::find_if(it_ins->opcodes.begin(), it_ins->opcodes.end(),
-                     [&](auto const& o) { return modeMatches(o, arg); });
-
-    if (it_op == it_ins->opcodes.end()) {
-        return AsmResult::IllegalAdressingMode;
+    auto const& matrix = cpu65C02 ? op::matrix65C02 : op::matrix6502;
+    auto enc = op::encode(matrix, mnemonic, arg.mode, arg.val);
+    if (enc.code < 0) {
+        result.result = AsmResult::IllegalAdressingMode;
+        return result;
     }
-    arg.mode = it_op->mode;
+    arg.mode = enc.mode;
 
     if (arg.mode == Mode::REL) {
-        arg.val = arg.val - currentSection->pc - 2;
+        arg.val = arg.val - pc - 2;
+        result.pc = pc;
     }
 
     if (arg.mode == Mode::ZP_REL) {
         auto adr = arg.val & 0xffff;
         auto val = (arg.val >> 16) & 0xff;
-        auto diff = adr - currentSection->pc - 2;
+        auto diff = adr - pc - 2;
         arg.val = diff << 8 | val;
+        result.pc = pc;
     }
 
     auto sz = opSize(arg.mode);
 
-    auto& cs = *currentSection;
     auto v = arg.val & (sz == 2 ? 0xff : 0xffff);
     if (arg.mode == sixfive::Mode::REL) {
-        v = (static_cast<int8_t>(v)) + 2 + cs.pc;
+        v = (static_cast<int8_t>(v)) + 2 + pc;
     }
 
-    dis[cs.pc] = fmt::format(
-        "{} "s + modeTemplate.at(static_cast<int>(arg.mode)), it_ins->name, v);
+    result.dis =
+        fmt::format("{} "s + modeTemplate.at(static_cast<int>(arg.mode)),
+                    op::mnemonics[mnemonic], v);
 
-    cs.data.push_back(it_op->code);
-    if (sz > 1) {
-        cs.data.push_back(arg.val & 0xff);
+    result.size = sz;
+    result.bytes[0] = enc.code;
+    result.bytes[1] = arg.val & 0xff;
+    result.bytes[2] = (arg.val >> 8) & 0xff;
+
+    result.result = AsmResult::Ok;
+    if (arg.mode == Mode::REL && (arg.val > 127 || arg.val < -128)) {
+        result.result = AsmResult::Truncated;
     }
-    if (sz > 2) {
-        cs.data.push_back(arg.val >> 8);
+    return result;
+}
+
+void Machine::emit(EncodedOp const& op)
+{
+    auto& cs = *currentSection;
+    if (!cs.stripped) {
+        dis[cs.pc] = op.dis;
+        cs.data.insert(cs.data.end(), op.bytes.begin(),
+                       op.bytes.begin() + op.size);
+        cs.changed();
     }
-    cs.pc += sz;
+    cs.pc += op.size;
+}
 
-    if (arg.mode == Mode::REL && (arg.val > 127 || arg.val < -128)) {
-        return AsmResult::Truncated;
+AsmResult Machine::assemble(Instruction const& instr, EncodedOp& cache)
+{
+    auto pc = currentSection->pc;
+    if (!cache.matches(instr, pc, cpu65C02)) {
+        cache = encode(instr, pc);
     }
+    if (cache.result == AsmResult::Ok || cache.result == AsmResult::Truncated) {
+        emit(cache);
+    }
+    return cache.result;
+}
 
-    return AsmResult::Ok;
+AsmResult Machine::assemble(Instruction const& instr)
+{
+    EncodedOp op;
+    return assemble(instr, op);
 }
 
 uint8_t Machine::readRam(uint16_t offset) const
 {
-    return machine->read_mem(offset);
+    emu().mark_read(offset >> 8);
+    return emu().read_mem(offset);
 }
 void Machine::writeRam(uint16_t offset, uint8_t val)
 {
-    machine->write_ram(offset, val);
+    emu().write_ram(offset, val);
 }
 
 void Machine::bankWriteFunction(uint16_t adr, uint8_t val, void* data)
@@ -700,6 +1123,7 @@ void Machine::setBankWrite(int hi_adr, int len,
                            std::function<void(uint16_t, uint8_t)> const& fn)
 {
     bank_write_functions[hi_adr] = fn;
+    banksMapped = true;
     machine->map_write_callback(hi_adr, len, this, bankWriteFunction);
 }
 
@@ -707,6 +1131,7 @@ void Machine::setBankRead(int hi_adr, int len,
                           std::function<uint8_t(uint16_t)> const& fn)
 {
     bank_read_functions[hi_adr] = fn;
+    banksMapped = true;
     machine->map_read_callback(hi_adr, len, this, bankReadFunction);
 }
 
@@ -721,13 +1146,17 @@ void Machine::setBankRead(int hi_adr, int len, int bank)
         }
     }
     Check(bankSection != nullptr, "Could not map bank");
+    banksMapped = true;
     machine->map_rom(hi_adr, bankSection->data.data(), len);
 }
 
-std::vector<uint8_t> Machine::getRam()
+Bytes Machine::getRam()
 {
     std::vector<uint8_t> data(0x10000);
-    machine->read_ram(0, &data[0], data.size());
+    emu().read_ram(0, &data[0], data.size());
+    for (unsigned i = 0; i < 256; i++) {
+        emu().mark_read(i);
+    }
     return data;
 }
 
@@ -735,14 +1164,14 @@ void Machine::setRegs(RegState const& regs)
 {
     using sixfive::Reg;
     auto const& r = regs.regs;
-    machine->set<Reg::A>(r[0]);
-    machine->set<Reg::X>(r[1]);
-    machine->set<Reg::Y>(r[2]);
+    emu().set<Reg::A>(r[0]);
+    emu().set<Reg::X>(r[1]);
+    emu().set<Reg::Y>(r[2]);
     // machine->set<Reg::SR>(r[3]);
     // machine->set<Reg::SP>(r[4]);
     // machine->set<Reg::PC>(r[5]);
     for (auto const& [adr, val] : regs.ram) {
-        machine->write_ram(adr, val);
+        emu().write_ram(adr, val);
     }
 }
 
@@ -751,17 +1180,17 @@ void Machine::setReg(sixfive::Reg reg, unsigned v)
     using sixfive::Reg;
     switch (reg) {
     case Reg::A:
-        return machine->set<Reg::A>(v);
+        return emu().set<Reg::A>(v);
     case Reg::X:
-        return machine->set<Reg::X>(v);
+        return emu().set<Reg::X>(v);
     case Reg::Y:
-        return machine->set<Reg::Y>(v);
+        return emu().set<Reg::Y>(v);
     case Reg::SR:
-        return machine->set<Reg::SR>(v);
+        return emu().set<Reg::SR>(v);
     case Reg::SP:
-        return machine->set<Reg::SP>(v);
+        return emu().set<Reg::SP>(v);
     case Reg::PC:
-        return machine->set<Reg::PC>(v);
+        return emu().set<Reg::PC>(v);
     }
 }
 
@@ -770,17 +1199,17 @@ unsigned Machine::getReg(sixfive::Reg reg)
     using sixfive::Reg;
     switch (reg) {
     case Reg::A:
-        return machine->get<Reg::A>();
+        return emu().get<Reg::A>();
     case Reg::X:
-        return machine->get<Reg::X>();
+        return emu().get<Reg::X>();
     case Reg::Y:
-        return machine->get<Reg::Y>();
+        return emu().get<Reg::Y>();
     case Reg::SR:
-        return machine->get<Reg::SR>();
+        return emu().get<Reg::SR>();
     case Reg::SP:
-        return machine->get<Reg::SP>();
+        return emu().get<Reg::SP>();
     case Reg::PC:
-        return machine->get<Reg::PC>();
+        return emu().get<Reg::PC>();
     }
     return 0; // Cant get here
 }
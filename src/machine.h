@@ -5,6 +5,7 @@
 
 #include <coreutils/file.h>
 
+#include <array>
 #include <cstdint>
 #include <deque>
 #include <functional>
@@ -12,6 +13,7 @@
 #include <memory>
 #include <string>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
 class machine_error : public std::exception
@@ -41,6 +43,8 @@ struct Intercept
 
 namespace sixfive {
 struct DefaultPolicy;
+struct Profile;
+struct Coverage;
 template <class POLICY>
 struct Machine;
 } // namespace sixfive
@@ -55,6 +59,27 @@ enum class AsmResult
     Failed
 };
 
+// An encoded instruction. The assembler keeps these between passes so
+// instructions that did not change do not have to be encoded again.
+struct EncodedOp
+{
+    Instruction instr{"", sixfive::Mode::NONE, 0};
+    // Address it was encoded for; only set for relative modes
+    int32_t pc = -1;
+    bool cpu65C02 = false;
+    AsmResult result = AsmResult::Failed;
+    uint8_t size = 0;
+    std::array<uint8_t, 3> bytes{};
+    std::string dis;
+
+    bool matches(Instruction const& in, int32_t at, bool c02) const
+    {
+        return result != AsmResult::Failed && in.val == instr.val &&
+               in.mode == instr.mode && in.opcode == instr.opcode &&
+               c02 == cpu65C02 && (pc < 0 || pc == at);
+    }
+};
+
 enum SectionFlags
 {
     NoStorage = 1, // May not contain data (non leaf)
@@ -63,7 +88,16 @@ enum SectionFlags
     KeepFirst = 8,   // Keep first even if new First section is added
     KeepLast = 16,   // Keep last when new sections are added
     FixedStart = 32, // Section may not moved (specified with Start)
-    FixedSize = 64   // Specified with size
+    FixedSize = 64,  // Specified with size
+    Floating = 128,  // Placed in a free region by the layout
+    Removable = 256  // May be stripped if nothing refers to it
+};
+
+// A range of memory [start, end) that floating sections may be placed in
+struct Region
+{
+    int32_t start;
+    int32_t end;
 };
 
 struct Section
@@ -77,6 +111,7 @@ struct Section
     Section& addByte(uint8_t b)
     {
         data.push_back(b);
+        changed();
         pc++;
         return *this;
     }
@@ -102,9 +137,35 @@ struct Section
     int32_t start = -1;
     int32_t pc = -1;
     int32_t size = -1;
+    int32_t align = 0;
     uint32_t flags{};
+    // Return section data as a shared buffer. The copy is made once and
+    // reused until `changed()` is called.
+    Bytes const& bytes() const
+    {
+        if (bytesDirty) {
+            cachedBytes = Bytes(data);
+            bytesDirty = false;
+        }
+        return cachedBytes;
+    }
+    // Must be called after every change to `data`
+    void changed()
+    {
+        bytesDirty = true;
+        cachedBytes = {};
+    }
+
     std::vector<uint8_t> data;
     bool valid{true};
+    // Removed by stripping. Keeps its addresses but stores no data.
+    bool stripped{false};
+    // Data is identical to the bytes at `foldOffset` in this section, so
+    // it is placed there instead of being written separately
+    std::string foldedInto;
+    int32_t foldOffset = 0;
+    mutable Bytes cachedBytes;
+    mutable bool bytesDirty{true};
 };
 
 enum class OutFmt
@@ -125,18 +186,29 @@ public:
 
     int32_t layoutSection(int32_t start, Section& s);
     bool layoutSections();
-    Error checkOverlap();
+    void addRegion(int32_t start, int32_t end);
+    // Return an error for every pair of overlapping data sections
+    std::vector<Error> checkOverlap();
 
     void writeCrt(utils::File const& outFile);
 
     uint32_t writeByte(uint8_t b);
     uint32_t writeChar(uint8_t b);
     AsmResult assemble(Instruction const& instr);
+    // Assemble using (and updating) a previous encoding
+    AsmResult assemble(Instruction const& instr, EncodedOp& cache);
     std::string disassemble(uint32_t* pc);
+    // Check if `opcode` takes a relative (branch) argument
+    bool isBranch(std::string_view opcode) const;
 
     Section& addSection(Section const& s);
 
     void removeSection(std::string const& name);
+    void stripSection(std::string const& name);
+    void clearStripped();
+    void foldSection(std::string const& name, std::string const& into,
+                     int32_t offset);
+    void unfoldSection(std::string const& name);
     void setSection(std::string const& name);
     void popSection();
     void dropSection();
@@ -144,6 +216,8 @@ public:
     Section& getSection(std::string const& name);
     Section& getCurrentSection();
     std::deque<Section> const& getSections() const { return sections; }
+    // Index of a section in `getSections()`
+    int32_t getSectionIndex(std::string const& name) const;
     uint32_t getPC() const;
     void write(std::string_view name, OutFmt fmt);
     void writeListFile(std::string_view name);
@@ -154,7 +228,52 @@ public:
     uint32_t run(uint16_t pc);
     uint32_t go(uint16_t pc);
     void runSetup();
-    std::vector<uint8_t> getRam();
+    Bytes getRam();
+
+    // Save the current memory, normally right after `runSetup()`
+    MemSnapshot snapshot();
+    // Restore memory from `snapshot`, which must have been taken from
+    // this machine, then run code at `pc` from reset registers
+    RunResult runFrom(MemSnapshot const& snapshot, RegState const& regs,
+                      uint16_t pc);
+    bool hasBankFunctions() const { return banksMapped; }
+    // Count instructions run on this machine (not on workers) in `p`
+    void setProfile(sixfive::Profile* p);
+    // Mark instructions run on this machine (not on workers) in `c`
+    void setCoverage(sixfive::Coverage* c);
+
+    // Watch accesses of the `sixfive::WatchKind`s in `kinds` to addresses
+    // from `start` up to `end`. Each is passed to the watch function with
+    // its address, value and kind. Watches are removed by `clear()`.
+    using WatchFunction = std::function<void(uint16_t, uint8_t, int)>;
+    void setWatchFunction(WatchFunction const& fn) { watchFunction = fn; }
+    void addWatch(uint32_t start, uint32_t end, int kinds);
+    bool hasWatches() const { return anyWatches; }
+
+    // Remember registers for the last `size` instructions run, or stop
+    // if 0. `getHistory()` returns them oldest first, as A, X, Y, SR, SP
+    // and PC like in `RunResult`.
+    void setHistory(unsigned size);
+    std::vector<std::array<unsigned, 6>> getHistory() const;
+
+    // A separate emulator sharing the intercepts of a machine. While it
+    // runs, register and memory access on the machine from the same thread
+    // go to the worker. Workers may run on several threads at once if all
+    // intercepts can, and no bank functions are set.
+    class Worker
+    {
+    public:
+        explicit Worker(Machine const& m);
+        ~Worker();
+        RunResult run(MemSnapshot const& snapshot, RegState const& regs,
+                      uint16_t pc);
+        void setCoverage(sixfive::Coverage* c);
+        void setProfile(sixfive::Profile* p);
+
+    private:
+        std::unique_ptr<sixfive::Machine<EmuPolicy>> emu;
+        MemSnapshot loaded;
+    };
 
     unsigned getReg(sixfive::Reg reg);
     void setReg(sixfive::Reg reg, unsigned v);
@@ -179,10 +298,17 @@ public:
     };
 
     void setCpu(CPU cpu);
+    bool is65C02() const { return cpu65C02; }
 
     std::map<uint32_t, std::string> dis;
 
 private:
+    EncodedOp encode(Instruction const& instr, int32_t pc) const;
+    sixfive::Machine<EmuPolicy>& emu() const;
+    void emit(EncodedOp const& op);
+    Section* findSection(std::string const& name);
+    void placeFloating(
+        std::vector<std::pair<Section*, int32_t>> const& floating);
 
     bool cpu65C02 = true;
 
@@ -192,11 +318,24 @@ private:
         bank_read_functions;
     std::unordered_map<uint8_t, std::function<void(uint16_t, uint8_t)>>
         bank_write_functions;
+    // Intercepts by address, pointed to from the emulator
+    std::unordered_map<uint16_t, Intercept> intercepts;
+    WatchFunction watchFunction;
+    bool anyWatches = false;
+    static void watchHit(sixfive::Machine<EmuPolicy>& emu, unsigned adr,
+                         unsigned value, int kind, void* data);
 
     std::unique_ptr<sixfive::Machine<EmuPolicy>> machine;
     std::deque<Section> sections;
+    // Index into `sections` by name
+    std::unordered_map<std::string, size_t> sectionIndex;
+    std::vector<Region> regions;
+    // Placement inputs from the last layout where a floating section did
+    // not fit
+    std::vector<int32_t> failedInputs;
     Section* currentSection = nullptr;
     int anonSection = 0;
 
     bool layoutOk{false};
+    bool banksMapped{false};
 };
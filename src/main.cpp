@@ -1,8 +1,12 @@
 
 #include "assembler.h"
+#include "coverage.h"
 #include "defines.h"
+#include "emulator.h"
+#include "linker.h"
 #include "machine.h"
 #include "pet100.h"
+#include "profile.h"
 
 #include <coreutils/file.h>
 #include <coreutils/log.h>
@@ -15,7 +19,10 @@
 #    include <csignal>
 #endif
 
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <mutex>
 #include <thread>
 
 using namespace std::chrono_literals;
@@ -43,9 +50,17 @@ struct AssemblerState
     bool quiet = false;
     bool doRun = false;
     int maxPasses = 10;
+    bool stripUnused = false;
+    bool foldData = false;
+    bool compile = false;
+    bool link = false;
+    unsigned jobs = 0;
+    unsigned testJobs = 0;
     std::string listFile;
     std::string symbolFile;
     std::string programFile;
+    std::string profileFile;
+    std::string coverageFile;
     OutFmt outFmt = OutFmt::Prg;
 
     void parseArgs(int argc, char** argv)
@@ -64,6 +79,17 @@ struct AssemblerState
         app.add_flag("--trace", showTrace, "Trace rule invocations");
         app.add_flag("--run", doRun, "Run program");
         app.add_option("--max-passes", maxPasses, "Max assembler passes");
+        app.add_flag("--strip", stripUnused,
+                     "Strip removable sections that are not referenced");
+        app.add_flag("--fold", foldData,
+                     "Fold read only sections with identical data");
+        app.add_flag("-c,--compile", compile,
+                     "Assemble each source into an object file");
+        app.add_flag("--link", link, "Link object files");
+        app.add_option("-j,--jobs", jobs,
+                       "Assemble each source separately, using N threads");
+        app.add_option("--test-jobs", testJobs,
+                       "Threads used to run tests (default one per core)");
         app.add_flag("--show-undefined", showUndef,
                      "Show undefined after each pass");
         app.add_flag("-q,--quiet", quiet, "Less noise");
@@ -74,6 +100,12 @@ struct AssemblerState
                        "Write numeric symbols to file");
         app.add_option("-o,--out", outFile, "Output file");
         app.add_option("-p,--prg", programFile, "Program file");
+        app.add_option("--profile", profileFile,
+                       "Write a profile of the tests, and of the program "
+                       "with --run, to file");
+        app.add_option("--coverage", coverageFile,
+                       "Write the source lines run by tests to file (LCOV "
+                       "for .info or .lcov)");
         app.add_option("-D", definitions, "Add symbol");
         app.add_option("-i", sourceFiles, "Sources to compile");
         app.add_option("-x,--lua", scriptFiles, "LUA scripts to load")
@@ -101,17 +133,15 @@ struct AssemblerState
     void setupAssembler(Assembler& assem)
     {
         assem.setMaxPasses(maxPasses);
+        assem.setStripUnused(stripUnused);
+        assem.setFoldData(foldData);
+        assem.setTestThreads(testJobs);
         assem.setDebugFlags((showUndef ? Assembler::DEB_PASS : 0) |
                             (showTrace ? Assembler::DEB_TRACE : 0));
 
         assem.useCache(!doRun);
+        assem.setMapSources(!doRun);
 
-        if (outFile.empty()) {
-            outFile =
-                outFmt == OutFmt::Prg
-                    ? "result.prg"
-                    : (outFmt == OutFmt::Crt ? "result.crt" : "result.bin");
-        }
         auto& mach = assem.getMachine();
         auto& syms = assem.getSymbols();
         mach.setCpu(use65c02 ? Machine::CPU::CPU_65C02 : Machine::CPU_6502);
@@ -128,42 +158,190 @@ struct AssemblerState
                 syms.at<Number>(parts[0]) = std::strtod(parts[1], nullptr);
             }
         }
+    }
 
-        logging::setLevel(logging::Level::Info);
+    std::string outExtension() const
+    {
+        if (outFmt == OutFmt::Prg) return ".prg";
+        return outFmt == OutFmt::Crt ? ".crt" : ".bin";
     }
 
-    bool assemble(Assembler& assem)
+    // Output file when each source is assembled separately
+    std::string outFileFor(std::string const& sourceFile,
+                           std::string const& ext) const
     {
-        bool failed = false;
-        for (auto const& sourceFile : sourceFiles) {
-            auto sp = fs::path(sourceFile);
-            if (!assem.parse_path(sp)) {
-                for (auto const& e : assem.getErrors()) {
-                    if (e.level == ErrLevel::Error) failed = true;
-                    fmt::print("{}:{}: {}: {}\n", e.file, e.line,
-                               e.level == ErrLevel::Warning ? "warning"
-                                                            : "error",
-                               e.message.c_str());
+        if (!outFile.empty() && sourceFiles.size() == 1) {
+            return outFile;
+        }
+        return fs::path(sourceFile).replace_extension(ext).string();
+    }
+
+    // Options that only apply when all sources are assembled together
+    std::string unitOption() const
+    {
+        if (!listFile.empty()) return "--list-file";
+        if (!symbolFile.empty()) return "--table";
+        if (dumpSyms) return "--symbols";
+        if (!profileFile.empty()) return "--profile";
+        if (!coverageFile.empty()) return "--coverage";
+        return "";
+    }
+
+    // Call `job` for every source file, using up to `jobs` threads. The
+    // output of each source is printed whole when it is done.
+    bool forEachSource(std::function<bool(std::string const&)> const& job)
+    {
+        std::atomic<size_t> next{0};
+        std::atomic<bool> ok{true};
+        std::mutex printMutex;
+        auto worker = [&] {
+            for (size_t i = next++; i < sourceFiles.size(); i = next++) {
+                std::string output;
+                outputBuffer = &output;
+                try {
+                    if (!job(sourceFiles[i])) {
+                        ok = false;
+                    }
+                } catch (std::exception& e) {
+                    output += fmt::format("**Error: {}: {}\n", sourceFiles[i],
+                                          e.what());
+                    ok = false;
                 }
+                outputBuffer = nullptr;
+                std::lock_guard lock(printMutex);
+                fputs(output.c_str(), stdout);
+                fflush(stdout);
+            }
+        };
+        auto count = std::min<size_t>(std::max(jobs, 1U), sourceFiles.size());
+        // Units share the cores when running their tests
+        if (testJobs == 0 && count > 1) {
+            testJobs = std::max(std::thread::hardware_concurrency() /
+                                    static_cast<unsigned>(count),
+                                1U);
+        }
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < count; i++) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& t : threads) {
+            t.join();
+        }
+        return ok;
+    }
+
+    bool assemble(Assembler& assem, std::string const& sourceFile)
+    {
+        bool failed = false;
+        auto sp = fs::path(sourceFile);
+        if (!assem.parse_path(sp)) {
+            for (auto const& e : assem.getErrors()) {
+                if (e.level == ErrLevel::Error) failed = true;
+                printOut("{}:{}: {}: {}\n", e.file, e.line,
+                         e.level == ErrLevel::Warning ? "warning" : "error",
+                         e.message.c_str());
             }
         }
         return !failed;
     }
+
+    bool assemble(Assembler& assem)
+    {
+        bool ok = true;
+        for (auto const& sourceFile : sourceFiles) {
+            ok = assemble(assem, sourceFile) && ok;
+        }
+        return ok;
+    }
+
+    // Assemble each source file separately into an object file
+    int compileObjects()
+    {
+        auto ok = forEachSource([&](std::string const& sourceFile) {
+            Assembler unit;
+            setupAssembler(unit);
+            unit.setObjectMode(true);
+            if (!assemble(unit, sourceFile)) {
+                return false;
+            }
+            unit.makeObject().write(outFileFor(sourceFile, ".o"));
+            return true;
+        });
+        return ok ? 0 : 1;
+    }
+
+    // Assemble each source file separately into its own output file
+    int assembleEach()
+    {
+        auto ok = forEachSource([&](std::string const& sourceFile) {
+            Assembler unit;
+            setupAssembler(unit);
+            if (!assemble(unit, sourceFile)) {
+                return false;
+            }
+            unit.getMachine().write(outFileFor(sourceFile, outExtension()),
+                                    outFmt);
+            return true;
+        });
+        return ok ? 0 : 1;
+    }
 };
 
+// Set by ctrl-c when running with a profile, so the profile is written
+// before quitting
+static std::atomic<bool> stopRequested{false};
+static bool stopOnInterrupt = false;
+
 int main(int argc, char** argv)
 {
     AssemblerState state;
     state.parseArgs(argc, argv);
+    logging::setLevel(logging::Level::Info);
+
+    bool separate = state.compile ||
+                    (state.jobs > 0 && !state.doRun && !state.link);
+    if (separate) {
+        auto option = state.unitOption();
+        if (!option.empty()) {
+            fmt::print(stderr, "**Error: {} can not be used with {}\n",
+                       option, state.compile ? "--compile" : "--jobs");
+            return 1;
+        }
+    }
+    if (state.compile) {
+        return state.compileObjects();
+    }
+    if (separate) {
+        return state.assembleEach();
+    }
+
+    if (state.outFile.empty()) {
+        state.outFile = "result"s + state.outExtension();
+    }
 
     Assembler assem;
     state.setupAssembler(assem);
 
     auto& mach = assem.getMachine();
 
+    sixfive::Profile profile;
+    if (!state.profileFile.empty()) {
+        assem.setProfile(&profile);
+        stopOnInterrupt = state.doRun;
+    }
+    sixfive::Coverage coverage;
+    if (!state.coverageFile.empty()) {
+        assem.setCoverage(&coverage);
+    }
+
 #ifndef _WIN32
     struct sigaction sh = {};
     sh.sa_handler = [](int) {
+        if (stopOnInterrupt) {
+            stopRequested = true;
+            return;
+        }
         // Restore cursor and exit alt mode
         fputs("\x1b[?25h", stdout);
         fputs("\x1b[?1049l", stdout);
@@ -174,6 +352,21 @@ int main(int argc, char** argv)
     sigaction(SIGINT, &sh, nullptr);
 #endif
 
+    if (state.link) {
+        try {
+            std::vector<ObjectFile> objects;
+            for (auto const& objectFile : state.sourceFiles) {
+                objects.push_back(ObjectFile::read(objectFile));
+            }
+            linkObjects(objects, mach);
+            mach.write(state.outFile, state.outFmt);
+        } catch (std::exception& e) {
+            fmt::print(stderr, "**Error: {}\n", e.what());
+            return 1;
+        }
+        state.sourceFiles.clear();
+    }
+
     while (state.doRun) {
 
         Pet100 emu;
@@ -214,10 +407,14 @@ int main(int argc, char** argv)
             }
         }
         emu.start(start);
+        // The program is counted on top of the tests
+        if (!state.profileFile.empty()) {
+            emu.setProfile(&profile);
+        }
         bool quit = false;
         bool recompile = false;
         while (!quit) {
-            quit = emu.update();
+            quit = emu.update() || stopRequested;
             size_t i = 0;
             for (auto const& sourceFile : state.sourceFiles) {
                 auto lastTime = times[i];
@@ -233,29 +430,43 @@ int main(int argc, char** argv)
                 }
             }
         }
+        if (!state.profileFile.empty()) {
+            profile.finish();
+            writeProfile(state.profileFile, profile, assem);
+        }
         if (recompile) {
             continue;
         }
         return 0;
     }
 
-    assem.clear();
-    if (!state.assemble(assem)) {
-        return 1;
-    }
+    if (!state.link) {
+        assem.clear();
+        if (!state.assemble(assem)) {
+            return 1;
+        }
 
-    try {
-        mach.write(state.outFile, state.outFmt);
-    } catch (utils::io_exception&) {
-        fmt::print(stderr, "**Error: Could not write output file {}\n",
-                   state.outFile);
-        return 1;
+        try {
+            mach.write(state.outFile, state.outFmt);
+        } catch (utils::io_exception&) {
+            fmt::print(stderr, "**Error: Could not write output file {}\n",
+                       state.outFile);
+            return 1;
+        }
     }
 
     if (!state.listFile.empty()) {
         mach.writeListFile(state.listFile);
     }
 
+    if (!state.profileFile.empty()) {
+        writeProfile(state.profileFile, profile, assem);
+    }
+
+    if (!state.coverageFile.empty()) {
+        writeCoverage(state.coverageFile, coverage, assem);
+    }
+
     if (!state.quiet) {
         for (auto const& section : mach.getSections()) {
             if (!section.data.empty()) {
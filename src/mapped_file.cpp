@@ -0,0 +1,60 @@
+#include "mapped_file.h"
+
+#include <coreutils/file.h>
+
+#ifndef _WIN32
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
+MappedFile::MappedFile(std::string const& name, bool map)
+{
+#ifndef _WIN32
+    if (map) {
+        map = mapFile(name);
+    }
+    if (map) {
+        return;
+    }
+#endif
+    // Read the file instead
+    utils::File f{name};
+    contents = f.readAllString();
+    ptr = contents.data();
+    len = contents.size();
+}
+
+#ifndef _WIN32
+bool MappedFile::mapFile(std::string const& name)
+{
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw utils::io_exception("Could not open " + name);
+    }
+    struct stat st{};
+    bool const haveSize = fstat(fd, &st) == 0;
+    if (haveSize && st.st_size > 0) {
+        auto sz = static_cast<size_t>(st.st_size);
+        void* p = mmap(nullptr, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            ptr = static_cast<char const*>(p);
+            len = sz;
+            mapped = true;
+        }
+    }
+    close(fd);
+    // An empty file needs no contents
+    return mapped || (haveSize && st.st_size == 0);
+}
+#endif
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+    if (mapped) {
+        munmap(const_cast<char*>(ptr), len);
+    }
+#endif
+}
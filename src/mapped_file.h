@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// A read only view of a file, memory mapped where the platform allows it.
+// The contents stay valid (and in place) until the object is destroyed.
+// A mapped file that is truncated while mapped can crash the process on
+// access, so files that may change are better read with `map` false.
+class MappedFile
+{
+public:
+    explicit MappedFile(std::string const& name, bool map = true);
+    ~MappedFile();
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    char const* data() const { return ptr; }
+    size_t size() const { return len; }
+    std::string_view view() const { return {ptr, len}; }
+    // Check if `s` points into the contents
+    bool owns(std::string_view s) const
+    {
+        return s.data() >= ptr && s.data() + s.size() <= ptr + len;
+    }
+
+private:
+    bool mapFile(std::string const& name);
+
+    char const* ptr = "";
+    size_t len = 0;
+    bool mapped = false;
+    // Used where mapping is not possible
+    std::string contents;
+};
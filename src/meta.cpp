@@ -1,6 +1,7 @@
 #include "assembler.h"
 #include "chars.h"
 #include "defines.h"
+#include "emulator.h"
 #include "machine.h"
 
 #include <any>
@@ -38,6 +39,14 @@ static Section parseArgs(std::vector<std::any> const& args)
                 result.flags |= NoStorage;
             } else if (p->first == "ToFile") {
                 result.flags |= WriteToDisk;
+            } else if (p->first == "ReadOnly") {
+                result.flags |= ReadOnly;
+            } else if (p->first == "Removable") {
+                result.flags |= Removable;
+            } else if (p->first == "Float") {
+                result.flags |= Floating;
+            } else if (p->first == "align") {
+                result.align = number<int32_t>(p->second);
             }
         } else {
             if (i == 0) {
@@ -62,10 +71,12 @@ void initMeta(Assembler& assem)
 {
     using std::any_cast;
     using Meta = Assembler::Meta;
-    static bool globalCond = true;
+    // Result of the last `!if`, shared by `!elseif` and `!else`
+    auto globalCond = std::make_shared<bool>(true);
     auto& mach = assem.getMachine();
+    auto& translator = assem.getTranslator();
 
-    setTranslation(Translation::ScreencodeUpper);
+    translator.setTranslation(Translation::ScreencodeUpper);
 
     static auto is_space = [](char const c) {
         return c == ' ' || c == '\t' || c == '\n' || c == '\r';
@@ -88,12 +99,12 @@ void initMeta(Assembler& assem)
         Check(meta.args.size() == 1, "Expected single argument");
         std::any data = meta.args[0];
         std::string indexVar = "i";
-        std::vector<uint8_t>* vec = nullptr;
+        Bytes* vec = nullptr;
         size_t count = 0;
         if (auto* p = any_cast<std::pair<std::string_view, std::any>>(&data)) {
             indexVar = p->first;
             count = number<size_t>(p->second);
-        } else if ((vec = any_cast<std::vector<uint8_t>>(&data))) {
+        } else if ((vec = any_cast<Bytes>(&data))) {
             count = vec->size();
         } else {
             count = number<size_t>(data);
@@ -143,6 +154,122 @@ void initMeta(Assembler& assem)
         assem.addTest(testName, start, regs);
     });
 
+    assem.registerMeta("watch", [&](Meta const& meta) {
+        Check(!meta.args.empty(), "Expected address");
+        auto start = number<uint32_t>(meta.args[0]);
+        auto end = start + 1;
+        int kinds = sixfive::WatchRead | sixfive::WatchWrite;
+        for (size_t i = 1; i < meta.args.size(); i++) {
+            auto const& v = meta.args[i];
+            if (auto const* s = any_cast<std::string_view>(&v)) {
+                kinds = 0;
+                for (auto c : *s) {
+                    if (c == 'r') {
+                        kinds |= sixfive::WatchRead;
+                    } else if (c == 'w') {
+                        kinds |= sixfive::WatchWrite;
+                    } else if (c == 'x') {
+                        kinds |= sixfive::WatchExec;
+                    } else {
+                        throw parse_error("Watch access must be 'r', 'w' "
+                                          "and/or 'x'");
+                    }
+                }
+            } else {
+                end = number<uint32_t>(v);
+            }
+        }
+        Check(end > start, "Empty watch range");
+        mach.addWatch(start, end, kinds);
+    });
+
+    assem.registerMeta("bench", [&](Meta const& meta) {
+        Assembler::Bench bench;
+        bench.start = mach.getPC();
+        bench.line = meta.line;
+        size_t runs = 1;
+        // Input values for each run, by register (0-2) or RAM address
+        std::vector<std::pair<int32_t, std::function<Number(size_t)>>> inputs;
+        for (auto const& v : meta.args) {
+            if (auto const* s = any_cast<std::string_view>(&v)) {
+                bench.name = *s;
+            } else if (auto const* n = any_cast<Number>(&v)) {
+                bench.start = static_cast<uint32_t>(*n);
+            } else if (auto const* p =
+                           std::any_cast<std::pair<std::string_view, std::any>>(
+                               &v)) {
+                if (p->first == "budget") {
+                    bench.budget = number<uint32_t>(p->second);
+                    continue;
+                }
+                if (p->first == "runs") {
+                    runs = number<size_t>(p->second);
+                    continue;
+                }
+                int32_t target = -1;
+                if (p->first == "A") {
+                    target = 0;
+                } else if (p->first == "X") {
+                    target = 1;
+                } else if (p->first == "Y") {
+                    target = 2;
+                } else if (auto sym = assem.getSymbols().get_sym(p->first)) {
+                    target = 0x10000 + number<uint16_t>(sym->value);
+                } else {
+                    // Labels may not be defined before the final pass
+                    if (assem.isFinalPass()) {
+                        throw parse_error(fmt::format(
+                            "Unknown bench argument '{}'", p->first));
+                    }
+                    continue;
+                }
+                // Constants, arrays indexed by run, or functions of the run
+                std::function<Number(size_t)> fn;
+                auto const& val = p->second;
+                if (auto const* n = any_cast<Number>(&val)) {
+                    fn = [n = *n](size_t) { return n; };
+                } else if (auto const* nv =
+                               any_cast<std::vector<Number>>(&val)) {
+                    Check(!nv->empty(), "Empty bench input");
+                    fn = [v = *nv](size_t i) { return v[i % v.size()]; };
+                } else if (auto const* bv = any_cast<Bytes>(&val)) {
+                    Check(!bv->empty(), "Empty bench input");
+                    fn = [v = *bv](size_t i) -> Number {
+                        return v[i % v.size()];
+                    };
+                } else if (auto const* macro =
+                               any_cast<Assembler::Macro>(&val)) {
+                    fn = [&assem, macro = *macro](size_t i) {
+                        Assembler::Call call;
+                        call.args.resize(macro.args.size());
+                        if (!call.args.empty()) {
+                            call.args[0] = any_num(i);
+                        }
+                        return number(assem.applyDefine(macro, call));
+                    };
+                } else {
+                    throw parse_error("Bench input must be a number, array or "
+                                      "function");
+                }
+                inputs.emplace_back(target, fn);
+            }
+        }
+        Check(!bench.name.empty(), "Bench needs a name");
+        Check(runs > 0, "Bench needs at least one run");
+        bench.runs.resize(runs);
+        for (size_t i = 0; i < runs; i++) {
+            for (auto const& [target, fn] : inputs) {
+                auto value = static_cast<uint8_t>(static_cast<int32_t>(fn(i)));
+                if (target < 0x10000) {
+                    bench.runs[i].regs[target] = value;
+                } else {
+                    bench.runs[i].ram[target - 0x10000] = value;
+                }
+            }
+        }
+        assem.addBench(bench);
+    });
+
     assem.registerMeta("macro", [&](Meta const& meta) {
         Check(!meta.blocks.empty(), "Expected block");
 
@@ -152,13 +279,14 @@ void initMeta(Assembler& assem)
         assem.defineMacro(macroName, macroArgs, meta.blocks[0]);
     });
 
-    assem.registerMeta(
-        "ascii", [&](Meta const&) { setTranslation(Translation::Ascii); });
+    assem.registerMeta("ascii", [&](Meta const&) {
+        translator.setTranslation(Translation::Ascii);
+    });
 
     assem.registerMeta("encoding", [&](Meta const& meta) {
         auto name = any_cast<std::string_view>(meta.args[0]);
 
-        setTranslation(name);
+        translator.setTranslation(name);
     });
 
     assem.registerMeta("chartrans", [&](Meta const& meta) {
@@ -175,7 +303,7 @@ void initMeta(Assembler& assem)
                 auto n = number<uint8_t>(v);
                 auto c = text[index++];
                 LOGD("%x %x", n, (uint16_t)c);
-                setTranslation(c, n);
+                translator.setTranslation(c, n);
             }
         }
     });
@@ -185,7 +313,7 @@ void initMeta(Assembler& assem)
             if (auto const* s = any_cast<std::string_view>(&v)) {
                 auto ws = utils::utf8_decode(*s);
                 for (auto c : ws) {
-                    auto b = translateChar(c);
+                    auto b = translator.translateChar(c);
                     mach.writeChar(b);
                 }
             } else {
@@ -205,7 +333,7 @@ void initMeta(Assembler& assem)
                     first = false;
                 }
                 for (auto c : ws) {
-                    auto b = translateChar(c);
+                    auto b = translator.translateChar(c);
                     mach.writeChar(b);
                 }
             }
@@ -219,7 +347,7 @@ void initMeta(Assembler& assem)
                     mach.writeChar(c);
                 }
             } else {
-                auto b = number<uint8_t>(v);
+                auto b = static_cast<uint8_t>(assem.dataValue(v, 1));
                 mach.writeByte(b);
             }
         }
@@ -236,7 +364,7 @@ void initMeta(Assembler& assem)
 
     assem.registerMeta("word", [&](Meta const& meta) {
         for (auto const& v : meta.args) {
-            auto w = number<int32_t>(v);
+            auto w = static_cast<int32_t>(assem.dataValue(v, 2));
             mach.writeByte(w & 0xff);
             mach.writeByte(w >> 8);
         }
@@ -254,10 +382,10 @@ void initMeta(Assembler& assem)
         }
     });
 
-    assem.registerMeta("if", [&](Meta const& meta) {
+    assem.registerMeta("if", [&, globalCond](Meta const& meta) {
         for (size_t i = 0; i < meta.blocks.size(); i++) {
             auto cond = i < meta.args.size() ? number(meta.args[i]) : 1.0;
-            globalCond = cond != 0;
+            *globalCond = cond != 0;
             if (cond != 0) {
                 assem.evaluateBlock(meta.blocks[i]);
                 break;
@@ -265,12 +393,12 @@ void initMeta(Assembler& assem)
         }
     });
 
-    assem.registerMeta("elseif", [&](Meta const& meta) {
-        if (globalCond) return;
+    assem.registerMeta("elseif", [&, globalCond](Meta const& meta) {
+        if (*globalCond) return;
 
         for (size_t i = 0; i < meta.blocks.size(); i++) {
             auto cond = i < meta.args.size() ? number(meta.args[i]) : 1.0;
-            globalCond = cond != 0;
+            *globalCond = cond != 0;
             if (cond != 0) {
                 assem.evaluateBlock(meta.blocks[i]);
                 break;
@@ -278,13 +406,13 @@ void initMeta(Assembler& assem)
         }
     });
 
-    assem.registerMeta("else", [&](Meta const& meta) {
-        if (globalCond) return;
+    assem.registerMeta("else", [&, globalCond](Meta const& meta) {
+        if (*globalCond) return;
 
         for (auto const& block : meta.blocks) {
             assem.evaluateBlock(block);
         }
-        globalCond = true;
+        *globalCond = true;
     });
 
     assem.registerMeta("org", [&](Meta const& meta) {
@@ -293,6 +421,14 @@ void initMeta(Assembler& assem)
         mach.setSection(section.name);
     });
 
+    assem.registerMeta("region", [&](Meta const& meta) {
+        if (meta.args.size() < 2) {
+            throw parse_error("Too few arguments");
+        }
+        mach.addRegion(number<int32_t>(meta.args[0]),
+                       number<int32_t>(meta.args[1]));
+    });
+
     assem.registerMeta("cpu", [&](Meta const& meta) {
         auto text = any_cast<std::string_view>(meta.args[0]);
         if (text == "6502") {
@@ -351,7 +487,7 @@ void initMeta(Assembler& assem)
         for (auto const& arg : meta.args) {
             printArg(arg);
         }
-        fmt::print("\n");
+        printOut("\n");
     });
 
     assem.registerMeta("section", [&](Meta const& meta) {
@@ -376,7 +512,8 @@ void initMeta(Assembler& assem)
                 mach.getSection(section.parent).pc +=
                     static_cast<int32_t>(section.data.size() - sz);
             }
-            syms.set("sections."s + std::string(section.name), section.data);
+            syms.set("sections."s + std::string(section.name),
+                     section.bytes());
             mach.popSection();
             return;
         }
@@ -391,7 +528,7 @@ void initMeta(Assembler& assem)
 
         // Create source lambda depending on first argument
         std::function<Number(size_t)> src;
-        if (auto* vec = any_cast<std::vector<uint8_t>>(&data)) {
+        if (auto* vec = any_cast<Bytes>(&data)) {
             size = vec->size();
             src = [v = *vec](size_t i) -> Number { return v[i]; };
         } else if (auto* nv = any_cast<std::vector<Number>>(&data)) {
@@ -407,8 +544,8 @@ void initMeta(Assembler& assem)
             LOGI("Fill string %s", *sv);
             auto utext = utils::utf8_decode(*sv);
             size = utext.size();
-            src = [utext](size_t i) -> Number {
-                return translateChar(utext[i]);
+            src = [utext, &translator](size_t i) -> Number {
+                return translator.translateChar(utext[i]);
             };
         } else {
             size = number<size_t>(data);
@@ -457,7 +594,7 @@ void initMeta(Assembler& assem)
     assem.registerMeta("include", [&](Meta const& meta) {
         Check(meta.args.size() == 1, "Incorrect number of arguments");
         auto name = any_cast<std::string_view>(meta.args[0]);
-        auto fileName = persist(assem.evaluatePath(name).string());
+        auto fileName = assem.intern(assem.evaluatePath(name).string());
         auto block = assem.includeFile(fileName);
         assem.evaluateBlock(block);
     });
@@ -481,8 +618,7 @@ void initMeta(Assembler& assem)
         if (p.is_relative()) {
             p = assem.getCurrentPath() / p;
         }
-        utils::File f{p.string()};
-        for (auto const& b : f.readAll()) {
+        for (auto const& b : assem.loadFile(p)) {
             mach.writeByte(b);
         }
     });
@@ -0,0 +1,128 @@
+#include "object_file.h"
+
+#include <coreutils/file.h>
+#include <fmt/format.h>
+
+static constexpr uint32_t ObjectMagic = 0xba550b1e;
+
+static void writeStr(utils::File const& f, std::string const& s)
+{
+    f.writeString(s);
+    f.write<uint8_t>(0);
+}
+
+void ObjectFile::write(std::string const& fileName) const
+{
+    utils::File f{fileName, utils::File::Mode::Write};
+    f.write<uint32_t>(ObjectMagic);
+
+    f.write<uint32_t>(sections.size());
+    for (auto const& s : sections) {
+        writeStr(f, s.name);
+        writeStr(f, s.parent);
+        f.write<int32_t>(s.start);
+        f.write<int32_t>(s.size);
+        f.write<uint32_t>(s.flags);
+        f.write<int32_t>(s.align);
+        f.write<uint32_t>(s.data.size());
+        f.write(s.data);
+    }
+
+    f.write<uint32_t>(symbols.size());
+    for (auto const& s : symbols) {
+        writeStr(f, s.name);
+        f.write<int32_t>(s.section);
+        f.write<double>(s.value);
+    }
+
+    f.write<uint32_t>(imports.size());
+    for (auto const& name : imports) {
+        writeStr(f, name);
+    }
+
+    f.write<uint32_t>(relocs.size());
+    for (auto const& r : relocs) {
+        f.write<uint32_t>(r.section);
+        f.write<uint32_t>(r.offset);
+        f.write<uint8_t>(static_cast<uint8_t>(r.kind));
+        f.write<int32_t>(r.target);
+        f.write<int32_t>(r.addend);
+    }
+}
+
+ObjectFile ObjectFile::read(std::string const& fileName)
+{
+    utils::File f{fileName};
+    if (f.read<uint32_t>() != ObjectMagic) {
+        throw link_error(fileName + " is not an object file");
+    }
+    ObjectFile obj;
+
+    obj.sections.resize(f.read<uint32_t>());
+    for (auto& s : obj.sections) {
+        s.name = f.readString();
+        s.parent = f.readString();
+        s.start = f.read<int32_t>();
+        s.size = f.read<int32_t>();
+        s.flags = f.read<uint32_t>();
+        s.align = f.read<int32_t>();
+        s.data.resize(f.read<uint32_t>());
+        if (f.read(s.data.data(), s.data.size()) != s.data.size()) {
+            throw link_error("Truncated object file " + fileName);
+        }
+    }
+
+    obj.symbols.resize(f.read<uint32_t>());
+    for (auto& s : obj.symbols) {
+        s.name = f.readString();
+        s.section = f.read<int32_t>();
+        s.value = f.read<double>();
+    }
+
+    obj.imports.resize(f.read<uint32_t>());
+    for (auto& name : obj.imports) {
+        name = f.readString();
+    }
+
+    obj.relocs.resize(f.read<uint32_t>());
+    for (auto& r : obj.relocs) {
+        r.section = f.read<uint32_t>();
+        r.offset = f.read<uint32_t>();
+        r.kind = static_cast<RelocKind>(f.read<uint8_t>());
+        r.target = f.read<int32_t>();
+        r.addend = f.read<int32_t>();
+    }
+    return obj;
+}
+
+void ObjectFile::check() const
+{
+    if (sections.size() > static_cast<size_t>(reloc::ImportBase)) {
+        throw link_error("Too many sections in object file");
+    }
+    for (auto const& s : symbols) {
+        if (s.section >= static_cast<int32_t>(sections.size())) {
+            throw link_error(
+                fmt::format("Symbol '{}' in unknown section", s.name));
+        }
+    }
+    for (auto const& r : relocs) {
+        if (r.section >= sections.size() || r.kind > RelocKind::Rel) {
+            throw link_error("Bad relocation in object file");
+        }
+        size_t size = r.kind == RelocKind::Word ? 2 : 1;
+        if (r.offset + size > sections[r.section].data.size()) {
+            throw link_error("Relocation outside section " +
+                             sections[r.section].name);
+        }
+        bool const known =
+            r.target < reloc::ImportBase
+                ? r.target >= 0 &&
+                      r.target < static_cast<int32_t>(sections.size())
+                : r.target - reloc::ImportBase <
+                      static_cast<int32_t>(imports.size());
+        if (!known) {
+            throw link_error("Relocation to unknown target in object file");
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "defines.h"
+#include "reloc.h"
+
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <vector>
+
+class link_error : public std::exception
+{
+public:
+    explicit link_error(std::string m = "Link error") : msg(std::move(m)) {}
+    const char* what() const noexcept override { return msg.c_str(); }
+
+private:
+    std::string msg;
+};
+
+// Relocatable output of one assembled source file
+struct ObjectFile
+{
+    struct Section
+    {
+        std::string name;
+        std::string parent;
+        int32_t start = -1; // Only set for sections with a fixed start
+        int32_t size = -1;  // Only set for sections with a fixed size
+        uint32_t flags = 0;
+        int32_t align = 0;
+        std::vector<uint8_t> data;
+    };
+
+    struct Symbol
+    {
+        std::string name;
+        int32_t section = -1; // -1 for absolute values
+        Number value = 0;
+    };
+
+    struct Reloc
+    {
+        uint32_t section = 0;
+        uint32_t offset = 0;
+        RelocKind kind = RelocKind::Word;
+        int32_t target = 0;
+        int32_t addend = 0;
+    };
+
+    std::vector<Section> sections;
+    std::vector<Symbol> symbols;
+    std::vector<std::string> imports;
+    std::vector<Reloc> relocs;
+
+    void write(std::string const& fileName) const;
+    static ObjectFile read(std::string const& fileName);
+    // Throw `link_error` unless all symbols and relocations refer to
+    // existing sections and imports
+    void check() const;
+};
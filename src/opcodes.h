@@ -0,0 +1,465 @@
+#pragma once
+
+#include "6502.h"
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+// Compile time opcode tables used by the assembler.
+//
+// Every mnemonic is packed into a 32 bit key and looked up through a
+// perfect hash that is found at compile time. Each mnemonic then has a
+// dense row of opcodes indexed by addressing mode, one table per CPU.
+// `opcodetest.cpp` checks these tables against the emulator.
+
+namespace sixfive::opcodes {
+
+enum Cpu : uint8_t
+{
+    C6502 = 1,
+    C65C02 = 2,
+    Both = 3
+};
+
+struct OpcodeDef
+{
+    const char* name;
+    Mode mode;
+    uint8_t code;
+    uint8_t cpus;
+};
+
+// clang-format off
+constexpr OpcodeDef opcodeDefs[] = {
+    {"nop", Mode::NONE, 0xea, Both},
+    {"lda", Mode::IMM, 0xa9, Both},
+    {"lda", Mode::ZP, 0xa5, Both},
+    {"lda", Mode::ZPX, 0xb5, Both},
+    {"lda", Mode::ABS, 0xad, Both},
+    {"lda", Mode::ABSX, 0xbd, Both},
+    {"lda", Mode::ABSY, 0xb9, Both},
+    {"lda", Mode::INDX, 0xa1, Both},
+    {"lda", Mode::INDY, 0xb1, Both},
+    {"ldx", Mode::IMM, 0xa2, Both},
+    {"ldx", Mode::ZP, 0xa6, Both},
+    {"ldx", Mode::ZPY, 0xb6, Both},
+    {"ldx", Mode::ABS, 0xae, Both},
+    {"ldx", Mode::ABSY, 0xbe, Both},
+    {"ldy", Mode::IMM, 0xa0, Both},
+    {"ldy", Mode::ZP, 0xa4, Both},
+    {"ldy", Mode::ZPX, 0xb4, Both},
+    {"ldy", Mode::ABS, 0xac, Both},
+    {"ldy", Mode::ABSX, 0xbc, Both},
+    {"sta", Mode::ZP, 0x85, Both},
+    {"sta", Mode::ZPX, 0x95, Both},
+    {"sta", Mode::ABS, 0x8d, Both},
+    {"sta", Mode::ABSX, 0x9d, Both},
+    {"sta", Mode::ABSY, 0x99, Both},
+    {"sta", Mode::INDX, 0x81, Both},
+    {"sta", Mode::INDY, 0x91, Both},
+    {"stx", Mode::ZP, 0x86, Both},
+    {"stx", Mode::ZPY, 0x96, Both},
+    {"stx", Mode::ABS, 0x8e, Both},
+    {"sty", Mode::ZP, 0x84, Both},
+    {"sty", Mode::ZPX, 0x94, Both},
+    {"sty", Mode::ABS, 0x8c, Both},
+    {"dec", Mode::ZP, 0xc6, Both},
+    {"dec", Mode::ZPX, 0xd6, Both},
+    {"dec", Mode::ABS, 0xce, Both},
+    {"dec", Mode::ABSX, 0xde, Both},
+    {"inc", Mode::ZP, 0xe6, Both},
+    {"inc", Mode::ZPX, 0xf6, Both},
+    {"inc", Mode::ABS, 0xee, Both},
+    {"inc", Mode::ABSX, 0xfe, Both},
+    {"tax", Mode::NONE, 0xaa, Both},
+    {"txa", Mode::NONE, 0x8a, Both},
+    {"tay", Mode::NONE, 0xa8, Both},
+    {"tya", Mode::NONE, 0x98, Both},
+    {"txs", Mode::NONE, 0x9a, Both},
+    {"tsx", Mode::NONE, 0xba, Both},
+    {"dex", Mode::NONE, 0xca, Both},
+    {"inx", Mode::NONE, 0xe8, Both},
+    {"dey", Mode::NONE, 0x88, Both},
+    {"iny", Mode::NONE, 0xc8, Both},
+    {"pha", Mode::NONE, 0x48, Both},
+    {"pla", Mode::NONE, 0x68, Both},
+    {"php", Mode::NONE, 0x08, Both},
+    {"plp", Mode::NONE, 0x28, Both},
+    {"bcc", Mode::REL, 0x90, Both},
+    {"bcs", Mode::REL, 0xb0, Both},
+    {"bne", Mode::REL, 0xd0, Both},
+    {"beq", Mode::REL, 0xf0, Both},
+    {"bpl", Mode::REL, 0x10, Both},
+    {"bmi", Mode::REL, 0x30, Both},
+    {"bvc", Mode::REL, 0x50, Both},
+    {"bvs", Mode::REL, 0x70, Both},
+    {"adc", Mode::IMM, 0x69, Both},
+    {"adc", Mode::ZP, 0x65, Both},
+    {"adc", Mode::ZPX, 0x75, Both},
+    {"adc", Mode::ABS, 0x6d, Both},
+    {"adc", Mode::ABSX, 0x7d, Both},
+    {"adc", Mode::ABSY, 0x79, Both},
+    {"adc", Mode::INDX, 0x61, Both},
+    {"adc", Mode::INDY, 0x71, Both},
+    {"adc", Mode::INDZ, 0x72, Both},
+    {"sbc", Mode::IMM, 0xe9, Both},
+    {"sbc", Mode::ZP, 0xe5, Both},
+    {"sbc", Mode::ZPX, 0xf5, Both},
+    {"sbc", Mode::ABS, 0xed, Both},
+    {"sbc", Mode::ABSX, 0xfd, Both},
+    {"sbc", Mode::ABSY, 0xf9, Both},
+    {"sbc", Mode::INDX, 0xe1, Both},
+    {"sbc", Mode::INDY, 0xf1, Both},
+    {"cmp", Mode::IMM, 0xc9, Both},
+    {"cmp", Mode::ZP, 0xc5, Both},
+    {"cmp", Mode::ZPX, 0xd5, Both},
+    {"cmp", Mode::ABS, 0xcd, Both},
+    {"cmp", Mode::ABSX, 0xdd, Both},
+    {"cmp", Mode::ABSY, 0xd9, Both},
+    {"cmp", Mode::INDX, 0xc1, Both},
+    {"cmp", Mode::INDY, 0xd1, Both},
+    {"cpx", Mode::IMM, 0xe0, Both},
+    {"cpx", Mode::ZP, 0xe4, Both},
+    {"cpx", Mode::ABS, 0xec, Both},
+    {"cpy", Mode::IMM, 0xc0, Both},
+    {"cpy", Mode::ZP, 0xc4, Both},
+    {"cpy", Mode::ABS, 0xcc, Both},
+    {"and", Mode::IMM, 0x29, Both},
+    {"and", Mode::ZP, 0x25, Both},
+    {"and", Mode::ZPX, 0x35, Both},
+    {"and", Mode::ABS, 0x2d, Both},
+    {"and", Mode::ABSX, 0x3d, Both},
+    {"and", Mode::ABSY, 0x39, Both},
+    {"and", Mode::INDX, 0x21, Both},
+    {"and", Mode::INDY, 0x31, Both},
+    {"eor", Mode::IMM, 0x49, Both},
+    {"eor", Mode::ZP, 0x45, Both},
+    {"eor", Mode::ZPX, 0x55, Both},
+    {"eor", Mode::ABS, 0x4d, Both},
+    {"eor", Mode::ABSX, 0x5d, Both},
+    {"eor", Mode::ABSY, 0x59, Both},
+    {"eor", Mode::INDX, 0x41, Both},
+    {"eor", Mode::INDY, 0x51, Both},
+    {"ora", Mode::IMM, 0x09, Both},
+    {"ora", Mode::ZP, 0x05, Both},
+    {"ora", Mode::ZPX, 0x15, Both},
+    {"ora", Mode::ABS, 0x0d, Both},
+    {"ora", Mode::ABSX, 0x1d, Both},
+    {"ora", Mode::ABSY, 0x19, Both},
+    {"ora", Mode::INDX, 0x01, Both},
+    {"ora", Mode::INDY, 0x11, Both},
+    {"sec", Mode::NONE, 0x38, Both},
+    {"clc", Mode::NONE, 0x18, Both},
+    {"sei", Mode::NONE, 0x78, Both},
+    {"cli", Mode::NONE, 0x58, Both},
+    {"sed", Mode::NONE, 0xf8, Both},
+    {"cld", Mode::NONE, 0xd8, Both},
+    {"clv", Mode::NONE, 0xb8, Both},
+    {"lsr", Mode::NONE, 0x4a, Both},
+    {"lsr", Mode::ACC, 0x4a, Both},
+    {"lsr", Mode::ZP, 0x46, Both},
+    {"lsr", Mode::ZPX, 0x56, Both},
+    {"lsr", Mode::ABS, 0x4e, Both},
+    {"lsr", Mode::ABSX, 0x5e, Both},
+    {"asl", Mode::NONE, 0x0a, Both},
+    {"asl", Mode::ACC, 0x0a, Both},
+    {"asl", Mode::ZP, 0x06, Both},
+    {"asl", Mode::ZPX, 0x16, Both},
+    {"asl", Mode::ABS, 0x0e, Both},
+    {"asl", Mode::ABSX, 0x1e, Both},
+    {"ror", Mode::NONE, 0x6a, Both},
+    {"ror", Mode::ACC, 0x6a, Both},
+    {"ror", Mode::ZP, 0x66, Both},
+    {"ror", Mode::ZPX, 0x76, Both},
+    {"ror", Mode::ABS, 0x6e, Both},
+    {"ror", Mode::ABSX, 0x7e, Both},
+    {"rol", Mode::NONE, 0x2a, Both},
+    {"rol", Mode::ACC, 0x2a, Both},
+    {"rol", Mode::ZP, 0x26, Both},
+    {"rol", Mode::ZPX, 0x36, Both},
+    {"rol", Mode::ABS, 0x2e, Both},
+    {"rol", Mode::ABSX, 0x3e, Both},
+    {"bit", Mode::ZP, 0x24, Both},
+    {"bit", Mode::ABS, 0x2c, Both},
+    {"rti", Mode::NONE, 0x40, Both},
+    {"brk", Mode::NONE, 0x00, Both},
+    {"brk", Mode::IMM, 0x00, Both},
+    {"rts", Mode::NONE, 0x60, Both},
+    {"jmp", Mode::ABS, 0x4c, Both},
+    {"jmp", Mode::IND, 0x6c, Both},
+    {"jsr", Mode::ABS, 0x20, Both},
+    {"adc", Mode::INDZ, 0x72, C65C02},
+    {"and", Mode::INDZ, 0x32, C65C02},
+    {"cmp", Mode::INDZ, 0xd2, C65C02},
+    {"eor", Mode::INDZ, 0x52, C65C02},
+    {"lda", Mode::INDZ, 0xb2, C65C02},
+    {"ora", Mode::INDZ, 0x12, C65C02},
+    {"sbc", Mode::INDZ, 0xf2, C65C02},
+    {"sta", Mode::INDZ, 0x92, C65C02},
+    {"phx", Mode::NONE, 0xda, C65C02},
+    {"phy", Mode::NONE, 0x5a, C65C02},
+    {"plx", Mode::NONE, 0xfa, C65C02},
+    {"ply", Mode::NONE, 0x7a, C65C02},
+    {"stz", Mode::ZP, 0x64, C65C02},
+    {"stz", Mode::ZPX, 0x74, C65C02},
+    {"stz", Mode::ABS, 0x9c, C65C02},
+    {"stz", Mode::ABSX, 0x9e, C65C02},
+    {"trb", Mode::ZP, 0x14, C65C02},
+    {"trb", Mode::ABS, 0x1c, C65C02},
+    {"tsb", Mode::ZP, 0x04, C65C02},
+    {"tsb", Mode::ABS, 0x0c, C65C02},
+    {"bra", Mode::REL, 0x80, C65C02},
+    {"bbr0", Mode::ZP_REL, 0x0f, C65C02},
+    {"bbr1", Mode::ZP_REL, 0x1f, C65C02},
+    {"bbr2", Mode::ZP_REL, 0x2f, C65C02},
+    {"bbr3", Mode::ZP_REL, 0x3f, C65C02},
+    {"bbr4", Mode::ZP_REL, 0x4f, C65C02},
+    {"bbr5", Mode::ZP_REL, 0x5f, C65C02},
+    {"bbr6", Mode::ZP_REL, 0x6f, C65C02},
+    {"bbr7", Mode::ZP_REL, 0x7f, C65C02},
+    {"bbs0", Mode::ZP_REL, 0x8f, C65C02},
+    {"bbs1", Mode::ZP_REL, 0x9f, C65C02},
+    {"bbs2", Mode::ZP_REL, 0xaf, C65C02},
+    {"bbs3", Mode::ZP_REL, 0xbf, C65C02},
+    {"bbs4", Mode::ZP_REL, 0xcf, C65C02},
+    {"bbs5", Mode::ZP_REL, 0xdf, C65C02},
+    {"bbs6", Mode::ZP_REL, 0xef, C65C02},
+    {"bbs7", Mode::ZP_REL, 0xff, C65C02},
+    {"rmb0", Mode::ZP, 0x07, C65C02},
+    {"rmb1", Mode::ZP, 0x17, C65C02},
+    {"rmb2", Mode::ZP, 0x27, C65C02},
+    {"rmb3", Mode::ZP, 0x37, C65C02},
+    {"rmb4", Mode::ZP, 0x47, C65C02},
+    {"rmb5", Mode::ZP, 0x57, C65C02},
+    {"rmb6", Mode::ZP, 0x67, C65C02},
+    {"rmb7", Mode::ZP, 0x77, C65C02},
+    {"smb0", Mode::ZP, 0x87, C65C02},
+    {"smb1", Mode::ZP, 0x97, C65C02},
+    {"smb2", Mode::ZP, 0xa7, C65C02},
+    {"smb3", Mode::ZP, 0xb7, C65C02},
+    {"smb4", Mode::ZP, 0xc7, C65C02},
+    {"smb5", Mode::ZP, 0xd7, C65C02},
+    {"smb6", Mode::ZP, 0xe7, C65C02},
+    {"smb7", Mode::ZP, 0xf7, C65C02},
+    {"lax", Mode::ZP, 0xa7, C6502},
+    {"lax", Mode::ZPY, 0xb7, C6502},
+    {"lax", Mode::ABS, 0xaf, C6502},
+    {"lax", Mode::ABSY, 0xbf, C6502},
+    {"lax", Mode::INDX, 0xa3, C6502},
+    {"lax", Mode::INDY, 0xb3, C6502},
+    {"lax", Mode::IMM, 0xab, C6502},
+    {"sax", Mode::ZP, 0x87, C6502},
+    {"sax", Mode::ZPY, 0x97, C6502},
+    {"sax", Mode::ABS, 0x8f, C6502},
+    {"sax", Mode::INDX, 0x83, C6502},
+    {"lxa", Mode::IMM, 0xab, C6502},
+    {"nop", Mode::IMM, 0xe2, C6502},
+    {"nop", Mode::ZP, 0x04, C6502},
+    {"nop", Mode::ABS, 0x0c, C6502},
+};
+// clang-format on
+
+constexpr size_t ModeCount = static_cast<size_t>(Mode::ZP_REL) + 1;
+constexpr int HashBits = 10;
+constexpr size_t HashSize = 1 << HashBits;
+constexpr uint8_t NoMnemonic = 0xff;
+
+// Pack up to 4 characters into a key, converting to lower case.
+// Returns 0 for names that can not be mnemonics.
+constexpr uint32_t makeKey(std::string_view name)
+{
+    if (name.empty() || name.size() > 4) {
+        return 0;
+    }
+    uint32_t key = 0;
+    for (size_t i = 0; i < name.size(); i++) {
+        auto c = static_cast<uint8_t>(name[i]);
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        key |= static_cast<uint32_t>(c) << (i * 8);
+    }
+    return key;
+}
+
+constexpr size_t countMnemonics()
+{
+    size_t count = 0;
+    for (size_t i = 0; i < std::size(opcodeDefs); i++) {
+        bool seen = false;
+        for (size_t j = 0; j < i; j++) {
+            seen = seen || makeKey(opcodeDefs[j].name) ==
+                               makeKey(opcodeDefs[i].name);
+        }
+        count += seen ? 0 : 1;
+    }
+    return count;
+}
+
+constexpr size_t MnemonicCount = countMnemonics();
+static_assert(MnemonicCount < NoMnemonic);
+
+// Unique mnemonic names, in table order
+constexpr auto mnemonics = [] {
+    std::array<std::string_view, MnemonicCount> names{};
+    size_t n = 0;
+    for (auto const& def : opcodeDefs) {
+        bool seen = false;
+        for (size_t i = 0; i < n; i++) {
+            seen = seen || names[i] == def.name;
+        }
+        if (!seen) {
+            names[n++] = def.name;
+        }
+    }
+    return names;
+}();
+
+constexpr auto mnemonicKeys = [] {
+    std::array<uint32_t, MnemonicCount> keys{};
+    for (size_t i = 0; i < MnemonicCount; i++) {
+        keys[i] = makeKey(mnemonics[i]);
+    }
+    return keys;
+}();
+
+constexpr uint32_t hashKey(uint32_t key, uint32_t mul)
+{
+    return (key * mul) >> (32 - HashBits);
+}
+
+constexpr bool isPerfect(uint32_t mul)
+{
+    std::array<bool, HashSize> used{};
+    for (auto key : mnemonicKeys) {
+        auto h = hashKey(key, mul);
+        if (used[h]) {
+            return false;
+        }
+        used[h] = true;
+    }
+    return true;
+}
+
+// Search odd multipliers until one maps all mnemonics to unique slots
+constexpr uint32_t hashMul = [] {
+    uint32_t mul = 0x9e3779b1;
+    while (!isPerfect(mul)) {
+        mul += 2;
+    }
+    return mul;
+}();
+
+constexpr auto hashTable = [] {
+    std::array<uint8_t, HashSize> table{};
+    for (auto& t : table) {
+        t = NoMnemonic;
+    }
+    for (size_t i = 0; i < MnemonicCount; i++) {
+        table[hashKey(mnemonicKeys[i], hashMul)] = static_cast<uint8_t>(i);
+    }
+    return table;
+}();
+
+// Opcode for each [mnemonic][mode], or -1 if the combination is illegal
+using OpcodeMatrix = std::array<std::array<int16_t, ModeCount>, MnemonicCount>;
+
+constexpr OpcodeMatrix makeMatrix(Cpu cpu)
+{
+    OpcodeMatrix matrix{};
+    for (auto& row : matrix) {
+        for (auto& code : row) {
+            code = -1;
+        }
+    }
+    for (auto const& def : opcodeDefs) {
+        if ((def.cpus & cpu) == 0) continue;
+        size_t m = 0;
+        while (mnemonics[m] != def.name) {
+            m++;
+        }
+        auto& code = matrix[m][static_cast<size_t>(def.mode)];
+        if (code < 0) {
+            code = def.code;
+        }
+    }
+    return matrix;
+}
+
+constexpr OpcodeMatrix matrix6502 = makeMatrix(C6502);
+constexpr OpcodeMatrix matrix65C02 = makeMatrix(C65C02);
+
+// Return index of mnemonic, or -1 if not found
+constexpr int findMnemonic(uint32_t key)
+{
+    auto i = hashTable[hashKey(key, hashMul)];
+    return i != NoMnemonic && mnemonicKeys[i] == key ? i : -1;
+}
+
+constexpr int findMnemonic(std::string_view name)
+{
+    auto key = makeKey(name);
+    return key == 0 ? -1 : findMnemonic(key);
+}
+
+// The zero page (or 65C02 zero page indirect) version of a mode
+constexpr Mode shortMode(Mode mode)
+{
+    switch (mode) {
+    case Mode::ABS:
+        return Mode::ZP;
+    case Mode::ABSX:
+        return Mode::ZPX;
+    case Mode::ABSY:
+        return Mode::ZPY;
+    case Mode::IND:
+        return Mode::INDZ;
+    default:
+        return Mode::NONE;
+    }
+}
+
+struct Encoding
+{
+    int16_t code = -1;
+    Mode mode = Mode::NONE;
+};
+
+// Select opcode for a mnemonic and addressing mode. Prefer the zero page
+// version if the value fits, and allow branches to take absolute
+// addresses.
+constexpr Encoding encode(OpcodeMatrix const& matrix, int mnemonic, Mode mode,
+                          int32_t val)
+{
+    auto const& row = matrix[mnemonic];
+    auto mode_code = [&](Mode m) { return row[static_cast<size_t>(m)]; };
+
+    auto sm = shortMode(mode);
+    if (sm != Mode::NONE && val >= 0 && val <= 0xff && mode_code(sm) >= 0) {
+        return {mode_code(sm), sm};
+    }
+    if (mode_code(mode) >= 0) {
+        return {mode_code(mode), mode};
+    }
+    if (mode == Mode::ABS && mode_code(Mode::REL) >= 0) {
+        return {mode_code(Mode::REL), Mode::REL};
+    }
+    return {};
+}
+
+static_assert(findMnemonic("lda") >= 0);
+static_assert(findMnemonic("LDA") == findMnemonic("lda"));
+static_assert(findMnemonic("xyz") < 0);
+static_assert(encode(matrix6502, findMnemonic("lda"), Mode::ABS, 0x10).code ==
+              0xa5);
+static_assert(encode(matrix6502, findMnemonic("lda"), Mode::ABS, 0x1000)
+                  .code == 0xad);
+static_assert(encode(matrix6502, findMnemonic("bne"), Mode::ABS, 0x1000)
+                  .code == 0xd0);
+static_assert(encode(matrix65C02, findMnemonic("stz"), Mode::ABS, 0x10)
+                  .code == 0x64);
+static_assert(encode(matrix6502, findMnemonic("stz"), Mode::ABS, 0x10).code ==
+              -1);
+
+} // namespace sixfive::opcodes
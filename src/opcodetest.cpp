@@ -0,0 +1,540 @@
+#include "catch.hpp"
+
+#include "emulator.h"
+#include "opcodes.h"
+
+#include <chrono>
+#include <fmt/format.h>
+#include <random>
+#include <set>
+#include <unordered_map>
+
+using sixfive::Mode;
+namespace op = sixfive::opcodes;
+
+using Emulator = sixfive::Machine<>;
+
+template <int CORE, int ACCESS = sixfive::Callback,
+          int TIMING = sixfive::FixedCycles>
+struct TestPolicy : public sixfive::DefaultPolicy
+{
+    TestPolicy() = default;
+    explicit TestPolicy(sixfive::Machine<TestPolicy>&) {}
+    static constexpr int Core = CORE;
+    static constexpr int Read_AccessMode = ACCESS;
+    static constexpr int Write_AccessMode = ACCESS;
+    static constexpr int Timing = TIMING;
+};
+
+using SwitchEmulator = sixfive::Machine<TestPolicy<sixfive::Switch>>;
+using BlockEmulator = sixfive::Machine<TestPolicy<sixfive::Blocks>>;
+
+static op::OpcodeMatrix const& matrixFor(bool cpu65c02)
+{
+    return cpu65c02 ? op::matrix65C02 : op::matrix6502;
+}
+
+// Opcode selection as done by the original linear search
+static op::Encoding referenceEncode(Emulator::Instruction const& ins,
+                                    Mode mode, int32_t val)
+{
+    static const std::unordered_map<Mode, Mode> conv{{Mode::INDZ, Mode::IND},
+                                                     {Mode::ZPX, Mode::ABSX},
+                                                     {Mode::ZPY, Mode::ABSY},
+                                                     {Mode::ZP, Mode::ABS}};
+    for (auto const& o : ins.opcodes) {
+        bool match = o.mode == mode;
+        if (!match && val >= 0 && val <= 0xff) {
+            auto it = conv.find(o.mode);
+            match = it != conv.end() && it->second == mode;
+        }
+        if (!match) {
+            match = mode == Mode::ABS && o.mode == Mode::REL;
+        }
+        if (match) {
+            return {o.code, o.mode};
+        }
+    }
+    return {};
+}
+
+TEST_CASE("opcodes.tables", "[opcodes]")
+{
+    for (bool cpu65c02 : {false, true}) {
+        auto const& matrix = matrixFor(cpu65c02);
+        auto const& instructions = Emulator::getInstructions(cpu65c02);
+        // Opcodes may be listed more than once (65C02 'adc (zp)'), but
+        // always with the same code
+        std::set<std::pair<int, Mode>> emuOpcodes;
+        for (auto const& ins : instructions) {
+            auto m = op::findMnemonic(ins.name);
+            REQUIRE(m >= 0);
+            REQUIRE(op::mnemonics[m] == ins.name);
+            for (auto const& o : ins.opcodes) {
+                auto code = matrix[m][static_cast<size_t>(o.mode)];
+                REQUIRE(code == o.code);
+                emuOpcodes.emplace(m, o.mode);
+            }
+        }
+        size_t tableCount = 0;
+        for (auto const& row : matrix) {
+            for (auto code : row) {
+                tableCount += code >= 0 ? 1 : 0;
+            }
+        }
+        REQUIRE(tableCount == emuOpcodes.size());
+    }
+}
+
+TEST_CASE("opcodes.encode", "[opcodes]")
+{
+    std::array<int32_t, 6> values{-1, 0, 0x10, 0xff, 0x100, 0x1234};
+    for (bool cpu65c02 : {false, true}) {
+        auto const& matrix = matrixFor(cpu65c02);
+        for (auto const& ins : Emulator::getInstructions(cpu65c02)) {
+            auto m = op::findMnemonic(ins.name);
+            for (size_t mode = 0; mode < op::ModeCount; mode++) {
+                for (auto val : values) {
+                    auto expected =
+                        referenceEncode(ins, static_cast<Mode>(mode), val);
+                    auto enc =
+                        op::encode(matrix, m, static_cast<Mode>(mode), val);
+                    INFO(ins.name << " mode " << mode << " val " << val);
+                    REQUIRE(enc.code == expected.code);
+                    if (enc.code >= 0) {
+                        REQUIRE(enc.mode == expected.mode);
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("opcodes.lookup", "[opcodes]")
+{
+    REQUIRE(op::findMnemonic("JSR") == op::findMnemonic("jsr"));
+    REQUIRE(op::findMnemonic("bbr7") >= 0);
+    REQUIRE(op::findMnemonic("ldaa") < 0);
+    REQUIRE(op::findMnemonic("") < 0);
+    REQUIRE(op::findMnemonic("lda_x") < 0);
+}
+
+// Set up both emulators identically, run one instruction and then `php`,
+// so all flags end up in memory
+template <typename EMU>
+static std::vector<uint8_t> runOne(EMU& emu, bool cpu65c02, uint8_t code,
+                                   bool dec, uint32_t seed)
+{
+    using sixfive::Reg;
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> ram(0x10000);
+    for (auto& b : ram) {
+        b = rng() & 0xff;
+    }
+    emu.set_cpu(cpu65c02);
+    emu.write_ram(0, ram.data(), ram.size());
+    emu.reset_regs();
+    emu.template set<Reg::A>(rng() & 0xff);
+    emu.template set<Reg::X>(rng() & 0xff);
+    emu.template set<Reg::Y>(rng() & 0xff);
+    emu.template set<Reg::SP>(0x80 + (rng() & 0x7f));
+    emu.write_ram(0x1000, dec ? 0xf8 : 0x38); // sed / sec
+    emu.write_ram(0x1001, code);
+    emu.setPC(0x1000);
+    emu.run(1);
+    emu.run(1);
+    auto cycles = emu.run_cycles();
+    emu.write_ram(emu.regPC(), 0x08); // php
+    emu.run(1);
+
+    auto [a, x, y, sr, sp, pc] = emu.regs();
+    std::vector<uint8_t> state(0x10000);
+    emu.read_ram(0, state.data(), state.size());
+    for (unsigned v : {a, x, y, sr, static_cast<unsigned>(sp), pc, cycles}) {
+        state.push_back(v & 0xff);
+        state.push_back(v >> 8);
+    }
+    return state;
+}
+
+TEST_CASE("emulator.cores", "[emulator]")
+{
+    for (bool cpu65c02 : {false, true}) {
+        std::set<uint8_t> codes;
+        for (auto const& ins : Emulator::getInstructions(cpu65c02)) {
+            for (auto const& o : ins.opcodes) {
+                codes.insert(o.code);
+            }
+        }
+        Emulator table;
+        SwitchEmulator inlined;
+        BlockEmulator blocks;
+        for (auto code : codes) {
+            for (bool dec : {false, true}) {
+                for (uint32_t seed = 0; seed < 4; seed++) {
+                    INFO("cpu " << cpu65c02 << " opcode " << int(code)
+                                << " decimal " << dec << " seed " << seed);
+                    auto state = runOne(table, cpu65c02, code, dec, seed);
+                    REQUIRE(runOne(inlined, cpu65c02, code, dec, seed) ==
+                            state);
+                    REQUIRE(runOne(blocks, cpu65c02, code, dec, seed) ==
+                            state);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("emulator.blocks", "[emulator]")
+{
+    // A loop that patches its own immediate operand, and a decimal mode
+    // switch in the middle of straight code
+    std::vector<uint8_t> code{
+        0xa0, 0x00,       // ldy #0
+        0xa9, 0x00,       // lda #0   ; operand is patched
+        0x99, 0x00, 0x20, // sta $2000,y
+        0xee, 0x03, 0x10, // inc $1003
+        0xc8,             // iny
+        0xd0, 0xf5,       // bne $1002
+        0xf8,             // sed
+        0x18,             // clc
+        0xa9, 0x19,       // lda #$19
+        0x69, 0x01,       // adc #1
+        0xd8,             // cld
+        0x8d, 0x00, 0x21, // sta $2100
+        0x60              // rts
+    };
+    auto runWith = [&](auto& emu) {
+        emu.write_ram(0x1000, code.data(), code.size());
+        emu.setPC(0x1000);
+        emu.run();
+        std::vector<uint8_t> ram(0x101);
+        emu.read_ram(0x2000, ram.data(), ram.size());
+        return std::make_tuple(ram, emu.regs(), emu.run_cycles());
+    };
+    Emulator table;
+    BlockEmulator blocks;
+    auto result = runWith(table);
+    REQUIRE(std::get<0>(result)[0xff] == 0xff);
+    REQUIRE(std::get<0>(result)[0x100] == 0x20);
+    REQUIRE(runWith(blocks) == result);
+    // Blocks decoded by the first run must not survive a rewrite
+    code[3] = 0x80;
+    code[16] = 0x29;
+    auto changed = runWith(table);
+    REQUIRE(changed != result);
+    REQUIRE(runWith(blocks) == changed);
+}
+
+// When an event was scheduled and when it ran
+struct Fired
+{
+    uint64_t at = 0;
+    uint64_t when = 0;
+};
+
+template <typename EMU>
+static void irqEvent(EMU& m, void* data)
+{
+    static_cast<Fired*>(data)->when = m.elapsed();
+    REQUIRE(m.irq());
+}
+
+template <typename EMU>
+static void vectorIrqEvent(EMU& m, void* data)
+{
+    static_cast<Fired*>(data)->when = m.elapsed();
+    REQUIRE(m.irq(0xfffc));
+}
+
+template <typename EMU>
+static void nmiEvent(EMU& m, void* data)
+{
+    static_cast<Fired*>(data)->when = m.elapsed();
+    REQUIRE(!m.irq());
+    m.clear_irq();
+    m.nmi();
+}
+
+// Count in X until an interrupt handler stores X and exits. Returns how
+// many cycles late the event ran.
+template <typename EMU>
+static uint64_t runEvent(EMU& emu, uint8_t iflag, uint16_t vector,
+                         typename EMU::EventFn event)
+{
+    std::vector<uint8_t> code{
+        iflag,           // cli / sei
+        0xe8,            // inx
+        0x4c, 0x01, 0x10 // jmp $1001
+    };
+    std::vector<uint8_t> handler{
+        0x8e, 0x00, 0x30, // stx $3000
+        0xa2, 0xff,       // ldx #$ff
+        0x9a,             // txs
+        0x60              // rts
+    };
+    emu.write_ram(0x1000, code.data(), code.size());
+    emu.write_ram(0x2000, handler.data(), handler.size());
+    emu.write_ram(vector, 0x00);
+    emu.write_ram(vector + 1, 0x20);
+    emu.setPC(0x1000);
+    Fired fired;
+    fired.at = emu.elapsed() + 1000;
+    emu.schedule(fired.at, event, &fired);
+    // Run in slices shorter than the time to the event
+    int slices = 0;
+    while (emu.run(100) == 0) {
+        REQUIRE(++slices < 100);
+    }
+    REQUIRE(fired.when >= fired.at);
+    REQUIRE(fired.when < fired.at + 7);
+    REQUIRE(emu.read_ram(0x3000) != 0);
+    return fired.when - fired.at;
+}
+
+TEST_CASE("emulator.events", "[emulator]")
+{
+    Emulator table;
+    SwitchEmulator inlined;
+    BlockEmulator blocks;
+    auto late = runEvent(table, 0x58, 0xfffe, irqEvent<Emulator>);
+    REQUIRE(runEvent(inlined, 0x58, 0xfffe, irqEvent<SwitchEmulator>) ==
+            late);
+    REQUIRE(runEvent(blocks, 0x58, 0xfffe, irqEvent<BlockEmulator>) == late);
+    // Scheduling relative to `elapsed()` works for later runs too
+    runEvent(table, 0x58, 0xfffe, irqEvent<Emulator>);
+    runEvent(table, 0x78, 0xfffa, nmiEvent<Emulator>);
+    runEvent(table, 0x58, 0xfffc, vectorIrqEvent<Emulator>);
+}
+
+template <typename EMU>
+static void heldIrqEvent(EMU& m, void*)
+{
+    REQUIRE(!m.irq());
+}
+
+template <typename EMU>
+static void clearedIrqEvent(EMU& m, void*)
+{
+    REQUIRE(!m.irq());
+    m.clear_irq();
+}
+
+// Count in X with interrupts off, then turn them on and exit. Returns the
+// X stored by the interrupt handler, or 0 if it did not run.
+template <typename EMU>
+static uint8_t runHeldIrq(EMU& emu, typename EMU::EventFn event)
+{
+    std::vector<uint8_t> code{
+        0x78,             // sei
+        0xe8,             // inx
+        0xe0, 0xf0,       // cpx #$f0
+        0xd0, 0xfb,       // bne $1001
+        0x58,             // cli
+        0xa2, 0xff,       // ldx #$ff
+        0x9a,             // txs
+        0x60              // rts
+    };
+    std::vector<uint8_t> handler{
+        0x8e, 0x00, 0x30, // stx $3000
+        0xa2, 0xff,       // ldx #$ff
+        0x9a,             // txs
+        0x60              // rts
+    };
+    emu.write_ram(0x1000, code.data(), code.size());
+    emu.write_ram(0x2000, handler.data(), handler.size());
+    emu.write_ram(0x3000, 0);
+    emu.write_ram(0xfffe, 0x00);
+    emu.write_ram(0xffff, 0x20);
+    emu.reset_regs();
+    emu.setPC(0x1000);
+    emu.schedule(emu.elapsed() + 100, event, nullptr);
+    int slices = 0;
+    while (emu.run(100) == 0) {
+        REQUIRE(++slices < 100);
+    }
+    return emu.read_ram(0x3000);
+}
+
+TEST_CASE("emulator.held_irq", "[emulator]")
+{
+    // An interrupt raised while the I flag is set is taken by the `cli`
+    // that clears it, unless it was cleared first
+    Emulator table;
+    SwitchEmulator inlined;
+    BlockEmulator blocks;
+    REQUIRE(runHeldIrq(table, heldIrqEvent<Emulator>) == 0xf0);
+    REQUIRE(runHeldIrq(inlined, heldIrqEvent<SwitchEmulator>) == 0xf0);
+    REQUIRE(runHeldIrq(blocks, heldIrqEvent<BlockEmulator>) == 0xf0);
+    REQUIRE(runHeldIrq(table, clearedIrqEvent<Emulator>) == 0);
+    REQUIRE(runHeldIrq(blocks, clearedIrqEvent<BlockEmulator>) == 0);
+}
+
+struct CycleTest
+{
+    const char* name;
+    bool cpu65c02;
+    bool dec;
+    uint16_t org;
+    std::vector<uint8_t> code;
+    unsigned fixed; // Cycles with `FixedCycles`
+    unsigned exact; // Cycles with `ExactCycles`
+};
+
+// X and Y are 1, ($10) points to $20ff and the Z flag is set
+static const std::vector<CycleTest> cycleTests{
+    {"lda abs,x", false, false, 0x1000, {0xbd, 0x00, 0x20}, 4, 4},
+    {"lda abs,x crossing", false, false, 0x1000, {0xbd, 0xff, 0x20}, 4, 5},
+    {"lda abs,y crossing", false, false, 0x1000, {0xb9, 0xff, 0x20}, 4, 5},
+    {"lax abs,y crossing", false, false, 0x1000, {0xbf, 0xff, 0x20}, 4, 5},
+    {"cmp abs,x crossing", true, false, 0x1000, {0xdd, 0xff, 0x20}, 4, 5},
+    {"sta abs,x crossing", false, false, 0x1000, {0x9d, 0xff, 0x20}, 5, 5},
+    {"inc abs,x crossing", false, false, 0x1000, {0xfe, 0xff, 0x20}, 7, 7},
+    {"lda (zp),y crossing", false, false, 0x1000, {0xb1, 0x10}, 5, 6},
+    {"sta (zp),y crossing", false, false, 0x1000, {0x91, 0x10}, 6, 6},
+    {"beq taken", false, false, 0x1000, {0xf0, 0x02}, 3, 3},
+    {"beq taken crossing", false, false, 0x10f0, {0xf0, 0x10}, 3, 4},
+    {"beq back crossing", false, false, 0x1000, {0xf0, 0xf0}, 3, 4},
+    {"bne not taken", false, false, 0x10f0, {0xd0, 0x10}, 2, 2},
+    {"bra crossing", true, false, 0x10f0, {0x80, 0x10}, 3, 4},
+    {"adc #", true, false, 0x1000, {0x69, 0x01}, 2, 2},
+    {"adc # decimal", false, true, 0x1000, {0x69, 0x01}, 2, 2},
+    {"adc # decimal 65c02", true, true, 0x1000, {0x69, 0x01}, 2, 3},
+    {"sbc abs decimal 65c02", true, true, 0x1000, {0xed, 0x00, 0x20}, 4, 5},
+    {"sbc abs,y both 65c02", true, true, 0x1000, {0xf9, 0xff, 0x20}, 4, 6},
+};
+
+template <typename EMU>
+static unsigned runCycles(CycleTest const& test)
+{
+    using sixfive::Reg;
+    auto emu = std::make_unique<EMU>();
+    emu->set_cpu(test.cpu65c02);
+    emu->write_ram(0x10, 0xff);
+    emu->write_ram(0x11, 0x20);
+    emu->write_ram(test.org - 1, test.dec ? 0xf8 : 0xea); // sed / nop
+    emu->write_ram(test.org, test.code.data(), test.code.size());
+    emu->template set<Reg::X>(1);
+    emu->template set<Reg::Y>(1);
+    emu->setPC(test.org - 1);
+    emu->run(1);
+    emu->run(1);
+    return emu->run_cycles();
+}
+
+TEST_CASE("emulator.timing", "[emulator]")
+{
+    using sixfive::Blocks;
+    using sixfive::Callback;
+    using sixfive::ExactCycles;
+    using sixfive::JumpTable;
+    using sixfive::Machine;
+    using sixfive::Switch;
+    for (auto const& test : cycleTests) {
+        INFO(test.name);
+        REQUIRE(runCycles<Emulator>(test) == test.fixed);
+        REQUIRE(runCycles<Machine<TestPolicy<JumpTable, Callback,
+                                             ExactCycles>>>(test) ==
+                test.exact);
+        REQUIRE(
+            runCycles<Machine<TestPolicy<Switch, Callback, ExactCycles>>>(
+                test) == test.exact);
+        REQUIRE(
+            runCycles<Machine<TestPolicy<Blocks, Callback, ExactCycles>>>(
+                test) == test.exact);
+    }
+}
+
+template <typename EMU>
+static double emulatedMHz(uint32_t cycles)
+{
+    // Add one to a page of memory, over and over
+    std::vector<uint8_t> code{
+        0xa2, 0x00,       // ldx #0
+        0xbd, 0x00, 0x20, // lda $2000,x
+        0x18,             // clc
+        0x69, 0x01,       // adc #1
+        0x9d, 0x00, 0x20, // sta $2000,x
+        0xe8,             // inx
+        0xd0, 0xf4,       // bne $1002
+        0x4c, 0x00, 0x10  // jmp $1000
+    };
+    auto emu = std::make_unique<EMU>();
+    emu->write_ram(0x1000, code.data(), code.size());
+    emu->setPC(0x1000);
+    auto start = std::chrono::steady_clock::now();
+    emu->run(cycles);
+    std::chrono::duration<double, std::micro> us =
+        std::chrono::steady_clock::now() - start;
+    return emu->run_cycles() / us.count();
+}
+
+TEST_CASE("emulator.mapped", "[emulator]")
+{
+    // Mapped access must only call the callbacks for mapped banks, and
+    // otherwise behave as when every access goes through a callback
+    std::vector<uint8_t> code{
+        0xad, 0x00, 0xd0, // lda $d000
+        0x8d, 0x00, 0x20, // sta $2000
+        0xee, 0x00, 0x20, // inc $2000
+        0xad, 0x00, 0x20, // lda $2000
+        0x8d, 0x01, 0xd0, // sta $d001
+        0x60              // rts
+    };
+    auto runWith = [&](auto& emu) {
+        std::vector<unsigned> io;
+        auto write = [](uint16_t adr, uint8_t v, void* data) {
+            static_cast<std::vector<unsigned>*>(data)->push_back(adr << 8 | v);
+        };
+        auto read = [](uint16_t adr, void* data) -> uint8_t {
+            static_cast<std::vector<unsigned>*>(data)->push_back(adr);
+            return 0x41;
+        };
+        emu.map_write_callback(0xd0, 1, &io, write);
+        emu.map_read_callback(0xd0, 1, &io, read);
+        emu.write_ram(0x1000, code.data(), code.size());
+        emu.setPC(0x1000);
+        emu.run();
+        REQUIRE(emu.read_ram(0x2000) == 0x42);
+        REQUIRE(emu.read_ram(0xd001) == 0);
+        return io;
+    };
+    sixfive::Machine<TestPolicy<sixfive::JumpTable>> callbacks;
+    Emulator mapped;
+    auto io = runWith(mapped);
+    REQUIRE(io == std::vector<unsigned>{0xd000, 0xd00142});
+    REQUIRE(runWith(callbacks) == io);
+}
+
+TEST_CASE("emulator.benchmark", "[.][benchmark]")
+{
+    using sixfive::Banked;
+    using sixfive::Blocks;
+    using sixfive::Callback;
+    using sixfive::JumpTable;
+    using sixfive::Machine;
+    using sixfive::Mapped;
+    using sixfive::Switch;
+    uint32_t cycles = 200'000'000;
+    for (int i = 0; i < 3; i++) {
+        fmt::print(
+            "Jump table, callbacks: {:.1f} MHz\n",
+            emulatedMHz<Machine<TestPolicy<JumpTable, Callback>>>(cycles));
+        fmt::print("Switch, callbacks:     {:.1f} MHz\n",
+                   emulatedMHz<Machine<TestPolicy<Switch, Callback>>>(cycles));
+        fmt::print(
+            "Jump table, mapped:    {:.1f} MHz\n",
+            emulatedMHz<Machine<TestPolicy<JumpTable, Mapped>>>(cycles));
+        fmt::print("Switch, mapped:        {:.1f} MHz\n",
+                   emulatedMHz<Machine<TestPolicy<Switch, Mapped>>>(cycles));
+        fmt::print("Blocks, mapped:        {:.1f} MHz\n",
+                   emulatedMHz<Machine<TestPolicy<Blocks, Mapped>>>(cycles));
+        fmt::print(
+            "Jump table, banked:    {:.1f} MHz\n",
+            emulatedMHz<Machine<TestPolicy<JumpTable, Banked>>>(cycles));
+        fmt::print("Switch, banked:        {:.1f} MHz\n",
+                   emulatedMHz<Machine<TestPolicy<Switch, Banked>>>(cycles));
+        fmt::print("Blocks, banked:        {:.1f} MHz\n",
+                   emulatedMHz<Machine<TestPolicy<Blocks, Banked>>>(cycles));
+    }
+}
@@ -5,13 +5,16 @@
 
 #include <coreutils/log.h>
 #include <cstdio>
+#include <functional>
 #include <string>
+#include <thread>
 
 using namespace std::string_literals;
 
 struct BassNode
 {
     std::vector<std::any> v;
+    std::any cache;
     std::string_view source;
     std::string_view file_name;
     ActionFn* action{};
@@ -49,6 +52,16 @@ std::string_view SemanticValues::name() const
     return ast->name;
 }
 
+std::string_view SemanticValues::file_name() const
+{
+    return ast->file_name;
+}
+
+std::any& SemanticValues::cache() const
+{
+    return ast->cache;
+}
+
 Parser::Parser(const char* s) : p(std::make_unique<peg::parser>(s))
 {
     if (useCache) {
@@ -182,13 +195,16 @@ AstNode Parser::parse(std::string_view source, std::string_view file)
     currentSource = source;
     currentFile = file;
 
+    // Rule indexes are stored in cached ASTs, so the list must be
+    // the same for every parse
+    ruleNames.clear();
     p->get_rule_names(ruleNames);
 
     try {
         AstNode ast = nullptr;
         bool rc = false;
         if (useCache && fs::exists(target)) {
-            fmt::print("Using cached AST\n");
+            printOut("Using cached AST\n");
             utils::File f{target.string()};
             auto id = f.read<uint32_t>();
             if (id != 0xba55a570) {
@@ -201,7 +217,7 @@ AstNode Parser::parse(std::string_view source, std::string_view file)
                 ast = loadAst(f);
                 rc = true;
             } else {
-                fmt::print("**Warn: Old grammar in AST\n");
+                printOut("**Warn: Old grammar in AST\n");
             }
         }
 
@@ -213,11 +229,16 @@ AstNode Parser::parse(std::string_view source, std::string_view file)
                     ruleMap[ruleNames[i]] = i;
                 }
                 if (useCache) {
-                    utils::File f{target.string(), utils::File::Mode::Write};
+                    // Write to a temporary file first, since other threads
+                    // or processes may be reading the same cache entry
+                    auto temp = target;
+                    temp += tempSuffix();
+                    utils::File f{temp.string(), utils::File::Mode::Write};
                     f.write<uint32_t>(0xba55a570);
                     f.write(grammarSHA.data(), 32);
                     saveAst(f, ast);
                     f.close();
+                    fs::rename(temp, target);
                 }
             }
         }
@@ -237,7 +258,7 @@ AstNode Parser::parse(std::string_view source, std::string_view file)
         currentError.file = file;
         return nullptr;
     } catch (peg::parse_error& e) {
-        fmt::print("## Unhandled Parse error: {}\n", e.what());
+        printOut("## Unhandled Parse error: {}\n", e.what());
         setError(e.what(), file, 0);
         return nullptr;
     }
@@ -269,15 +290,15 @@ std::any Parser::evaluate(AstNode const& node)
         if (ast->action != nullptr) {
             SemanticValues sv{ast};
             if (tracing) {
-                fmt::print("\n{} (line {}): "
-                           "'{}'\n-------------------------------------\n",
-                           sv.name(), ast->line, sv.token_view());
+                printOut("\n{} (line {}): "
+                         "'{}'\n-------------------------------------\n",
+                         sv.name(), ast->line, sv.token_view());
                 for (size_t i = 0; i < sv.size(); i++) {
                     std::any v = sv[i];
-                    fmt::print("  {}: {}\n", i, any_to_string(v));
+                    printOut("  {}: {}\n", i, any_to_string(v));
                 }
                 auto ret = callAction(sv, *ast->action);
-                fmt::print(">>  {}\n", any_to_string(ret));
+                printOut(">>  {}\n", any_to_string(ret));
                 return ret;
             }
             return callAction(sv, *ast->action);
@@ -53,6 +53,11 @@ public:
     std::string_view token_view() const;
     size_t size() const;
     std::string_view name() const;
+    // File the node was parsed from
+    std::string_view file_name() const;
+    // Storage attached to the node, that actions can use to keep
+    // results between passes.
+    std::any& cache() const;
 
     AstNode get_node() const { return ast; }
 
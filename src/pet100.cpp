@@ -304,13 +304,26 @@ void Pet100::writeReg(int reg, uint8_t val)
         if ((val & 1) != 0) {
             throw exit_exception();
         } else if ((val & 2) != 0) {
-            std::this_thread::sleep_until(nextUpdate);
-            doUpdate();
+            // Wait for the next frame
+            emu->clear_events();
+            std::this_thread::sleep_until(timeAt(nextFrame));
+            frame();
         }
         break;
     case IrqR:
         regs[IrqR] ^= val;
+        updateIrq();
         break;
+    case IrqE: {
+        auto enabled = ~regs[IrqE] & val;
+        regs[IrqE] = val;
+        if ((enabled & regs[IrqR]) != 0) {
+            // The PET100 IRQ vector is at $fffc
+            emu->irq(0xfffc);
+        }
+        updateIrq();
+        break;
+    }
     default:
         break;
     }
@@ -325,21 +338,44 @@ void Pet100::doUpdate()
 
     if ((~oldR & regs[IrqR]) != 0) {
         if ((regs[IrqR] & regs[IrqE]) != 0) {
-            emu->irq(emu->read_mem(0xfffc) | (emu->read_mem(0xfffd) << 8));
+            // The PET100 IRQ vector is at $fffc
+            emu->irq(0xfffc);
         }
     }
 }
 
+// The IRQ line is held until every enabled request is acknowledged
+void Pet100::updateIrq()
+{
+    if ((regs[IrqR] & regs[IrqE]) == 0) {
+        emu->clear_irq();
+    }
+}
+
+static void frameEvent(sixfive::Machine<>&, void* data)
+{
+    static_cast<Pet100*>(data)->frame();
+}
+
+void Pet100::frame()
+{
+    doUpdate();
+    nextFrame = emu->elapsed() + FrameCycles;
+    emu->schedule(nextFrame, &frameEvent, this);
+}
+
+Pet100::clk::time_point Pet100::timeAt(uint64_t cycles) const
+{
+    auto us = (cycles - startCycles) * 1000000 / ClockRate;
+    return start_t + std::chrono::microseconds(us);
+}
+
 bool Pet100::update()
 {
     try {
         auto cycles = emu->run(10000);
-        if (clk::now() >= nextUpdate) {
-            nextUpdate += 20ms;
-            doUpdate();
-        } else {
-            std::this_thread::sleep_for(1ms);
-        }
+        // Do not run ahead of real time
+        std::this_thread::sleep_until(timeAt(emu->elapsed()));
         return cycles != 0;
     } catch (exit_exception&) {
         return true;
@@ -369,6 +405,11 @@ void Pet100::load(uint16_t start, uint8_t const* ptr, size_t size) const
     emu->write_memory(start, ptr, size);
 }
 
+void Pet100::setProfile(sixfive::Profile* p)
+{
+    emu->set_profile(p);
+}
+
 void Pet100::start(uint16_t pc)
 {
     if (pc == 0x0801 && basicStart >= 0) {
@@ -379,7 +420,10 @@ void Pet100::start(uint16_t pc)
 
     emu->setPC(pc);
     start_t = clk::now();
-    nextUpdate = start_t + 10ms;
+    startCycles = emu->elapsed();
+    nextFrame = startCycles + FrameCycles / 2;
+    emu->clear_events();
+    emu->schedule(nextFrame, &frameEvent, this);
 }
 
 int Pet100::get_width() const
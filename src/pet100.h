@@ -9,6 +9,7 @@
 
 namespace sixfive {
 struct DefaultPolicy;
+struct Profile;
 template <class POLICY>
 struct Machine;
 } // namespace sixfive
@@ -23,6 +24,8 @@ struct exit_exception : public std::exception
 
 struct Pet100
 {
+    using clk = std::chrono::steady_clock;
+
     enum Regs
     {
         WinX,
@@ -72,6 +75,11 @@ struct Pet100
     int get_height() const;
 
     void doUpdate();
+    void updateIrq();
+    // Update the screen and schedule the next frame
+    void frame();
+    // When the emulator is due to reach `cycles`, running at `ClockRate`
+    clk::time_point timeAt(uint64_t cycles) const;
 
     uint8_t readReg(int reg);
     void writeReg(int reg, uint8_t val);
@@ -80,6 +88,10 @@ struct Pet100
     Pet100();
     ~Pet100();
 
+    // Emulated cycles per second, and per frame
+    static constexpr uint64_t ClockRate = 10000000;
+    static constexpr uint64_t FrameCycles = ClockRate / 50;
+
     void run(uint16_t start);
     void load(uint16_t start, uint8_t const* ptr, size_t size) const;
 
@@ -89,13 +101,14 @@ struct Pet100
     }
     void start(uint16_t pc);
     bool update();
+    void setProfile(sixfive::Profile* p);
     bool frozenTimer = false;
 
-    using clk = std::chrono::steady_clock;
-    
     clk::duration frozenTime;
 
     clk::time_point start_t;
-    clk::time_point nextUpdate;
+    // Cycles when started, and when the next frame is due
+    uint64_t startCycles = 0;
+    uint64_t nextFrame = 0;
 };
 
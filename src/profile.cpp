@@ -0,0 +1,173 @@
+#include "profile.h"
+#include "assembler.h"
+#include "emulator.h"
+#include "machine.h"
+#include "opcodes.h"
+
+#include <coreutils/file.h>
+#include <fmt/format.h>
+
+#include <algorithm>
+
+namespace {
+
+class Report
+{
+public:
+    Report(sixfive::Profile const& profile, Assembler& assem)
+        : profile(profile),
+          labels(assem.getLabels()),
+          lines(assem.getSourceLines()),
+          dis(assem.getMachine().dis)
+    {
+        auto cpu = assem.getMachine().is65C02() ? sixfive::opcodes::C65C02
+                                                : sixfive::opcodes::C6502;
+        mnemonics.fill("???");
+        for (auto const& def : sixfive::opcodes::opcodeDefs) {
+            if ((def.cpus & cpu) != 0) {
+                mnemonics[def.code] = def.name;
+            }
+        }
+    }
+
+    std::string write() const
+    {
+        auto text = fmt::format("{} cycles\n", profile.total);
+        text += flat();
+        text += callGraph();
+        text += instructionMix();
+        text += listing();
+        return text;
+    }
+
+private:
+    sixfive::Profile const& profile;
+    std::map<uint32_t, std::string> const& labels;
+    std::map<uint32_t, Assembler::SourceLine> const& lines;
+    std::map<uint32_t, std::string> const& dis;
+    std::array<const char*, 256> mnemonics{};
+
+    double percent(uint64_t part) const
+    {
+        return profile.total == 0 ? 0.0 : part * 100.0 / profile.total;
+    }
+
+    std::string nameOf(uint16_t adr) const
+    {
+        auto it = labels.find(adr);
+        return it != labels.end() ? it->second : fmt::format("${:04x}", adr);
+    }
+
+    std::string lineOf(uint16_t adr) const
+    {
+        auto it = lines.find(adr);
+        if (it == lines.end()) return "";
+        return fmt::format("{}:{}", it->second.file, it->second.line);
+    }
+
+    std::string flat() const
+    {
+        using Entry = std::pair<uint16_t, sixfive::Profile::Calls>;
+        std::vector<Entry> sorted(profile.functions.begin(),
+                                  profile.functions.end());
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [](Entry const& a, Entry const& b) {
+                             return a.second.exclusive > b.second.exclusive;
+                         });
+        std::string text = "\nFLAT PROFILE\n\n"
+                           "  self%   self cycles  total cycles     calls"
+                           "  subroutine\n";
+        for (auto const& [adr, fn] : sorted) {
+            text += fmt::format("{:6.2f}% {:13} {:13} {:9}  {} {}\n",
+                                percent(fn.exclusive), fn.exclusive,
+                                fn.inclusive, fn.calls, nameOf(adr),
+                                lineOf(adr));
+        }
+        return text;
+    }
+
+    std::string callGraph() const
+    {
+        std::string text = "\nCALL GRAPH\n";
+        for (auto const& [adr, fn] : profile.functions) {
+            text += fmt::format("\n{} {}: {} calls, {} cycles\n", nameOf(adr),
+                                lineOf(adr), fn.calls, fn.inclusive);
+            for (auto const& [edge, calls] : profile.edges) {
+                if (edge.second == adr) {
+                    text += fmt::format("    from {:24} {:9} calls {:13} "
+                                        "cycles\n",
+                                        nameOf(edge.first), calls.calls,
+                                        calls.inclusive);
+                }
+            }
+            for (auto const& [edge, calls] : profile.edges) {
+                if (edge.first == adr) {
+                    text += fmt::format("    to   {:24} {:9} calls {:13} "
+                                        "cycles\n",
+                                        nameOf(edge.second), calls.calls,
+                                        calls.inclusive);
+                }
+            }
+        }
+        return text;
+    }
+
+    std::string instructionMix() const
+    {
+        std::map<std::string, uint64_t> counts;
+        uint64_t total = 0;
+        for (size_t code = 0; code < profile.opcodes.size(); code++) {
+            if (profile.opcodes[code] != 0) {
+                counts[mnemonics[code]] += profile.opcodes[code];
+                total += profile.opcodes[code];
+            }
+        }
+        std::vector<std::pair<std::string, uint64_t>> sorted(counts.begin(),
+                                                             counts.end());
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [](auto const& a, auto const& b) {
+                             return a.second > b.second;
+                         });
+        std::string text = "\nINSTRUCTION MIX\n\n";
+        for (auto const& [name, count] : sorted) {
+            text += fmt::format("  {:4} {:13} {:6.2f}%\n", name, count,
+                                count * 100.0 / total);
+        }
+        return text;
+    }
+
+    std::string listing() const
+    {
+        std::string text = "\nANNOTATED LISTING\n\n"
+                           "        count        cycles  cycles%  address"
+                           "  instruction\n";
+        int32_t last = -1;
+        for (uint32_t adr = 0; adr < profile.counts.size(); adr++) {
+            auto count = profile.counts[adr];
+            if (count == 0) continue;
+            auto label = labels.find(adr);
+            if (label != labels.end()) {
+                text += fmt::format("{}:\n", label->second);
+            } else if (last >= 0 && adr > static_cast<uint32_t>(last) + 3) {
+                text += "\n";
+            }
+            auto it = dis.find(adr);
+            auto instruction = it != dis.end() ? it->second : "???";
+            text += fmt::format("{:13} {:13} {:7.2f}%  {:04x}     {:20} {}\n",
+                                count, profile.cycles[adr],
+                                percent(profile.cycles[adr]), adr,
+                                instruction, lineOf(adr));
+            last = static_cast<int32_t>(adr);
+        }
+        return text;
+    }
+};
+
+} // namespace
+
+void writeProfile(std::string const& fileName,
+                  sixfive::Profile const& profile, Assembler& assem)
+{
+    utils::File f{fileName, utils::File::Mode::Write};
+    f.writeString(Report(profile, assem).write());
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+
+class Assembler;
+namespace sixfive {
+struct Profile;
+} // namespace sixfive
+
+// Write a flat profile, a call graph, the instruction mix and an annotated
+// listing of all executed instructions to `fileName`. Addresses are named
+// from the labels and source lines `assem` kept while profiling.
+void writeProfile(std::string const& fileName,
+                  sixfive::Profile const& profile, Assembler& assem);
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+// How a relocated value is patched into section data
+enum class RelocKind : uint8_t
+{
+    Word, // 16 bit address, low byte first
+    Lo,   // Low byte of address (`<`)
+    Hi,   // High byte of address (`>`)
+    Rel   // Branch offset, relative to the next instruction
+};
+
+// When assembling an object file, addresses that are not known until link
+// time (labels in sections without a fixed start, and imported symbols)
+// are carried as `reloc::Value` instead of numbers. Adding or subtracting
+// plain numbers keeps the value relocatable, and the difference between
+// two labels in the same section becomes a plain number. Anything else
+// can not be expressed as a relocation and is an error.
+namespace reloc {
+
+// Targets below this are sections, others are imported symbols
+constexpr int32_t ImportBase = 2048;
+
+struct Value
+{
+    RelocKind kind;
+    int32_t target;
+    int32_t addend;
+
+    bool operator==(Value const& v) const
+    {
+        return kind == v.kind && target == v.target && addend == v.addend;
+    }
+    bool operator!=(Value const& v) const { return !(*this == v); }
+};
+
+} // namespace reloc
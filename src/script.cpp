@@ -47,7 +47,8 @@ function to_string( tbl )
 end
 )";
 
-Scripting::Scripting() : luap(std::make_unique<sol::state>()), lua(*luap)
+Scripting::Scripting(StringPool& strings_)
+    : luap(std::make_unique<sol::state>()), lua(*luap), strings(strings_)
 {
     lua.open_libraries(sol::lib::base, sol::lib::package, sol::lib::string,
                        sol::lib::math, sol::lib::table, sol::lib::debug);
@@ -58,6 +59,7 @@ Scripting::~Scripting() = default;
 
 void Scripting::load(fs::path const& p)
 {
+    sources += utils::File{p.string()}.readAllString();
     try {
         lua.do_file(p.string());
     } catch (sol::error& e) {
@@ -73,6 +75,7 @@ std::function<void()> Scripting::make_function(std::string_view code)
 
 void Scripting::add(std::string_view code)
 {
+    sources += code;
     try {
         auto res = lua.script(code);
         if (res.status() != sol::call_status::ok) {
@@ -97,9 +100,7 @@ std::any Scripting::to_any(sol::object const& obj)
     }
     if (obj.is<std::string>()) {
         auto s = obj.as<std::string>();
-        std::string_view sv = s;
-        persist(sv);
-        return std::any(sv);
+        return std::any(strings.intern(s));
     }
 
     if (obj.is<sol::table>()) {
@@ -127,7 +128,7 @@ std::any Scripting::to_any(sol::object const& obj)
             }
         });
         // TODO: If table was empty it will become symbols
-        return isVec ? std::any(vec) : std::any(syms);
+        return isVec ? std::any(Bytes(vec)) : std::any(syms);
     }
     return std::any();
 }
@@ -140,7 +141,7 @@ sol::object Scripting::to_object(std::any const& a)
     if (auto const* as = std::any_cast<std::string_view>(&a)) {
         return sol::make_object(lua, *as);
     }
-    if (auto const* av = std::any_cast<std::vector<uint8_t>>(&a)) {
+    if (auto const* av = std::any_cast<Bytes>(&a)) {
         // TODO: Can we sol make this 'value' conversion?
         // return sol::make_object(lua, *av);
         sol::table t = lua.create_table();
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "defines.h"
+#include "string_pool.h"
 
 #include <any>
 #include <functional>
@@ -22,11 +23,13 @@ private:
 class Scripting
 {
 public:
-    Scripting();
+    explicit Scripting(StringPool& strings);
     ~Scripting();
     void load(fs::path const& p);
     void add(std::string_view code);
     bool hasFunction(std::string_view name);
+    // All code loaded so far, so results that depend on it can be cached
+    std::string const& getSources() const { return sources; }
     std::any call(std::string_view name, std::vector<std::any> const& args);
 
     sol::state& getState() { return *luap; }
@@ -40,4 +43,6 @@ public:
 private:
     std::unique_ptr<sol::state> luap;
     sol::state& lua;
+    StringPool& strings;
+    std::string sources;
 };
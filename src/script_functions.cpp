@@ -22,7 +22,7 @@ void registerLuaFunctions(Assembler& a, Scripting& s)
             }
         }
         std::string result = fmt::vformat(f, store);
-        puts(result.c_str());
+        printOut("{}\n", result);
     };
 
     lua["sym"] = [&](std::string const& name) {
@@ -45,3 +45,115 @@ TEST_CASE("sections.basic", "[sections]")
     REQUIRE(utils.start == 0x1000 + 0x200 + 0x50);
     REQUIRE(b.start == 0x1000 + 0x200 + 0x20);
 }
+
+TEST_CASE("sections.overlap", "[sections]")
+{
+    Machine m;
+
+    auto& a = m.addSection({"a", 0x1000});
+    auto& b = m.addSection({"b", 0x1080});
+    auto& c = m.addSection({"c", 0x1100});
+    auto& d = m.addSection({"d", 0x2000});
+
+    a.data = std::vector<uint8_t>(0x100);
+    b.data = std::vector<uint8_t>(0x100);
+    c.data = std::vector<uint8_t>(0x10);
+    d.data = std::vector<uint8_t>(0x10);
+
+    auto errors = m.checkOverlap();
+    REQUIRE(errors.size() == 2);
+    REQUIRE(errors[0].message == "Section b overlaps a");
+    REQUIRE(errors[1].message == "Section c overlaps b");
+
+    m.removeSection("b");
+    REQUIRE(m.checkOverlap().empty());
+    REQUIRE(m.getSection("d").start == 0x2000);
+    REQUIRE_THROWS(m.getSection("b"));
+}
+
+TEST_CASE("sections.floating", "[sections]")
+{
+    Machine m;
+
+    m.addRegion(0x1000, 0x1100);
+    m.addRegion(0x2000, 0x2400);
+
+    auto& fixed = m.addSection({"fixed", 0x2000});
+    fixed.data = std::vector<uint8_t>(0x80);
+
+    Section args{"a", ""};
+    args.flags = Floating;
+    auto& a = m.addSection(args);
+    args.name = "b";
+    args.align = 0x100;
+    auto& b = m.addSection(args);
+    args.name = "c";
+    args.align = 0;
+    auto& c = m.addSection(args);
+
+    REQUIRE(a.start == 0x1000);
+
+    a.data = std::vector<uint8_t>(0xf0);
+    b.data = std::vector<uint8_t>(0x200);
+    c.data = std::vector<uint8_t>(0x10);
+
+    REQUIRE(!m.layoutSections());
+    REQUIRE(b.start == 0x2100);
+    REQUIRE(a.start == 0x1000);
+    REQUIRE(c.start == 0x10f0);
+    REQUIRE(m.checkOverlap().empty());
+
+    // Same sizes give the same placement
+    REQUIRE(m.layoutSections());
+
+    // Not fitting is an error once the sizes are stable
+    c.data = std::vector<uint8_t>(0x400);
+    REQUIRE(!m.layoutSections());
+    REQUIRE_THROWS(m.layoutSections());
+}
+
+TEST_CASE("sections.floating_late_fit", "[sections]")
+{
+    Machine m;
+
+    m.addRegion(0x1000, 0x1100);
+
+    // Early passes may overestimate, leaving no room at first
+    auto& fixed = m.addSection({"fixed", 0x1000});
+    fixed.data = std::vector<uint8_t>(0x100);
+
+    Section args{"f", ""};
+    args.flags = Floating;
+    auto& f = m.addSection(args);
+    f.data = std::vector<uint8_t>(0x20);
+    auto start = f.start;
+
+    REQUIRE(!m.layoutSections());
+    REQUIRE(f.start == start);
+
+    fixed.data = std::vector<uint8_t>(0x80);
+    REQUIRE(!m.layoutSections());
+    REQUIRE(f.start == 0x1080);
+    REQUIRE(m.layoutSections());
+    REQUIRE(m.checkOverlap().empty());
+}
+
+TEST_CASE("sections.bytes", "[sections]")
+{
+    Machine m;
+    auto& a = m.addSection({"a", 0x1000});
+    m.setSection("a");
+    m.writeByte(1);
+    REQUIRE(a.bytes()[0] == 1);
+
+    // A new pass writing the same amount of data
+    m.clear();
+    m.setSection("a");
+    m.writeByte(2);
+    REQUIRE(a.bytes()[0] == 2);
+
+    // Patching in place
+    a.data[0] = 3;
+    a.changed();
+    REQUIRE(a.bytes()[0] == 3);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+// Arena for strings created during assembly (concatenations, function
+// results etc) that need to outlive the expression that created them.
+// Each distinct string is stored only once, so two interned strings are
+// equal if and only if their data pointers are equal.
+class StringPool
+{
+public:
+    std::string_view intern(std::string_view s)
+    {
+        auto it = strings.find(s);
+        if (it != strings.end()) {
+            return *it;
+        }
+        auto sv = store(s);
+        strings.insert(sv);
+        return sv;
+    }
+
+    // Check if `s` points into memory owned by this pool
+    bool owns(std::string_view s) const
+    {
+        auto inside = [&](Chunk const& c) {
+            return s.data() >= c.data.get() &&
+                   s.data() + s.size() <= c.data.get() + c.size;
+        };
+        return std::any_of(chunks.begin(), chunks.end(), inside) ||
+               std::any_of(large.begin(), large.end(), inside);
+    }
+
+    size_t size() const { return strings.size(); }
+
+    // Free all strings. Any views returned by `intern()` are invalidated.
+    void clear()
+    {
+        strings.clear();
+        chunks.clear();
+        large.clear();
+        used = 0;
+    }
+
+private:
+    static constexpr size_t ChunkSize = 16 * 1024;
+
+    struct Chunk
+    {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    std::string_view store(std::string_view s)
+    {
+        char* ptr = nullptr;
+        if (s.size() > ChunkSize / 4) {
+            // Large strings get a chunk of their own
+            large.push_back({std::make_unique<char[]>(s.size()), s.size()});
+            ptr = large.back().data.get();
+        } else {
+            if (chunks.empty() || used + s.size() > ChunkSize) {
+                chunks.push_back(
+                    {std::make_unique<char[]>(ChunkSize), ChunkSize});
+                used = 0;
+            }
+            ptr = chunks.back().data.get() + used;
+            used += s.size();
+        }
+        if (!s.empty()) {
+            memcpy(ptr, s.data(), s.size());
+        }
+        return {ptr, s.size()};
+    }
+
+    std::vector<Chunk> chunks;
+    std::vector<Chunk> large;
+    size_t used = 0;
+    std::unordered_set<std::string_view> strings;
+};
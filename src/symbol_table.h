@@ -9,6 +9,7 @@
 #include <optional>
 #include <set>
 #include <string>
+#include <typeindex>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -52,6 +53,15 @@ struct SymbolTable
     bool trace = false;
     bool undef_ok = true;
 
+    // Values returned by reference from `get()` for symbols that are
+    // not in the table. Kept per table so tables can be used from
+    // different threads.
+    std::any temp;
+    std::any zero;
+    // One default per type, so references returned earlier stay valid
+    std::unordered_map<std::type_index, std::any> defaults;
+    AnyMap cres;
+
     bool is_constant(std::string_view name) const {
         if(auto sym = get_sym(name)) {
             return sym->final;
@@ -184,10 +194,6 @@ struct SymbolTable
     template <typename T = std::any>
     T& get(std::string_view name)
     {
-        static std::any temp;
-        static T empty;
-        static std::any zero(0.0);
-        static AnyMap cres;
         accessed.insert(std::string(name));
         if constexpr (std::is_same_v<T, AnyMap>) {
             auto s = std::string(name);
@@ -216,10 +222,18 @@ struct SymbolTable
             }
             undefined.insert(s);
             if constexpr (std::is_same_v<T, std::any>) {
+                zero = 0.0;
                 return zero;
             }
             LOGD("Returning default (%s)", typeid(T{}).name());
-            return empty;
+            auto& slot = defaults[std::type_index(typeid(T))];
+            if (!slot.has_value()) {
+                slot.emplace<T>();
+            }
+            auto& value = *std::any_cast<T>(&slot);
+            // Callers may have changed it
+            value = T{};
+            return value;
         }
         if (it->second.value.type() == typeid(AnyMap)) {
             LOGE("MAP %s in table!!", name);
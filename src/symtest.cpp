@@ -44,6 +44,12 @@ TEST_CASE("symbol_table.basic", "[symbols]")
     REQUIRE(st.get<float>("not_here") == 0.0);
     REQUIRE(!st.undefined.empty());
 
+    // Defaults for missing symbols stay valid through later lookups
+    auto& missing = st.get<std::string>("not_here");
+    REQUIRE(st.get<float>("not_here") == 0.0);
+    REQUIRE(&st.get<std::string>("not_here") == &missing);
+    REQUIRE(missing.empty());
+
     //REQUIRE(st.is_constant("not_here"));
 
     AnyMap s;
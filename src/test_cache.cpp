@@ -0,0 +1,122 @@
+#include "test_cache.h"
+
+#include <coreutils/file.h>
+#include <fmt/format.h>
+
+extern "C"
+{
+#include <sha512.h>
+}
+
+#include <algorithm>
+
+static constexpr uint32_t TestMagic = 0xba557e59;
+
+std::string TestCache::makeKey(std::string const& inputs)
+{
+    std::array<uint8_t, SHA512_DIGEST_LENGTH> sha; // NOLINT
+    SHA512(reinterpret_cast<const uint8_t*>(inputs.data()), inputs.size(),
+           sha.data());
+    std::string key;
+    for (size_t i = 0; i < 32; i++) {
+        key += fmt::format("{:02x}", sha[i]);
+    }
+    return key;
+}
+
+std::optional<RunResult> TestCache::find(std::string const& key,
+                                         MemSnapshot const& image) const
+{
+    auto path = dir / key;
+    if (!fs::exists(path)) {
+        return std::nullopt;
+    }
+    // Broken entries are treated as missing
+    try {
+        utils::File f{path.string()};
+        if (f.read<uint32_t>() != TestMagic) {
+            return std::nullopt;
+        }
+
+        std::array<uint8_t, 256> contents{};
+        auto count = f.read<uint32_t>();
+        for (uint32_t i = 0; i < count; i++) {
+            auto offset = f.read<uint8_t>() * 256;
+            if (f.read(contents.data(), 256) != 256 ||
+                !std::equal(contents.begin(), contents.end(),
+                            image->begin() + offset)) {
+                return std::nullopt;
+            }
+        }
+
+        RunResult result;
+        result.base = image;
+        result.cycles = f.read<uint32_t>();
+        for (auto& r : result.regs) {
+            r = f.read<uint32_t>();
+        }
+        auto changed = f.read<uint32_t>();
+        if (changed > 256) {
+            return std::nullopt;
+        }
+        result.pages.resize(changed);
+        for (auto& [page, data] : result.pages) {
+            page = f.read<uint8_t>();
+            if (f.read(data.data(), 256) != 256) {
+                return std::nullopt;
+            }
+        }
+        auto covered = f.read<uint32_t>();
+        if (covered > 0x6000) {
+            return std::nullopt;
+        }
+        result.covered.resize(covered);
+        for (auto& [offset, bits] : result.covered) {
+            offset = f.read<uint16_t>();
+            bits = f.read<uint8_t>();
+        }
+        return result;
+    } catch (utils::io_exception&) {
+        return std::nullopt;
+    }
+}
+
+void TestCache::store(std::string const& key, RunResult const& result) const
+{
+    // Changed pages are stored whole, so their old contents must match too
+    std::vector<uint8_t> inputs = result.reads;
+    for (auto const& p : result.pages) {
+        inputs.push_back(p.first);
+    }
+    std::sort(inputs.begin(), inputs.end());
+    inputs.erase(std::unique(inputs.begin(), inputs.end()), inputs.end());
+
+    fs::create_directories(dir);
+    auto target = dir / key;
+    // Tests may be stored from several processes at once
+    auto temp = target;
+    temp += tempSuffix();
+    utils::File f{temp.string(), utils::File::Mode::Write};
+    f.write<uint32_t>(TestMagic);
+    f.write<uint32_t>(inputs.size());
+    for (auto page : inputs) {
+        f.write<uint8_t>(page);
+        f.write(result.base->data() + page * 256, 256);
+    }
+    f.write<uint32_t>(result.cycles);
+    for (auto r : result.regs) {
+        f.write<uint32_t>(r);
+    }
+    f.write<uint32_t>(result.pages.size());
+    for (auto const& [page, data] : result.pages) {
+        f.write<uint8_t>(page);
+        f.write(data.data(), data.size());
+    }
+    f.write<uint32_t>(result.covered.size());
+    for (auto [offset, bits] : result.covered) {
+        f.write<uint16_t>(offset);
+        f.write<uint8_t>(bits);
+    }
+    f.close();
+    fs::rename(temp, target);
+}
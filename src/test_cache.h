@@ -0,0 +1,27 @@
+#pragma once
+
+#include "defines.h"
+
+#include <optional>
+#include <string>
+
+// Results of `!test` runs, kept on disk between builds. Entries are found
+// from a hash of everything except memory that a test depends on, and
+// are only used if the memory pages the test read or changed still have
+// the same contents.
+class TestCache
+{
+public:
+    explicit TestCache(fs::path dir) : dir(std::move(dir)) {}
+
+    // Hash the non memory inputs of a test into a key
+    static std::string makeKey(std::string const& inputs);
+
+    std::optional<RunResult> find(std::string const& key,
+                                  MemSnapshot const& image) const;
+    // Store a result. Its `base` must be the memory the test started from.
+    void store(std::string const& key, RunResult const& result) const;
+
+private:
+    fs::path dir;
+};
@@ -0,0 +1,25 @@
+
+    !region $1000, $1100
+    !region $2000, $2400
+
+    !section "fixed", $2000
+    !fill $80
+
+    !section "big", Float=true, align=$100 {
+big:
+    !fill $200
+    }
+
+    !section "small", Float=true {
+small:
+    !fill $f0
+    }
+
+    !section "tiny", Float=true {
+tiny:
+    rts
+    }
+
+    !assert big == $2100
+    !assert small == $1000
+    !assert tiny == $10f0